@@ -12,10 +12,14 @@
 /**************************************************************************/
 
 
+#ifdef __linux__
+#define _GNU_SOURCE		 // sendmmsg()
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -47,7 +51,102 @@ extern char verb;
 
 // variable externa que muestra el número de timeouts vencidos
 // Uso: Comparar con otra variable inicializada a 0; si son distintas, tratar un timeout e incrementar en uno la otra variable
-extern volatile const int timeouts_vencidos;
+extern POR_HILO const int timeouts_vencidos;
+
+// tamaño de segmento propuesto al servidor (versión 2); 0: versión 1
+static unsigned int segpropuesto = 0;
+
+// flujo de una transferencia en paralelo (-n): primer byte de su rango e identificador
+static struct
+{
+	char activo;
+	uint32_t inicio;
+	uint32_t id;
+} flujo;
+
+// anuncio del tamaño del fichero (-l), pendiente de enviar tras la primera ráfaga
+static struct
+{
+	char pendiente;
+	uint32_t tamano;
+} anuncio;
+
+// enviar las ráfagas con segmentación en el kernel (UDP GSO)
+static char usagso = 0;
+
+// el servidor ha respondido con F_COMPACTO: ya se puede enviar en formato compacto
+static char compacto = 0;
+
+// relleno a ceros de los mensajes en formato fijo cuyos datos no están en el propio mensaje
+static uint8_t relleno[RCFTP_BUFLEN];
+
+// estimador del tiempo de expiración (Jacobson/Karels), en microsegundos
+static struct
+{
+	long srtt;				// RTT suavizado; 0: aún sin muestras
+	long rttvar;			// variación del RTT
+	unsigned long rto;		// tiempo de expiración estimado, sin backoff
+	int backoff;			// veces que se ha duplicado el RTO desde la última confirmación de datos nuevos
+	char midiendo;			// hay un mensaje en vuelo cuyo RTT se está midiendo
+	uint32_t inicio, fin;	// datos del mensaje medido
+	struct timespec envio;	// hora de envío del mensaje medido
+	struct timespec ultimobackoff;	// hora del último backoff
+} rto;
+
+// control de congestión (slow start + AIMD), en bytes
+static struct
+{
+	unsigned long cwnd;		// ventana de congestión
+	unsigned long ssthresh;	// umbral entre slow start y crecimiento lineal
+	unsigned long maxima;	// tamaño de la ventana de emisión (-w)
+} congestion;
+
+// control de congestión por ritmo de entrega (-c) en lugar de por pérdidas
+static char usaritmo = 0;
+
+// envío de datos nuevos, para muestrear el ritmo de entrega cuando se confirme
+struct envio
+{
+	uint32_t inicio, fin;	// datos enviados [inicio,fin)
+	uint64_t t;				// hora de envío (ns)
+	uint64_t entregado;		// bytes entregados hasta el envío
+	uint64_t tentregado;	// hora de la última entrega antes del envío (ns)
+	char confirmado;
+	char reenviado;			// reenviado: su muestra es ambigua (Karn)
+};
+
+// modelo del camino: ancho de banda del cuello de botella y RTT mínimo (tiempos en ns)
+static struct
+{
+	struct envio envios[MAXENVIOS];	// envíos sin confirmar, en orden de numseq
+	int primero, n;
+	uint64_t envuelo;		// bytes nuevos enviados y sin confirmar
+	uint64_t entregado;		// bytes confirmados desde el inicio
+	uint64_t tentregado;	// hora de la última confirmación
+	struct envio *muestra;	// envío más reciente confirmado en la respuesta en proceso
+	uint64_t bwronda[RONDASBW];	// máximo ritmo de entrega (bytes/s) de cada una de las últimas rondas
+	uint64_t btlbw;			// ancho de banda estimado (máximo de bwronda); 0: sin muestras
+	uint64_t minrtt, tminrtt;	// RTT mínimo y hora en que se midió
+	uint64_t ronda, finronda;	// ronda (un RTT) actual, y entregado al que empieza la siguiente
+	uint64_t bwlleno;		// ancho de banda al que se estancó el arranque
+	int rondaslleno;		// rondas seguidas sin crecer un 25%
+	int fase;				// RITMO_ARRANQUE, RITMO_VACIADO o fase del ciclo de sondeo
+	uint64_t tfase;			// hora de inicio de la fase
+	uint64_t siguienteenvio;	// hora a partir de la que se puede enviar
+	int timer;				// timer de espera del ritmo, o -1
+} ritmo;
+
+// reenvío rápido tras confirmaciones duplicadas (-f) y fase de recuperación
+static struct
+{
+	int umbral;				// confirmaciones duplicadas que indican una pérdida; 0: desactivado
+	int duplicados;			// confirmaciones duplicadas seguidas
+	char recuperando;		// hasta confirmar recuperar: 1 recuperación rápida, 2 tras un timeout
+	uint32_t recuperar;		// nextseq al detectar la pérdida
+} rapido = {REENVIO_RAPIDO, 0, 0, 0};
+
+// ganancias del ritmo de envío en cada fase del ciclo de sondeo del ancho de banda
+static const double gananciaciclo[FASESCICLO] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
 
 
 /**************************************************************************/
@@ -56,13 +155,20 @@ extern volatile const int timeouts_vencidos;
 
 int okMsg(struct rcftp_msg *msg, ssize_t len)
 {
-    // Comprobamos la versión
-    if (msg->version != RCFTP_VERSION_1) {
+    // Comprobamos la versión: la misma que usamos al enviar
+    if (msg->version != (segpropuesto ? RCFTP_VERSION_2 : RCFTP_VERSION_1)) {
         if (verb)
 			printf("Versión incorrecta: %d\n", msg->version);
         return 0;
     }
 
+    // Comprobamos que la longitud corresponda al formato compacto o al fijo
+    if (!islenvalid(msg, len)) {
+        if (verb)
+			printf("Longitud incorrecta: %zd\n", len);
+        return 0;
+    }
+
     // Comprobamos el checksum usando issumvalid
     if (!issumvalid(msg, len)) {
         if (verb) 
@@ -70,6 +176,13 @@ int okMsg(struct rcftp_msg *msg, ssize_t len)
         return 0;
     }
 
+    // Un servidor que acepta el formato compacto lo indica con F_COMPACTO
+    if ((msg->flags & F_COMPACTO) && !compacto) {
+        if (verb)
+			printf("El servidor acepta el formato compacto\n");
+        compacto = 1;
+    }
+
     // Si pasa ambas comprobaciones, el mensaje es válido
     return 1;
 }
@@ -96,6 +209,692 @@ int okResp(struct rcftp_msg *sent, struct rcftp_msg *received)
 	return 1;
 }
 
+int okRespVentana(struct rcftp_msg *received, uint32_t base, uint32_t nextseq, int finSent)
+{
+	uint32_t next = ntohl(received->next);
+
+	// Comprobamos que no tenga flags de ocupado ni de abortar
+	if((received->flags & (F_BUSY | F_ABORT)) != 0)
+		return 0;
+
+	// Confirmación del F_FIN: todo recibido y flag F_FIN presente
+	if(finSent && next == nextseq && (received->flags & F_FIN))
+		return 1;
+
+	// El next debe confirmar al menos un byte de la ventana: base < next <= nextseq
+	if((uint32_t)(next - base - 1) >= (uint32_t)(nextseq - base))
+		return 0;
+
+	return 1;
+}
+
+int okRespRepSel(struct rcftp_msg *received, uint32_t base, uint32_t nextseq)
+{
+	uint32_t next = ntohl(received->next);
+
+	// Comprobamos que no tenga flags de ocupado ni de abortar
+	if((received->flags & (F_BUSY | F_ABORT)) != 0)
+		return 0;
+
+	// El next no puede quedar fuera de la ventana: base <= next <= nextseq
+	// (next == base es válido: la respuesta puede confirmar datos fuera de orden)
+	if((uint32_t)(next - base) > (uint32_t)(nextseq - base))
+		return 0;
+
+	return 1;
+}
+
+void buildMsg(struct rcftp_msg *msg, uint32_t numseq, uint16_t len, uint8_t flags, uint16_t sumadatos)
+{
+	msg->flags = flags | F_COMPACTO;	// todos los mensajes ofrecen el formato compacto
+	msg->numseq = htonl(numseq);
+	if(segpropuesto)
+	{
+		// versión 2: next lleva el tamaño de segmento propuesto
+		msg->version = RCFTP_VERSION_2;
+		msg->next = htonl(segpropuesto);
+	}
+	else
+	{
+		msg->version = RCFTP_VERSION_1;
+		msg->next = htonl(0);
+	}
+	if(flujo.activo && numseq == flujo.inicio && !(flags & F_FIN))
+	{
+		// el primer mensaje del rango identifica la transferencia, en lugar de proponer segmento
+		msg->flags |= F_FLUJO;
+		msg->next = htonl(flujo.id);
+	}
+	msg->len = htons(len);
+	// solo sumamos las cabeceras: la suma de los datos se calculó al copiarlos
+	msg->sum = xsummensaje(msg, sumadatos);
+}
+
+void setSegPropuesto(unsigned int segmento)
+{
+	segpropuesto = (segmento > RCFTP_BUFLEN) ? segmento : 0;
+}
+
+void setFlujo(uint32_t inicio, uint32_t id)
+{
+	flujo.activo = 1;
+	flujo.inicio = inicio;
+	flujo.id = id;
+}
+
+void setTamano(uint32_t tamano)
+{
+	anuncio.pendiente = 1;
+	anuncio.tamano = tamano;
+}
+
+void anunciarTamano(int socket, struct addrinfo *servinfo)
+{
+	struct rcftp_msg msg;
+
+	if(!anuncio.pendiente)
+		return;
+	anuncio.pendiente = 0;
+	// mensaje sin datos, sin F_FLUJO y sin respuesta: next lleva el tamaño, no un segmento propuesto
+	msg.version = segpropuesto ? RCFTP_VERSION_2 : RCFTP_VERSION_1;
+	msg.flags = F_TAMANO | F_COMPACTO;
+	msg.numseq = htonl(flujo.inicio);
+	msg.next = htonl(anuncio.tamano);
+	msg.len = htons(0);
+	msg.sum = xsummensaje(&msg, 0);
+	sendMsg(socket, servinfo, &msg);
+}
+
+void setGSO(char gso)
+{
+#if defined(__linux__) && defined(UDP_SEGMENT)
+	usagso = gso;
+#else
+	if(gso)
+		fprintf(stderr, "UDP GSO no disponible en este sistema: se envía cada mensaje por separado\n");
+#endif
+}
+
+int segNegociado(struct rcftp_msg *received, int seglen, int window)
+{
+	uint32_t aceptado;
+
+	if(received->version != RCFTP_VERSION_2)
+		return seglen;
+
+	// el servidor indica en numseq el tamaño de segmento que acepta
+	aceptado = ntohl(received->numseq);
+	if(aceptado > segpropuesto)
+		aceptado = segpropuesto;
+	if(aceptado > (uint32_t)window)
+		aceptado = window;
+	if(aceptado > (uint32_t)seglen && verb)
+		printf("Tamaño de segmento negociado con el servidor: %u bytes\n", aceptado);
+	return (aceptado > (uint32_t)seglen) ? (int)aceptado : seglen;
+}
+
+void initRafaga(struct rafaga *r, int maxlen)
+{
+	// en formato fijo, cada mensaje ocupa al menos RCFTP_BUFLEN bytes de datos
+	r->tammsg = RCFTP_HDRLEN + ((maxlen > RCFTP_BUFLEN) ? maxlen : RCFTP_BUFLEN);
+	r->n = 0;
+	r->buffer = malloc(MAXRAFAGA * r->tammsg);
+	if(r->buffer == NULL)
+	{
+		perror("Error al reservar memoria para la ráfaga de mensajes");
+		exit(1);
+	}
+}
+
+struct rcftp_msg *msgRafaga(struct rafaga *r, int i)
+{
+	return (struct rcftp_msg *)&r->buffer[i * r->tammsg];
+}
+
+void initRTO(unsigned long inicial)
+{
+	rto.srtt = 0;
+	rto.rttvar = 0;
+	rto.rto = (inicial < RTO_MIN) ? RTO_MIN : (inicial > RTO_MAX) ? RTO_MAX : inicial;
+	rto.backoff = 0;
+	rto.midiendo = 0;
+	rto.ultimobackoff.tv_sec = 0;
+	rto.ultimobackoff.tv_nsec = 0;
+}
+
+void medirRTT(uint32_t numseq, uint16_t len)
+{
+	// un solo mensaje medido a la vez; los de longitud 0 no se distinguen en las respuestas
+	if(rto.midiendo || len == 0)
+		return;
+	rto.midiendo = 1;
+	rto.inicio = numseq;
+	rto.fin = numseq + len;
+	clock_gettime(CLOCK_MONOTONIC, &rto.envio);
+}
+
+void ackRTT(uint32_t inicio, uint32_t fin)
+{
+	struct timespec ahora;
+	long muestra, error;
+
+	// se han confirmado datos nuevos: la red vuelve a entregar y se anula el backoff;
+	// sin muestras aún, el RTO inicial era demasiado corto y se mantiene duplicado (Karn)
+	if(rto.srtt == 0)
+		rto.rto = getRTO();
+	rto.backoff = 0;
+	// la muestra solo es válida si los datos confirmados [inicio,fin) incluyen los del mensaje medido
+	if(!rto.midiendo || (uint32_t)(rto.inicio - inicio) >= 0x80000000u || (uint32_t)(rto.fin - inicio) > (uint32_t)(fin - inicio))
+		return;
+	rto.midiendo = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ahora);
+	muestra = (ahora.tv_sec - rto.envio.tv_sec) * 1000000 + (ahora.tv_nsec - rto.envio.tv_nsec) / 1000;
+	if(muestra <= 0)
+		muestra = 1;
+	if(rto.srtt == 0)
+	{
+		rto.srtt = muestra;
+		rto.rttvar = muestra / 2;
+	}
+	else
+	{
+		// rttvar ← 3/4 rttvar + 1/4 |srtt - muestra|; srtt ← 7/8 srtt + 1/8 muestra
+		error = muestra - rto.srtt;
+		rto.rttvar += ((error < 0 ? -error : error) - rto.rttvar) / 4;
+		rto.srtt += error / 8;
+	}
+	rto.rto = rto.srtt + 4 * rto.rttvar;
+	if(rto.rto < RTO_MIN)
+		rto.rto = RTO_MIN;
+	else if(rto.rto > RTO_MAX)
+		rto.rto = RTO_MAX;
+	if(verb)
+		printf("RTT medido: %ld us (SRTT=%ld us, RTTVAR=%ld us, RTO=%lu us)\n", muestra, rto.srtt, rto.rttvar, rto.rto);
+}
+
+void reenvioRTT(uint32_t numseq, uint16_t len)
+{
+	// algoritmo de Karn: el RTT de un mensaje reenviado es ambiguo
+	if(rto.midiendo && ((uint32_t)(numseq - rto.inicio) < (uint32_t)(rto.fin - rto.inicio)
+			|| (uint32_t)(rto.inicio - numseq) < (uint32_t)len))
+		rto.midiendo = 0;
+}
+
+int backoffRTO()
+{
+	struct timespec ahora;
+
+	// los timeouts que vencen menos de un RTO después del último backoff (p. ej. los
+	// pendientes de procesar) son de la misma pérdida y no lo vuelven a duplicar
+	clock_gettime(CLOCK_MONOTONIC, &ahora);
+	if((ahora.tv_sec - rto.ultimobackoff.tv_sec) * 1000000 + (ahora.tv_nsec - rto.ultimobackoff.tv_nsec) / 1000 < (long)getRTO())
+		return 0;
+	rto.ultimobackoff = ahora;
+	if(getRTO() < RTO_MAX)
+		rto.backoff++;
+	return 1;
+}
+
+unsigned long getRTO()
+{
+	if(rto.rto > (RTO_MAX >> rto.backoff))
+		return RTO_MAX;
+	return rto.rto << rto.backoff;
+}
+
+// traslada la ventana de congestión a la ventana de emisión (al menos un segmento)
+static void aplicarCongestion(int seglen)
+{
+	seteffectivewindow((congestion.cwnd < (unsigned long)seglen) ? (unsigned long)seglen : congestion.cwnd);
+}
+
+static uint64_t ahorans()
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// ganancia del ritmo de envío en la fase actual
+static double gananciaritmo()
+{
+	if(ritmo.fase == RITMO_ARRANQUE)
+		return GANANCIA_ARRANQUE;
+	if(ritmo.fase == RITMO_VACIADO)
+		return 1 / GANANCIA_ARRANQUE;
+	return gananciaciclo[ritmo.fase];
+}
+
+// actualiza el modelo del camino con la respuesta en proceso y deriva de él la ventana
+static void modeloRitmo(unsigned long confirmados, int seglen)
+{
+	uint64_t ahora = ahorans(), bw, bdp, rtt, anterior;
+	struct envio *e = ritmo.muestra;
+	int i;
+
+	if(confirmados > 0)
+	{
+		ritmo.entregado += confirmados;
+		ritmo.tentregado = ahora;
+	}
+	ritmo.muestra = NULL;
+	if(e != NULL)
+	{
+		// RTT y ritmo de entrega desde el envío del dato confirmado más reciente
+		rtt = ahora - e->t;
+		if(ritmo.minrtt == 0 || rtt < ritmo.minrtt || ahora - ritmo.tminrtt > VALIDEZ_MINRTT)
+		{
+			ritmo.minrtt = rtt;
+			ritmo.tminrtt = ahora;
+		}
+		if(e->entregado >= ritmo.finronda)
+		{
+			// todo lo enviado al empezar la ronda ya está entregado: empieza otra
+			ritmo.ronda++;
+			ritmo.finronda = ritmo.entregado;
+			ritmo.bwronda[ritmo.ronda % RONDASBW] = 0;
+			if(ritmo.fase == RITMO_ARRANQUE && ritmo.btlbw > 0)
+			{
+				// el arranque acaba cuando el ancho de banda deja de crecer un 25% en 3 rondas
+				if(ritmo.btlbw >= ritmo.bwlleno * 5 / 4)
+				{
+					ritmo.bwlleno = ritmo.btlbw;
+					ritmo.rondaslleno = 0;
+				}
+				else if(++ritmo.rondaslleno >= 3)
+				{
+					ritmo.fase = RITMO_VACIADO;
+					if(verb)
+						printf("Ritmo: fin del arranque (ancho de banda %lu bytes/s, RTT mínimo %lu us)\n", (unsigned long)ritmo.btlbw, (unsigned long)(ritmo.minrtt / 1000));
+				}
+			}
+		}
+		if(ahora > e->tentregado)
+		{
+			bw = (ritmo.entregado - e->entregado) * 1000000000 / (ahora - e->tentregado);
+			if(bw > ritmo.bwronda[ritmo.ronda % RONDASBW])
+				ritmo.bwronda[ritmo.ronda % RONDASBW] = bw;
+			anterior = ritmo.btlbw;
+			for(ritmo.btlbw = 0, i = 0; i < RONDASBW; i++)
+				if(ritmo.bwronda[i] > ritmo.btlbw)
+					ritmo.btlbw = ritmo.bwronda[i];
+			// la espera pendiente se calculó con el ancho de banda anterior: si ha crecido, se acorta
+			// (con una primera estimación muy baja la espera acumulada podría durar minutos)
+			if(anterior > 0 && ritmo.btlbw > anterior && ritmo.siguienteenvio > ahora)
+			{
+				ritmo.siguienteenvio = ahora + (uint64_t)((double)(ritmo.siguienteenvio - ahora) * anterior / ritmo.btlbw);
+				if(ritmo.timer >= 0)
+				{
+					canceltimer(ritmo.timer);
+					ritmo.timer = -1;
+				}
+			}
+		}
+	}
+
+	// los envíos confirmados ya no hacen falta
+	while(ritmo.n > 0 && ritmo.envios[ritmo.primero].confirmado)
+	{
+		ritmo.primero = (ritmo.primero + 1) % MAXENVIOS;
+		ritmo.n--;
+	}
+	if(ritmo.btlbw == 0)
+	{
+		// sin muestras todavía (p.ej. todo reenviado): ventana inicial, pero con el segmento
+		// ya negociado, o una ventana menor que el segmento no dejaría enviar nada
+		if(congestion.cwnd < CWND_INICIAL * (unsigned long)seglen)
+			congestion.cwnd = (CWND_INICIAL * (unsigned long)seglen < congestion.maxima) ? CWND_INICIAL * (unsigned long)seglen : congestion.maxima;
+		aplicarCongestion(seglen);
+		return;
+	}
+
+	// ventana: el producto ancho de banda-retardo, con margen para las confirmaciones agrupadas
+	bdp = ritmo.btlbw * ritmo.minrtt / 1000000000;
+	if(ritmo.fase == RITMO_VACIADO && ritmo.envuelo <= bdp)
+	{
+		ritmo.fase = 0;
+		ritmo.tfase = ahora;
+	}
+	else if(ritmo.fase >= 0 && ahora - ritmo.tfase > ritmo.minrtt)
+	{
+		ritmo.fase = (ritmo.fase + 1) % FASESCICLO;
+		ritmo.tfase = ahora;
+	}
+	congestion.cwnd = (ritmo.fase == RITMO_ARRANQUE ? GANANCIA_ARRANQUE : GANANCIA_VENTANA) * bdp;
+	if(congestion.cwnd < CWND_INICIAL * (unsigned long)seglen)
+		congestion.cwnd = CWND_INICIAL * (unsigned long)seglen;
+	if(congestion.cwnd > congestion.maxima)
+		congestion.cwnd = congestion.maxima;
+	aplicarCongestion(seglen);
+}
+
+void setRitmo(char usar)
+{
+	usaritmo = usar;
+}
+
+void initCongestion(unsigned int maxima, int seglen)
+{
+	congestion.maxima = maxima;
+	congestion.cwnd = (CWND_INICIAL * seglen < maxima) ? CWND_INICIAL * seglen : maxima;
+	congestion.ssthresh = maxima;
+	aplicarCongestion(seglen);
+	memset(&ritmo, 0, sizeof(ritmo));
+	ritmo.fase = RITMO_ARRANQUE;
+	ritmo.timer = -1;
+}
+
+void envioCongestion(uint32_t numseq, uint16_t len)
+{
+	struct envio *e;
+	uint64_t ahora;
+
+	if(!usaritmo || len == 0 || ritmo.n == MAXENVIOS)
+		return;
+	ahora = ahorans();
+	e = &ritmo.envios[(ritmo.primero + ritmo.n++) % MAXENVIOS];
+	e->inicio = numseq;
+	e->fin = numseq + len;
+	e->t = ahora;
+	e->entregado = ritmo.entregado;
+	e->tentregado = (ritmo.tentregado != 0) ? ritmo.tentregado : ahora;
+	e->confirmado = 0;
+	e->reenviado = 0;
+	ritmo.envuelo += len;
+	// el siguiente envío se retrasa lo que tarda en salir este al ritmo estimado
+	if(ritmo.btlbw > 0)
+	{
+		if(ritmo.siguienteenvio < ahora)
+			ritmo.siguienteenvio = ahora;
+		ritmo.siguienteenvio += (uint64_t)(len * 1e9 / (gananciaritmo() * ritmo.btlbw));
+	}
+}
+
+void reenvioCongestion(uint32_t numseq, uint16_t len)
+{
+	int i;
+	struct envio *e;
+
+	for(i = 0; usaritmo && i < ritmo.n; i++)
+	{
+		e = &ritmo.envios[(ritmo.primero + i) % MAXENVIOS];
+		if((int32_t)(e->fin - numseq) > 0 && (int32_t)(numseq + len - e->inicio) > 0)
+			e->reenviado = 1;
+	}
+}
+
+void marcaCongestion(uint32_t inicio, uint32_t fin, char acumulada)
+{
+	int i;
+	struct envio *e;
+
+	for(i = 0; usaritmo && i < ritmo.n; i++)
+	{
+		e = &ritmo.envios[(ritmo.primero + i) % MAXENVIOS];
+		if((int32_t)(e->inicio - fin) >= 0)
+			break;
+		if(e->confirmado || (!acumulada && (int32_t)(e->inicio - inicio) < 0) || (int32_t)(fin - e->fin) < 0)
+			continue;
+		e->confirmado = 1;
+		ritmo.envuelo -= e->fin - e->inicio;
+		if(!e->reenviado && (ritmo.muestra == NULL || e->t > ritmo.muestra->t))
+			ritmo.muestra = e;
+	}
+}
+
+int permiteCongestion()
+{
+	uint64_t ahora;
+
+	if(!usaritmo || ritmo.btlbw == 0)
+		return 1;
+	// el único timer (no timeout) del cliente es el de espera del ritmo
+	while(getexpiredtimer(NULL) != -1)
+		ritmo.timer = -1;
+	ahora = ahorans();
+	if(ahora >= ritmo.siguienteenvio)
+		return 1;
+	if(ritmo.timer < 0)
+		ritmo.timer = addtimer((ritmo.siguienteenvio - ahora) / 1000 + 1, NULL);
+	return 0;
+}
+
+void ackCongestion(unsigned long confirmados, int seglen)
+{
+	if(usaritmo)
+	{
+		modeloRitmo(confirmados, seglen);
+		return;
+	}
+	if(confirmados == 0)
+		return;
+	if(congestion.cwnd < congestion.ssthresh)
+	{
+		// slow start: un segmento más por cada segmento confirmado, contando bytes (una respuesta
+		// acumulada vale por todos los segmentos que confirma), sin pasar del umbral de golpe
+		congestion.cwnd += confirmados;
+		if(congestion.cwnd > congestion.ssthresh)
+			congestion.cwnd = congestion.ssthresh;
+	}
+	else
+	{
+		// crecimiento lineal: un segmento más por cada ventana confirmada
+		congestion.cwnd += ((unsigned long)seglen * seglen / congestion.cwnd > 0) ? (unsigned long)seglen * seglen / congestion.cwnd : 1;
+	}
+	if(congestion.cwnd > congestion.maxima)
+		congestion.cwnd = congestion.maxima;
+	aplicarCongestion(seglen);
+}
+
+unsigned long recuperacionCongestion(unsigned long envuelo, int seglen)
+{
+	// una pérdida aislada: el umbral baja a la mitad, pero sin volver a slow start
+	if(!usaritmo)
+	{
+		congestion.ssthresh = (envuelo / 2 > 2 * (unsigned long)seglen) ? envuelo / 2 : 2 * (unsigned long)seglen;
+		congestion.cwnd = congestion.ssthresh;
+		aplicarCongestion(seglen);
+		if(verb)
+			printf("Recuperación: ventana de congestión %lu bytes\n", congestion.cwnd);
+	}
+	return (congestion.cwnd < (unsigned long)seglen) ? (unsigned long)seglen : congestion.cwnd;
+}
+
+void setReenvioRapido(int umbral)
+{
+	rapido.umbral = umbral;
+}
+
+void initReenvioRapido()
+{
+	rapido.duplicados = 0;
+	rapido.recuperando = 0;
+}
+
+int dupReenvioRapido(struct rcftp_msg *received, uint32_t base, uint32_t nextseq)
+{
+	// solo cuenta una respuesta normal que repite next con datos pendientes de confirmar
+	if(rapido.umbral == 0 || rapido.recuperando || base == nextseq || ntohl(received->next) != base
+			|| (received->flags & (F_BUSY | F_ABORT)) != 0)
+		return 0;
+	if(++rapido.duplicados < rapido.umbral)
+		return 0;
+	if(verb)
+		printf("Reenvío rápido: %d confirmaciones duplicadas de next=%u\n", rapido.duplicados, base);
+	rapido.duplicados = 0;
+	rapido.recuperando = 1;
+	rapido.recuperar = nextseq;
+	return 1;
+}
+
+int ackReenvioRapido(uint32_t next)
+{
+	rapido.duplicados = 0;
+	if(rapido.recuperando && (int32_t)(next - rapido.recuperar) >= 0)
+		rapido.recuperando = 0;
+	return rapido.recuperando == 1;
+}
+
+void timeoutReenvioRapido(uint32_t nextseq)
+{
+	// las respuestas a lo ya reenviado repiten next sin indicar pérdidas nuevas
+	rapido.duplicados = 0;
+	rapido.recuperando = 2;
+	rapido.recuperar = nextseq;
+}
+
+void perdidaCongestion(unsigned long envuelo, int seglen)
+{
+	// con el control por ritmo las pérdidas no se toman como señal de congestión
+	if(usaritmo)
+		return;
+	// decremento multiplicativo: el umbral pasa a la mitad de lo enviado y se vuelve a slow start
+	congestion.ssthresh = (envuelo / 2 > 2 * (unsigned long)seglen) ? envuelo / 2 : 2 * (unsigned long)seglen;
+	congestion.cwnd = seglen;
+	aplicarCongestion(seglen);
+	if(verb)
+		printf("Pérdida: ventana de congestión %lu bytes, umbral %lu bytes\n", congestion.cwnd, congestion.ssthresh);
+}
+
+void sendRafaga(int socket, struct addrinfo *servinfo, struct rafaga *r)
+{
+	int i;
+#ifdef __linux__
+	struct mmsghdr hdrs[MAXRAFAGA];
+	struct iovec iov[MAXRAFAGA];
+	int primero[MAXRAFAGA + 1];	// primer mensaje de cada datagrama
+	int ndatagramas, enviados, tam, total, sig = 0;
+#ifdef UDP_SEGMENT
+	char control[MAXRAFAGA][CMSG_SPACE(sizeof(uint16_t))];
+	struct cmsghdr *cmsg;
+#endif
+
+	for(i = 0; i < r->n; i++)
+	{
+		iov[i].iov_base = msgRafaga(r, i);
+		iov[i].iov_len = lenMsgEnvio(msgRafaga(r, i));
+	}
+	while(sig < r->n)
+	{
+		// con GSO, los mensajes consecutivos del mismo tamaño (el último puede ser menor)
+		// viajan en un solo datagrama que el kernel divide en mensajes de tam bytes
+		memset(hdrs, 0, (r->n - sig) * sizeof(hdrs[0]));
+		for(ndatagramas = 0, i = sig; i < r->n; ndatagramas++)
+		{
+			primero[ndatagramas] = i;
+			tam = iov[i].iov_len;
+			total = 0;
+			do
+				total += iov[i++].iov_len;
+			while(usagso && i < r->n && iov[i - 1].iov_len == (size_t)tam
+					&& iov[i].iov_len <= (size_t)tam && total + iov[i].iov_len <= MAXDATAGRAMA);
+			hdrs[ndatagramas].msg_hdr.msg_iov = &iov[primero[ndatagramas]];
+			hdrs[ndatagramas].msg_hdr.msg_iovlen = i - primero[ndatagramas];
+			hdrs[ndatagramas].msg_hdr.msg_name = servinfo->ai_addr;
+			hdrs[ndatagramas].msg_hdr.msg_namelen = servinfo->ai_addrlen;
+#ifdef UDP_SEGMENT
+			if(hdrs[ndatagramas].msg_hdr.msg_iovlen > 1)
+			{
+				hdrs[ndatagramas].msg_hdr.msg_control = control[ndatagramas];
+				hdrs[ndatagramas].msg_hdr.msg_controllen = sizeof(control[ndatagramas]);
+				cmsg = CMSG_FIRSTHDR(&hdrs[ndatagramas].msg_hdr);
+				cmsg->cmsg_level = IPPROTO_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				*(uint16_t *)CMSG_DATA(cmsg) = tam;
+			}
+#endif
+		}
+		primero[ndatagramas] = r->n;
+		if((enviados = sendmmsg(socket, hdrs, ndatagramas, 0)) < 0)
+		{
+			// sin soporte de GSO en la interfaz, o segmentos mayores que su MTU
+			if(usagso && (errno == EIO || errno == EINVAL) && hdrs[0].msg_hdr.msg_iovlen > 1)
+			{
+				fprintf(stderr, "No se puede usar UDP GSO (%s): se envía cada mensaje por separado\n", strerror(errno));
+				usagso = 0;
+				continue;
+			}
+			perror("Error de escritura en el socket (sendmmsg)");
+			exit(1);
+		}
+		// sendmmsg puede enviar menos datagramas de los pedidos: continuamos con el resto
+		sig = primero[enviados];
+		if(verb)
+		{
+			for(i = primero[0]; i < sig; i++)
+				printf("Enviados %zu bytes al servidor (numseq=%u, len=%u)\n", iov[i].iov_len, ntohl(msgRafaga(r, i)->numseq), ntohs(msgRafaga(r, i)->len));
+		}
+	}
+#else
+	for(i = 0; i < r->n; i++)
+		sendMsg(socket, servinfo, msgRafaga(r, i));
+#endif
+	r->n = 0;
+}
+
+void sendMsgDatos(int socket, struct addrinfo *servinfo, struct rcftp_msg *msg, struct iovec *datos, int ndatos)
+{
+	struct msghdr hdr;
+	struct iovec iov[4];
+	ssize_t sentbytes;
+	int i;
+
+	// cabeceras del mensaje y, a continuación, los datos donde estén (sin copiarlos)
+	iov[0].iov_base = msg;
+	iov[0].iov_len = RCFTP_HDRLEN;
+	for(i = 0; i < ndatos; i++)
+		iov[i + 1] = datos[i];
+	// en formato fijo, los datos se completan con ceros hasta RCFTP_BUFLEN
+	if(!compacto && ntohs(msg->len) < RCFTP_BUFLEN)
+	{
+		iov[ndatos + 1].iov_base = relleno;
+		iov[ndatos + 1].iov_len = RCFTP_BUFLEN - ntohs(msg->len);
+		ndatos++;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_name = servinfo->ai_addr;
+	hdr.msg_namelen = servinfo->ai_addrlen;
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = ndatos + 1;
+	if((sentbytes = sendmsg(socket, &hdr, 0)) < 0)
+	{
+		perror("Error de escritura en el socket (sendmsg)");
+		exit(1);
+	}
+	else if(verb)
+	{
+		printf("Enviados %zd bytes al servidor (numseq=%u, len=%u)\n", sentbytes, ntohl(msg->numseq), ntohs(msg->len));
+	}
+}
+
+int lenMsgEnvio(struct rcftp_msg *msg)
+{
+	// formato compacto: solo cabeceras y datos válidos (los segmentos mayores de RCFTP_BUFLEN,
+	// negociados en versión 2, no caben en el formato fijo)
+	if(compacto || ntohs(msg->len) > RCFTP_BUFLEN)
+		return rcftp_msglen(msg);
+	// formato fijo: el resto del buffer a 0, que no cambia el checksum
+	memset(&msg->buffer[ntohs(msg->len)], 0, RCFTP_BUFLEN - ntohs(msg->len));
+	return RCFTP_FIXEDLEN;
+}
+
+void sendMsg(int socket, struct addrinfo *servinfo, struct rcftp_msg *msg)
+{
+	ssize_t sentbytes;
+
+	if((sentbytes = sendto(socket, (char*)msg, lenMsgEnvio(msg), 0, servinfo->ai_addr, servinfo->ai_addrlen)) < 0)
+	{
+		perror("Error de escritura en el socket (sendto)");
+		exit(1);
+	}
+	else if(verb)
+	{
+		printf("Enviados %zd bytes al servidor (numseq=%u, len=%u)\n", sentbytes, ntohl(msg->numseq), ntohs(msg->len));
+	}
+}
+
 /**************************************************************************/
 /* Obtiene la estructura de direcciones del servidor */
 /**************************************************************************/
@@ -305,6 +1104,53 @@ int initsocket(struct addrinfo *servinfo, char f_verbose)
     return sock;
 }
 
+/**************************************************************************/
+/* Calcula el tamaño de segmento según la MTU del camino */
+/**************************************************************************/
+int segmentomtu(int socket, struct addrinfo *servinfo, char f_verbose)
+{
+	int mtu = 0, cabeceras, segmento = RCFTP_BUFLEN;
+	socklen_t optlen = sizeof(mtu);
+#if defined(IP_MTU) && defined(IPV6_MTU)
+	struct sockaddr desconexion;
+
+	// la MTU del camino solo se conoce con el socket conectado al servidor
+	if (connect(socket, servinfo->ai_addr, servinfo->ai_addrlen) < 0)
+	{
+		perror("Error en la llamada connect");
+		exit(1);
+	}
+	if (servinfo->ai_family == AF_INET6)
+	{
+		cabeceras = 40 + 8; // IPv6 + UDP
+		if (getsockopt(socket, IPPROTO_IPV6, IPV6_MTU, &mtu, &optlen) < 0)
+			mtu = 0;
+	}
+	else
+	{
+		cabeceras = 20 + 8; // IPv4 + UDP
+		if (getsockopt(socket, IPPROTO_IP, IP_MTU, &mtu, &optlen) < 0)
+			mtu = 0;
+	}
+	if (mtu > cabeceras + (int)RCFTP_HDRLEN)
+		segmento = mtu - cabeceras - RCFTP_HDRLEN;
+	// deshacemos la conexión: un socket conectado recibiría los errores ICMP
+	// (p.ej. si el servidor termina antes de que lleguen nuestros últimos reenvíos)
+	memset(&desconexion, 0, sizeof(desconexion));
+	desconexion.sa_family = AF_UNSPEC;
+	connect(socket, &desconexion, sizeof(desconexion));
+#else
+	(void)socket; (void)servinfo; (void)optlen; (void)cabeceras;
+#endif
+	if (segmento < RCFTP_BUFLEN)
+		segmento = RCFTP_BUFLEN;
+	else if (segmento > RCFTP_MAXBUFLEN)
+		segmento = RCFTP_MAXBUFLEN;
+	if (f_verbose)
+		printf("MTU del camino: %d bytes; tamaño de segmento: %d bytes\n", mtu, segmento);
+	return segmento;
+}
+
 
 /**************************************************************************/
 /**************** ALGORITMOS DE COMUNICACIÓN DEL CLIENTE  *****************/
@@ -327,11 +1173,11 @@ void alg_basico(int socket, struct addrinfo *servinfo)
 	if(data == 0)		//if finDeFicheroAlcanzado then
 	{
 		lastMsg = 1;	//ultimoMensaje ← true
-		msg.flags = F_FIN;
+		msg.flags = F_FIN | F_COMPACTO;
 	}
 	else
 	{
-		msg.flags = F_NOFLAGS;
+		msg.flags = F_COMPACTO;
 	}		//end if
 
 	msg.version = RCFTP_VERSION_1;		//mensaje ← construirMensajeRCFTP(datos)
@@ -339,12 +1185,12 @@ void alg_basico(int socket, struct addrinfo *servinfo)
 	msg.next = htonl(0);
 	msg.len = htons(data);
 	msg.sum = 0;
-	msg.sum = xsum((char*)&msg, sizeof(msg));
+	msg.sum = xsum((char*)&msg, rcftp_msglen(&msg));
 
 	while(lastOkMsg == 0)		//while ultimoMensajeConfirmado = false do
 	{
 		//enviar(mensaje)
-		if((sentbytes = sendto(socket, (char*)&msg, sizeof(msg), 0, servinfo->ai_addr, servinfo->ai_addrlen)) < 0)
+		if((sentbytes = sendto(socket, (char*)&msg, lenMsgEnvio(&msg), 0, servinfo->ai_addr, servinfo->ai_addrlen)) < 0)
 		{
 			perror("Error de escritura en el socket (sendto)");
 			exit(1);
@@ -384,14 +1230,14 @@ void alg_basico(int socket, struct addrinfo *servinfo)
 				if(data == 0)		//if finDeFicheroAlcanzado then
 				{
 					lastMsg = 1;		//ultimoMensaje ← true
-					msg.flags = F_FIN;
+					msg.flags = F_FIN | F_COMPACTO;
 				}		//end if
 
 				msg.numseq = htonl(ntohl(msg.numseq) + ntohs(msg.len));		//mensaje ← construirMensajeRCFTP(datos)
 				msg.next = htonl(0);
 				msg.len = htons(data);
 				msg.sum = 0;
-				msg.sum = xsum((char*)&msg, sizeof(msg));
+				msg.sum = xsum((char*)&msg, rcftp_msglen(&msg));
 			}		// end if
 		}																			
 		else
@@ -420,17 +1266,18 @@ void alg_stopwait(int socket, struct addrinfo *servinfo)
 	int lastMsg = 0;		//ultimoMensaje ← false
 	int lastOkMsg = 0;	//ultimoMensajeConfirmado ← false
 	int timeouts_done = 0;
+	int reenvio = 0;		// el mensaje actual ya se ha enviado antes
 	ssize_t data, sentbytes, recvbytes;
 	data = readtobuffer((char *)msg.buffer, RCFTP_BUFLEN);		//datos ← leerDeEntradaEstandar(RCFTP_BUFLEN)
 
 	if(data == 0)		//if finDeFicheroAlcanzado then
 	{
 		lastMsg = 1;	//ultimoMensaje ← true
-		msg.flags = F_FIN;
+		msg.flags = F_FIN | F_COMPACTO;
 	}
 	else
 	{
-		msg.flags = F_NOFLAGS;
+		msg.flags = F_COMPACTO;
 	}		//end if
 
 	msg.version = RCFTP_VERSION_1;		//mensaje ← construirMensajeRCFTP(datos)
@@ -438,12 +1285,12 @@ void alg_stopwait(int socket, struct addrinfo *servinfo)
 	msg.next = htonl(0);
 	msg.len = htons(data);
 	msg.sum = 0;
-	msg.sum = xsum((char*)&msg, sizeof(msg));
+	msg.sum = xsum((char*)&msg, rcftp_msglen(&msg));
 
 	while(lastOkMsg == 0)		//while ultimoMensajeConfirmado = false do
 	{
 		//enviar(mensaje)
-		if((sentbytes = sendto(socket, (char*)&msg, sizeof(msg), 0, servinfo->ai_addr, servinfo->ai_addrlen)) < 0)
+		if((sentbytes = sendto(socket, (char*)&msg, lenMsgEnvio(&msg), 0, servinfo->ai_addr, servinfo->ai_addrlen)) < 0)
 		{
 			perror("Error de escritura en el socket (sendto)");
 			exit(1);
@@ -453,12 +1300,21 @@ void alg_stopwait(int socket, struct addrinfo *servinfo)
 			printf("Enviados %zd bytes al servidor\n", sentbytes);
 		}
 		
-		addtimeout();	//addtimeout()
+		// algoritmo de Karn: solo se mide el RTT de la primera transmisión de cada mensaje
+		if(reenvio)
+			reenvioRTT(ntohl(msg.numseq), ntohs(msg.len));
+		else
+			medirRTT(ntohl(msg.numseq), ntohs(msg.len));
+		reenvio = 1;
+		addtimeoutduration(getRTO());	//addtimeout()
 		int wait = 1;	//esperar ← true
 		int received = 0;
 
 		while(wait == 1)		//while esperar do
 		{
+			// esperamos a la respuesta o al timeout, sin espera activa
+			waittimeout(socket, 1);
+
 			//numDatosRecibidos ← recibir(respuesta)
 			socklen_t addrlen = servinfo->ai_addrlen;
 			recvbytes = recvfrom(socket, (char*)&resp, sizeof(resp), 0, servinfo->ai_addr, &addrlen);
@@ -473,14 +1329,16 @@ void alg_stopwait(int socket, struct addrinfo *servinfo)
 				fprintf(stderr, "Conexión cerrada por el servidor\n");
 				exit(1);
 			}
-			else	// if numDatosRecibidos > 0 then
+			else if(recvbytes > 0)	// if numDatosRecibidos > 0 then
 			{
 				if(verb)
 				{
 					printf("Recibidos %zd bytes del servidor\n", recvbytes);
 				}
 
-				canceltimeout();          // canceltimeout()
+				// con un RTO corto el timeout puede haber vencido ya
+				if(getnumtimeouts() > 0)
+					canceltimeout();          // canceltimeout()
 				wait = 0;              // esperar ← false
 				received = 1;
 			}	// end if
@@ -489,6 +1347,7 @@ void alg_stopwait(int socket, struct addrinfo *servinfo)
 			{
 				wait = 0;	//esperar ← false
 				timeouts_done++;		//timeouts_procesados ← timeouts_procesados + 1
+				backoffRTO();
 			}	//end if
 		}	//end while
 
@@ -501,6 +1360,7 @@ void alg_stopwait(int socket, struct addrinfo *servinfo)
 			{
 				printf("Respuesta válida y esperada recibida del servidor\n");
 			}
+			ackRTT(ntohl(msg.numseq), ntohl(resp.next));
 
 			if(lastMsg == 1)		//if ultimoMensaje then
 			{
@@ -513,14 +1373,15 @@ void alg_stopwait(int socket, struct addrinfo *servinfo)
 				if(data == 0)		//if finDeFicheroAlcanzado then
 				{
 					lastMsg = 1;		//ultimoMensaje ← true
-					msg.flags = F_FIN;
+					msg.flags = F_FIN | F_COMPACTO;
 				}		//end if
 
 				msg.numseq = htonl(ntohl(msg.numseq) + ntohs(msg.len));		//mensaje ← construirMensajeRCFTP(datos)
 				msg.next = htonl(0);
 				msg.len = htons(data);
 				msg.sum = 0;
-				msg.sum = xsum((char*)&msg, sizeof(msg));
+				msg.sum = xsum((char*)&msg, rcftp_msglen(&msg));
+				reenvio = 0;
 			}		// end if
 		}																			
 		else
@@ -536,11 +1397,491 @@ void alg_stopwait(int socket, struct addrinfo *servinfo)
 /**************************************************************************/
 /*  algoritmo 3 (ventana deslizante)  */
 /**************************************************************************/
-void alg_ventana(int socket, struct addrinfo *servinfo, int window)
+void alg_ventana(int socket, struct addrinfo *servinfo, int window, unsigned int segmento)
 {
 
 	printf("Comunicación con algoritmo go-back-n\n");
 
-#warning FALTA IMPLEMENTAR EL ALGORITMO GO-BACK-N
-	printf("Algoritmo no implementado\n");
+	int sockflags = fcntl(socket, F_GETFL, 0);
+	fcntl(socket, F_SETFL, sockflags | O_NONBLOCK);
+
+	setwindowsize(window);
+	setwindowstart(flujo.inicio);
+	setSegPropuesto(segmento);
+
+	struct rcftp_msg msg, resp, *pmsg;
+	struct rafaga rafaga;
+	int eof = 0;			//finDeFicheroAlcanzado ← false
+	int finSent = 0;		// mensaje con F_FIN enviado al menos una vez
+	int lastOkMsg = 0;		//ultimoMensajeConfirmado ← false
+	int timeouts_done = 0;
+	int seglen = (window < RCFTP_BUFLEN) ? window : RCFTP_BUFLEN;
+	uint32_t base = flujo.inicio;		// primer byte enviado y aún no confirmado
+	uint32_t nextseq = flujo.inicio;	// siguiente byte a enviar por primera vez
+	ssize_t data, recvbytes;
+	int i, len, valido;
+	int reenviar = 0;		// reenvío rápido pendiente (pérdida detectada o confirmación parcial en la recuperación)
+	unsigned long limite = 0;	// datos reenviados en vuelo como mucho durante la recuperación
+	uint32_t recuperado = flujo.inicio;	// fin de lo reenviado en la recuperación en curso
+	uint16_t sum;		// suma parcial de los datos, calculada al copiarlos a/de la ventana
+	struct iovec datos[2];	// datos a reenviar, tal cual están en la ventana
+	int ndatos;
+	int segmin = seglen;	// menor tamaño de segmento usado, para acotar los mensajes en vuelo
+
+	// el segmento negociado no supera ni el propuesto ni la ventana
+	int maxseglen = ((int)segmento > seglen) ? (int)segmento : seglen;
+	if(maxseglen > window)
+		maxseglen = window;
+
+	// los mensajes nuevos se envían en ráfagas, con una sola llamada al sistema
+	initRafaga(&rafaga, maxseglen);
+	// la ventana efectiva empieza con pocos segmentos y crece hasta window según las confirmaciones
+	initCongestion(window, seglen);
+	initReenvioRapido();
+
+	while(lastOkMsg == 0)		//while ultimoMensajeConfirmado = false do
+	{
+		/*** BLOQUE DE ENVIO: enviar en una ráfaga los datos que quepan en la ventana ***/
+		while(!eof && getfreespace() >= seglen && rafaga.n < MAXRAFAGA && getnumtimeouts() + rafaga.n < MAXENVUELO && permiteCongestion())	//if espacioLibreEnVentanaEmision and not finDeFicheroAlcanzado then
+		{
+			pmsg = msgRafaga(&rafaga, rafaga.n);
+			data = readtobuffer((char *)pmsg->buffer, seglen);		//datos ← leerDeEntradaEstandar(RCFTP_BUFLEN)
+			if(data == 0)
+			{
+				eof = 1;		//finDeFicheroAlcanzado ← true
+			}
+			else
+			{
+				addsentdatatowindowsum((char *)pmsg->buffer, data, &sum);		//addsentdatatowindow(datos)
+				buildMsg(pmsg, nextseq, data, F_NOFLAGS, sum);		//mensaje ← construirMensajeRCFTP(datos)
+				envioCongestion(nextseq, data);
+				rafaga.n++;
+				nextseq += data;
+			}
+		}		//end while
+
+		// el F_FIN se envía en cuanto se alcanza el fin de fichero, sin esperar a vaciar la ventana
+		if(eof && !finSent && rafaga.n < MAXRAFAGA && getnumtimeouts() + rafaga.n < MAXENVUELO)
+		{
+			buildMsg(msgRafaga(&rafaga, rafaga.n), nextseq, 0, F_FIN, 0);
+			rafaga.n++;
+			finSent = 1;
+		}
+
+		if(rafaga.n > 0)
+		{
+			len = rafaga.n;
+			medirRTT(ntohl(msgRafaga(&rafaga, 0)->numseq), ntohs(msgRafaga(&rafaga, 0)->len));
+			sendRafaga(socket, servinfo, &rafaga);		//enviar(mensajes)
+			anunciarTamano(socket, servinfo);		// tras la primera ráfaga, que abre la sesión
+			for(i = 0; i < len; i++)
+				addtimeoutduration(getRTO());		//addtimeout()
+			if(verb)
+				printvemision();
+		}
+
+		/*** BLOQUE DE RECEPCION: recibir respuesta y procesarla (si existe) ***/
+		// si no se puede enviar nada más, esperamos a una respuesta o a un timeout (sin espera activa)
+		waittimeout(socket, getnumtimeouts() >= MAXENVUELO || (eof ? finSent : (getfreespace() < seglen || !permiteCongestion())));
+		recvbytes = recvfrom(socket, (char*)&resp, sizeof(resp), 0, NULL, NULL);		//numDatosRecibidos ← recibir(respuesta)
+		if(recvbytes < 0 && errno != EAGAIN)
+		{
+			perror("Error al recibir datos (recvfrom)");
+			exit(1);
+		}
+		else if(recvbytes > 0)		//if numDatosRecibidos > 0 then
+		{
+			if(verb)
+				printf("Recibidos %zd bytes del servidor\n", recvbytes);
+
+			//if esMensajeValido(respuesta) and esLaRespuestaEsperada(respuesta) then
+			valido = okMsg(&resp, recvbytes);
+			if(valido && okRespVentana(&resp, base, nextseq, finSent))
+			{
+				seglen = segNegociado(&resp, seglen, window);
+				if(seglen < segmin)
+					segmin = seglen;
+				if(getnumtimeouts() > 0)
+					canceltimeout();		//canceltimeout()
+				if(ntohl(resp.next) != base)
+				{
+					ackRTT(base, ntohl(resp.next));
+					marcaCongestion(base, ntohl(resp.next), 1);
+					ackCongestion(ntohl(resp.next) - base, seglen);
+					// durante la recuperación, una confirmación parcial señala el siguiente hueco
+					reenviar = ackReenvioRapido(ntohl(resp.next));
+					freewindow(ntohl(resp.next));		//freewindow(respuesta.next)
+					base = ntohl(resp.next);
+					// una respuesta acumulada confirma varios mensajes: sobran sus timeouts
+					while(getnumtimeouts() > (int)((nextseq - base + segmin - 1) / segmin) + finSent)
+						canceltimeout();
+				}
+				if(verb)
+				{
+					printf("Respuesta válida y esperada recibida del servidor (next=%u)\n", base);
+					printvemision();
+				}
+				if(finSent && base == nextseq && (resp.flags & F_FIN))	//if finDeFicheroAlcanzado and ventanaEmisionVacia then
+					lastOkMsg = 1;		//ultimoMensajeConfirmado ← true
+			}
+			else if(valido && dupReenvioRapido(&resp, base, nextseq))
+			{
+				// pérdida detectada por confirmaciones duplicadas
+				limite = recuperacionCongestion(nextseq - base, seglen);
+				recuperado = base;
+				reenviar = 1;
+			}
+			else if(verb)
+			{
+				printf("Respuesta inválida o inesperada recibida del servidor. Ignorándola.\n");
+			}		//end if
+
+			// reenvío rápido: volvemos a base sin esperar al timeout (el servidor descarta lo recibido
+			// tras el hueco), con como mucho la ventana de congestión reducida al detectar la pérdida
+			// en vuelo; tras una confirmación parcial se sigue por lo aún no reenviado
+			if(reenviar)
+			{
+				reenviar = 0;
+				if((uint32_t)(recuperado - base) > (uint32_t)(nextseq - base))
+					recuperado = base;
+				while((uint32_t)(recuperado - base) < limite && recuperado != nextseq)
+				{
+					len = getiovfromwindow(recuperado, datos, &ndatos, seglen, &sum);
+					buildMsg(&msg, recuperado, len, F_NOFLAGS, sum);
+					reenvioRTT(recuperado, len);
+					reenvioCongestion(recuperado, len);
+					sendMsgDatos(socket, servinfo, &msg, datos, ndatos);
+					// el mensaje ya tenía timeout: se reinicia en lugar de añadir otro
+					if(getnumtimeouts() > 0)
+						canceltimeout();
+					addtimeoutduration(getRTO());
+					recuperado += len;
+				}
+			}
+		}		//end if
+
+		/*** BLOQUE DE PROCESAMIENTO DE TIMEOUT ***/
+		if(timeouts_done != timeouts_vencidos)		//if timeouts_procesados ≠ timeouts_vencidos then
+		{
+			if(base != nextseq || finSent)
+			{
+				if(base != nextseq)
+				{
+					//mensaje ← construirMensajeMasViejoDeVentanaEmision()
+					len = seglen;
+					uint32_t numseq = getiovtoresend(datos, &ndatos, &len, &sum);
+					buildMsg(&msg, numseq, len, F_NOFLAGS, sum);
+				}
+				else
+				{
+					// solo queda por confirmar el F_FIN
+					buildMsg(&msg, nextseq, 0, F_FIN, 0);
+					ndatos = 0;
+				}
+				// cada mensaje tiene su timeout: solo es una pérdida nueva si vence el más antiguo
+				if(ntohl(msg.numseq) == base && backoffRTO())
+				{
+					perdidaCongestion(nextseq - base, seglen);
+					timeoutReenvioRapido(nextseq);
+				}
+				reenvioRTT(ntohl(msg.numseq), ntohs(msg.len));
+				reenvioCongestion(ntohl(msg.numseq), ntohs(msg.len));
+				if(verb)
+					printf("Timeout: reenviando mensaje con numseq=%u (RTO=%lu us)\n", ntohl(msg.numseq), getRTO());
+				sendMsgDatos(socket, servinfo, &msg, datos, ndatos);		//enviar(mensaje)
+				addtimeoutduration(getRTO());		//addtimeout()
+			}
+			// con la ventana vacía y sin F_FIN enviado no hay nada que reenviar
+			timeouts_done++;		//timeouts_procesados ← timeouts_procesados + 1
+		}		//end if
+
+		// mientras quede algo sin confirmar debe haber algún timeout armado
+		if(!lastOkMsg && (base != nextseq || finSent) && getnumtimeouts() == 0)
+			addtimeoutduration(getRTO());
+	}		//end while
+
+	free(rafaga.buffer);
+}
+
+/**************************************************************************/
+/*  algoritmo 4 (repetición selectiva)  */
+/**************************************************************************/
+void alg_repsel(int socket, struct addrinfo *servinfo, int window, unsigned int segmento)
+{
+
+	printf("Comunicación con algoritmo de repetición selectiva\n");
+
+	int sockflags = fcntl(socket, F_GETFL, 0);
+	fcntl(socket, F_SETFL, sockflags | O_NONBLOCK);
+
+	setwindowsize(window);
+	setwindowstart(flujo.inicio);
+	setSegPropuesto(segmento);
+
+	struct rcftp_msg msg, resp, *pmsg;
+	struct rcftp_sack sack;
+	struct rafaga rafaga;
+	int eof = 0;			//finDeFicheroAlcanzado ← false
+	int finSent = 0;		// mensaje con F_FIN enviado al menos una vez
+	int lastOkMsg = 0;		//ultimoMensajeConfirmado ← false
+	int timeouts_done = 0;
+	int seglen = (window < RCFTP_BUFLEN) ? window : RCFTP_BUFLEN;
+	uint32_t base = flujo.inicio;		// primer byte enviado y aún no confirmado
+	uint32_t nextseq = flujo.inicio;	// siguiente byte a enviar por primera vez
+	ssize_t data, recvbytes;
+	int i, j, len, nuevos, nsacks, reenviar;
+	unsigned long confirmados;	// bytes confirmados por primera vez en una respuesta
+	unsigned long limite = 0, reenviados;	// bytes a reenviar en la recuperación, y reenviados en una respuesta
+	uint32_t mayorsack = base;		// fin del dato más alto confirmado selectivamente
+	unsigned int ordenrecuperacion = 0;	// orden del primer reenvío de la recuperación en curso
+	uint16_t sum;		// suma parcial de los datos, calculada al copiarlos a/de la ventana
+	struct iovec datos[2];	// datos a reenviar, tal cual están en la ventana
+	int ndatos;
+
+	// mensajes en vuelo, ordenados por numseq en una cola circular [firstseg, firstseg+nsegs-1]
+	// cada envío arma un timeout de la misma duración, así que el timeout que vence
+	// corresponde siempre al mensaje sin confirmar enviado hace más tiempo (menor orden)
+	int maxsegs = window / seglen + 1;
+	struct segmento *segs = malloc(maxsegs * sizeof(struct segmento));
+	int firstseg = 0, nsegs = 0;
+	unsigned int orden = 0;
+	if(segs == NULL)
+	{
+		perror("Error al reservar memoria para los mensajes en vuelo");
+		exit(1);
+	}
+
+	// el segmento negociado no supera ni el propuesto ni la ventana
+	int maxseglen = ((int)segmento > seglen) ? (int)segmento : seglen;
+	if(maxseglen > window)
+		maxseglen = window;
+
+	// los mensajes nuevos se envían en ráfagas, con una sola llamada al sistema
+	initRafaga(&rafaga, maxseglen);
+	// la ventana efectiva empieza con pocos segmentos y crece hasta window según las confirmaciones
+	initCongestion(window, seglen);
+	initReenvioRapido();
+
+	while(lastOkMsg == 0)		//while ultimoMensajeConfirmado = false do
+	{
+		/*** BLOQUE DE ENVIO: enviar en una ráfaga los datos que quepan en la ventana ***/
+		while(!eof && getfreespace() >= seglen && nsegs < maxsegs && rafaga.n < MAXRAFAGA && getnumtimeouts() + rafaga.n < MAXENVUELO
+				&& permiteCongestion())
+		{
+			pmsg = msgRafaga(&rafaga, rafaga.n);
+			data = readtobuffer((char *)pmsg->buffer, seglen);
+			if(data == 0)
+			{
+				eof = 1;
+			}
+			else
+			{
+				addsentdatatowindowsum((char *)pmsg->buffer, data, &sum);
+				buildMsg(pmsg, nextseq, data, F_NOFLAGS, sum);
+				envioCongestion(nextseq, data);
+				rafaga.n++;
+				i = (firstseg + nsegs) % maxsegs;
+				segs[i].numseq = nextseq;
+				segs[i].len = data;
+				segs[i].confirmado = 0;
+				segs[i].orden = orden++;
+				nsegs++;
+				nextseq += data;
+			}
+		}
+
+		if(eof && !finSent && rafaga.n < MAXRAFAGA && getnumtimeouts() + rafaga.n < MAXENVUELO)
+		{
+			buildMsg(msgRafaga(&rafaga, rafaga.n), nextseq, 0, F_FIN, 0);
+			rafaga.n++;
+			finSent = 1;
+		}
+
+		if(rafaga.n > 0)
+		{
+			len = rafaga.n;
+			medirRTT(ntohl(msgRafaga(&rafaga, 0)->numseq), ntohs(msgRafaga(&rafaga, 0)->len));
+			sendRafaga(socket, servinfo, &rafaga);
+			anunciarTamano(socket, servinfo);		// tras la primera ráfaga, que abre la sesión
+			for(i = 0; i < len; i++)
+				addtimeoutduration(getRTO());
+			if(verb)
+				printvemision();
+		}
+
+		/*** BLOQUE DE RECEPCION: confirmaciones acumulativas y selectivas ***/
+		// si no se puede enviar nada más, esperamos a una respuesta o a un timeout (sin espera activa)
+		waittimeout(socket, getnumtimeouts() >= MAXENVUELO
+				|| (eof ? finSent : (getfreespace() < seglen || nsegs >= maxsegs || !permiteCongestion())));
+		recvbytes = recvfrom(socket, (char*)&resp, sizeof(resp), 0, NULL, NULL);
+		if(recvbytes < 0 && errno != EAGAIN)
+		{
+			perror("Error al recibir datos (recvfrom)");
+			exit(1);
+		}
+		else if(recvbytes > 0)
+		{
+			if(verb)
+				printf("Recibidos %zd bytes del servidor\n", recvbytes);
+
+			if(okMsg(&resp, recvbytes) && okRespRepSel(&resp, base, nextseq))
+			{
+				seglen = segNegociado(&resp, seglen, window);
+				nuevos = 0;
+				confirmados = 0;
+				reenviar = 0;
+
+				// confirmación acumulativa: liberamos los mensajes completos hasta next
+				if(ntohl(resp.next) != base)
+				{
+					ackRTT(base, ntohl(resp.next));
+					marcaCongestion(base, ntohl(resp.next), 1);
+					while(nsegs > 0 && (uint32_t)(segs[firstseg].numseq + segs[firstseg].len - ntohl(resp.next) - 1) >= (uint32_t)(nextseq - ntohl(resp.next)))
+					{
+						if(!segs[firstseg].confirmado)
+						{
+							nuevos++;
+							confirmados += segs[firstseg].len;
+						}
+						firstseg = (firstseg + 1) % maxsegs;
+						nsegs--;
+					}
+					freewindow(ntohl(resp.next));
+					base = ntohl(resp.next);
+					// durante la recuperación, una confirmación parcial señala el siguiente hueco
+					reenviar = ackReenvioRapido(base);
+				}
+				else if(dupReenvioRapido(&resp, base, nextseq))
+				{
+					limite = recuperacionCongestion(nextseq - base, seglen);
+					ordenrecuperacion = orden;
+					reenviar = 1;
+				}
+
+				// confirmaciones selectivas: bloques [inicio,fin) en el buffer de la respuesta
+				nsacks = ntohs(resp.len) / sizeof(struct rcftp_sack);
+				if(nsacks > RCFTP_BUFLEN / (int)sizeof(struct rcftp_sack))
+					nsacks = RCFTP_BUFLEN / sizeof(struct rcftp_sack);
+				for(j = 0; j < nsacks; j++)
+				{
+					memcpy(&sack, &resp.buffer[j * sizeof(sack)], sizeof(sack));
+					if((int32_t)(ntohl(sack.fin) - mayorsack) > 0)
+						mayorsack = ntohl(sack.fin);
+					ackRTT(ntohl(sack.inicio), ntohl(sack.fin));
+					marcaCongestion(ntohl(sack.inicio), ntohl(sack.fin), 0);
+					for(i = 0; i < nsegs; i++)
+					{
+						struct segmento *seg = &segs[(firstseg + i) % maxsegs];
+						if(!seg->confirmado && seg->numseq >= ntohl(sack.inicio) && seg->numseq + seg->len <= ntohl(sack.fin))
+						{
+							seg->confirmado = 1;
+							nuevos++;
+							confirmados += seg->len;
+						}
+					}
+				}
+
+				if(finSent && nsegs == 0 && ntohl(resp.next) == nextseq && (resp.flags & F_FIN))
+				{
+					nuevos++;
+					lastOkMsg = 1;
+				}
+
+				ackCongestion(confirmados, seglen);
+
+				// un timeout menos por cada mensaje confirmado por primera vez
+				for(; nuevos > 0 && getnumtimeouts() > 0; nuevos--)
+					canceltimeout();
+
+				// reenvío rápido de los huecos, sin esperar a su timeout: el primer mensaje sin confirmar
+				// y los que estén por debajo del mayor dato confirmado selectivamente, salvo los ya
+				// reenviados en esta recuperación
+				for(i = 0, reenviados = 0; reenviar && i < nsegs && reenviados < limite; i++)
+				{
+					struct segmento *seg = &segs[(firstseg + i) % maxsegs];
+					if(i > 0 && (int32_t)(seg->numseq - mayorsack) >= 0)
+						break;
+					if(seg->confirmado || (int)(seg->orden - ordenrecuperacion) >= 0)
+						continue;
+					uint32_t start = (seg->numseq - base < nextseq - base) ? seg->numseq : base;
+					len = getiovfromwindow(start, datos, &ndatos, seg->numseq + seg->len - start, &sum);
+					buildMsg(&msg, start, len, F_NOFLAGS, sum);
+					seg->orden = orden++;
+					reenvioRTT(start, len);
+					reenvioCongestion(start, len);
+					if(verb)
+						printf("Reenvío rápido del mensaje con numseq=%u\n", start);
+					sendMsgDatos(socket, servinfo, &msg, datos, ndatos);
+					// el mensaje ya tenía timeout: se reinicia en lugar de añadir otro
+					if(getnumtimeouts() > 0)
+						canceltimeout();
+					addtimeoutduration(getRTO());
+					reenviados += len;
+				}
+
+				if(verb)
+				{
+					printf("Respuesta válida recibida del servidor (next=%u, %d bloques SACK)\n", base, nsacks);
+					printvemision();
+				}
+			}
+			else if(verb)
+			{
+				printf("Respuesta inválida o inesperada recibida del servidor. Ignorándola.\n");
+			}
+		}
+
+		/*** BLOQUE DE PROCESAMIENTO DE TIMEOUT: reenviar solo el mensaje vencido ***/
+		if(timeouts_done != timeouts_vencidos)
+		{
+			timeouts_done++;
+			j = -1;
+			for(i = 0; i < nsegs; i++)
+			{
+				int k = (firstseg + i) % maxsegs;
+				if(!segs[k].confirmado && (j < 0 || segs[k].orden < segs[j].orden))
+					j = k;
+			}
+			if(j < 0 && nsegs > 0)
+			{
+				// todo confirmado selectivamente pero sin confirmación acumulativa:
+				// el servidor ha descartado datos, reenviamos el primero
+				j = firstseg;
+				segs[j].confirmado = 0;
+			}
+			if(j >= 0)
+			{
+				uint32_t start = (segs[j].numseq - base < nextseq - base) ? segs[j].numseq : base;
+				len = getiovfromwindow(start, datos, &ndatos, segs[j].numseq + segs[j].len - start, &sum);
+				buildMsg(&msg, start, len, F_NOFLAGS, sum);
+				segs[j].orden = orden++;
+				// cada mensaje tiene su timeout: solo es una pérdida nueva si vence el más antiguo
+				if(start == base && backoffRTO())
+				{
+					perdidaCongestion(nextseq - base, seglen);
+					timeoutReenvioRapido(nextseq);
+				}
+				reenvioRTT(start, len);
+				reenvioCongestion(start, len);
+				if(verb)
+					printf("Timeout: reenviando mensaje con numseq=%u (RTO=%lu us)\n", start, getRTO());
+				sendMsgDatos(socket, servinfo, &msg, datos, ndatos);
+				addtimeoutduration(getRTO());
+			}
+			else if(finSent && !lastOkMsg)
+			{
+				buildMsg(&msg, nextseq, 0, F_FIN, 0);
+				backoffRTO();
+				sendMsg(socket, servinfo, &msg);
+				addtimeoutduration(getRTO());
+			}
+		}
+
+		// mientras quede algo sin confirmar debe haber algún timeout armado
+		if(!lastOkMsg && (nsegs > 0 || finSent) && getnumtimeouts() == 0)
+			addtimeoutduration(getRTO());
+	}
+
+	free(segs);
+	free(rafaga.buffer);
 }
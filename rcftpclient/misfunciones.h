@@ -4,6 +4,74 @@
 /* Autor: Grimal Torres, Oscar. Garcia Sanchez, Hugo.                       */
 /****************************************************************************/
 
+/**
+ * Estado de un mensaje enviado en el algoritmo de repetición selectiva
+ */
+struct segmento {
+	uint32_t numseq;		/**< Número de secuencia del primer byte */
+	uint16_t len;			/**< Longitud de los datos */
+	char confirmado;		/**< Confirmado selectivamente por el servidor */
+	unsigned int orden;		/**< Orden del último envío, para saber qué timeout vence antes */
+};
+
+/**
+ * Número máximo de mensajes enviados con una sola llamada al sistema
+ *
+ * Los mensajes de una ráfaga llegan juntos al servidor, que solo puede tener
+ * WINDOWSIZE respuestas pendientes; por eso la ráfaga es corta.
+ */
+#define MAXRAFAGA 8
+
+/**
+ * Número máximo de mensajes en vuelo. Cada uno tiene su timeout y multialarm solo admite
+ * MAXALARMS alarmas a la vez; de ellas, una es para el timer del ritmo de envío (-c) y otra
+ * queda libre en la lista de timeouts. Con ventanas grandes y segmentos pequeños, es este
+ * límite, y no la ventana, el que frena el envío.
+ */
+#define MAXENVUELO (MAXALARMS - 2)
+
+/**
+ * Límites del tiempo de expiración adaptativo (RTO), en microsegundos
+ */
+#define RTO_MIN 1000
+#define RTO_MAX 60000000
+
+/**
+ * Ventana de congestión inicial, en segmentos
+ */
+#define CWND_INICIAL 4
+
+/**
+ * Confirmaciones duplicadas tras las que se reenvía sin esperar al timeout (por defecto)
+ */
+#define REENVIO_RAPIDO 3
+
+/**
+ * Número máximo de flujos de una transferencia en paralelo (-n)
+ */
+#define MAXFLUJOS 64
+
+/**
+ * Parámetros del control de congestión por ritmo de entrega (-c)
+ */
+#define MAXENVIOS 4096			/**< Envíos sin confirmar que se pueden muestrear */
+#define RONDASBW 10				/**< Rondas (RTT) durante las que vale una muestra de ancho de banda */
+#define VALIDEZ_MINRTT 10000000000ULL	/**< Validez del RTT mínimo, en ns */
+#define GANANCIA_ARRANQUE 2.89	/**< Ganancia del ritmo y de la ventana en el arranque (2/ln 2) */
+#define GANANCIA_VENTANA 2		/**< Ventana, en productos ancho de banda-retardo, tras el arranque */
+#define FASESCICLO 8			/**< Fases del ciclo de sondeo del ancho de banda, de un RTT mínimo cada una */
+#define RITMO_ARRANQUE -2		/**< Fase de arranque: el ritmo crece hasta que el ancho de banda se estanca */
+#define RITMO_VACIADO -1		/**< Fase de vaciado de la cola creada en el arranque */
+
+/**
+ * Ráfaga de mensajes nuevos a enviar con una sola llamada (sendmmsg)
+ */
+struct rafaga {
+	char *buffer;			/**< Espacio para MAXRAFAGA mensajes consecutivos */
+	int tammsg;				/**< Espacio reservado para cada mensaje (cabeceras y datos) */
+	int n;					/**< Número de mensajes en la ráfaga */
+};
+
 /**
  * Obtiene la estructura de direcciones del servidor
  *
@@ -30,6 +98,333 @@ void printsockaddr(struct sockaddr_storage * saddr);
  */
 int initsocket(struct addrinfo *servinfo, char f_verbose);
 
+/**
+ * Calcula el tamaño de segmento que cabe en la MTU del camino hacia el servidor
+ *
+ * @param[in] socket Descriptor del socket
+ * @param[in] servinfo Estructura con la dirección del servidor
+ * @param[in] f_verbose Flag para imprimir información adicional
+ * @return Tamaño de datos por segmento, entre RCFTP_BUFLEN y RCFTP_MAXBUFLEN
+ */
+int segmentomtu(int socket, struct addrinfo *servinfo, char f_verbose);
+
+
+/**
+ * Comprueba si la respuesta es la esperada en el algoritmo de ventana deslizante
+ *
+ * @param[in] received Respuesta recibida del servidor
+ * @param[in] base Primer número de secuencia enviado y aún no confirmado
+ * @param[in] nextseq Siguiente número de secuencia a enviar por primera vez
+ * @param[in] finSent Indica si ya se ha enviado el mensaje con F_FIN
+ * @return 1: respuesta esperada; 0: respuesta inesperada
+ */
+int okRespVentana(struct rcftp_msg *received, uint32_t base, uint32_t nextseq, int finSent);
+
+/**
+ * Comprueba si la respuesta es aceptable en el algoritmo de repetición selectiva
+ *
+ * @param[in] received Respuesta recibida del servidor
+ * @param[in] base Primer número de secuencia enviado y aún no confirmado
+ * @param[in] nextseq Siguiente número de secuencia a enviar por primera vez
+ * @return 1: respuesta aceptable; 0: respuesta inesperada
+ */
+int okRespRepSel(struct rcftp_msg *received, uint32_t base, uint32_t nextseq);
+
+/**
+ * Construye un mensaje RCFTP con los datos ya presentes en su buffer.
+ * El checksum se obtiene sumando solo las cabeceras a la suma parcial de los datos.
+ *
+ * @param[in,out] msg Mensaje a construir
+ * @param[in] numseq Número de secuencia (host order)
+ * @param[in] len Longitud de los datos (host order)
+ * @param[in] flags Flags del mensaje
+ * @param[in] sumadatos Suma parcial (xsumparcial) de los len bytes de datos
+ */
+void buildMsg(struct rcftp_msg *msg, uint32_t numseq, uint16_t len, uint8_t flags, uint16_t sumadatos);
+
+/**
+ * Establece el tamaño de segmento a proponer al servidor en los mensajes (versión 2)
+ *
+ * @param[in] segmento Tamaño propuesto; si no supera RCFTP_BUFLEN se usa la versión 1
+ */
+void setSegPropuesto(unsigned int segmento);
+
+/**
+ * Convierte la transmisión en un flujo de una transferencia en paralelo (-n): los números de
+ * secuencia empiezan en la posición del rango en el fichero, y el mensaje que empieza en ella
+ * lleva F_FLUJO y el identificador de la transferencia
+ *
+ * @param[in] inicio Posición en el fichero del primer byte del rango
+ * @param[in] id Identificador de la transferencia, común a todos sus flujos
+ */
+void setFlujo(uint32_t inicio, uint32_t id);
+
+/**
+ * Pide anunciar al servidor el tamaño total del fichero (F_TAMANO), para que pueda reservarlo
+ * de antemano. El anuncio se envía una sola vez, tras la primera ráfaga (-a3 y -a4).
+ *
+ * @param[in] tamano Tamaño del fichero completo (también en un flujo de una transferencia en paralelo)
+ */
+void setTamano(uint32_t tamano);
+
+/**
+ * Envía el anuncio del tamaño del fichero pedido con setTamano, si aún no se ha enviado.
+ * El servidor no lo confirma: si se pierde, simplemente no reserva el fichero.
+ *
+ * @param[in] socket Descriptor del socket
+ * @param[in] servinfo Dirección del servidor
+ */
+void anunciarTamano(int socket, struct addrinfo *servinfo);
+
+/**
+ * Activa o desactiva el envío de ráfagas con segmentación en el kernel (UDP GSO, GNU/Linux):
+ * los mensajes consecutivos del mismo tamaño se entregan al kernel como un solo datagrama,
+ * que lo divide en un mensaje RCFTP por datagrama. Si la interfaz no lo admite, se desactiva.
+ *
+ * @param[in] gso 1: usar GSO si está disponible; 0: un datagrama por mensaje
+ */
+void setGSO(char gso);
+
+/**
+ * Actualiza el tamaño de segmento a usar según la respuesta (ya validada) del servidor.
+ * Hasta que el servidor acepta la versión 2 no se envían más de RCFTP_BUFLEN bytes.
+ *
+ * @param[in] received Respuesta recibida del servidor
+ * @param[in] seglen Tamaño de segmento en uso
+ * @param[in] window Tamaño de la ventana de emisión (límite del segmento)
+ * @return Tamaño de segmento a usar a partir de ahora
+ */
+int segNegociado(struct rcftp_msg *received, int seglen, int window);
+
+/**
+ * Inicializa el estimador del tiempo de expiración (RTO) de Jacobson/Karels
+ *
+ * @param[in] inicial RTO hasta obtener la primera muestra de RTT (el especificado con -T), en microsegundos
+ */
+void initRTO(unsigned long inicial);
+
+/**
+ * Empieza a medir el RTT de un mensaje recién enviado por primera vez, si no se está midiendo ya otro
+ *
+ * @param[in] numseq Número de secuencia del mensaje
+ * @param[in] len Longitud de los datos del mensaje (si es 0 no se mide)
+ */
+void medirRTT(uint32_t numseq, uint16_t len);
+
+/**
+ * Procesa la confirmación de datos nuevos: anula el backoff del RTO (si ya hay alguna
+ * muestra de RTT) y, si los datos confirmados incluyen los del mensaje medido, actualiza
+ * SRTT, RTTVAR y RTO
+ *
+ * @param[in] inicio Primer byte confirmado
+ * @param[in] fin Byte siguiente al último confirmado
+ */
+void ackRTT(uint32_t inicio, uint32_t fin);
+
+/**
+ * Descarta la medida de RTT en curso si el mensaje reenviado incluye datos del medido (algoritmo de Karn)
+ *
+ * @param[in] numseq Número de secuencia del mensaje reenviado
+ * @param[in] len Longitud de los datos del mensaje reenviado
+ */
+void reenvioRTT(uint32_t numseq, uint16_t len);
+
+/**
+ * Duplica el RTO tras el timeout del mensaje más antiguo sin confirmar (hasta RTO_MAX).
+ * Los timeouts que vencen menos de un RTO después del último backoff son de la misma
+ * pérdida y no vuelven a duplicarlo.
+ *
+ * @return 1: pérdida nueva (RTO duplicado); 0: timeout de una pérdida ya tratada
+ */
+int backoffRTO();
+
+/**
+ * Devuelve el tiempo de expiración a usar en los timeouts
+ *
+ * @return RTO con el backoff aplicado, en microsegundos
+ */
+unsigned long getRTO();
+
+/**
+ * Activa el control de congestión por ritmo de entrega en lugar del basado en pérdidas
+ *
+ * @param[in] usar 1: estimar ancho de banda y RTT mínimo y enviar a ese ritmo; 0: slow start + AIMD
+ */
+void setRitmo(char usar);
+
+/**
+ * Inicializa el control de congestión (slow start + AIMD, o por ritmo) y la ventana efectiva de emisión
+ *
+ * @param[in] maxima Tamaño de la ventana de emisión, máximo de la ventana de congestión
+ * @param[in] seglen Tamaño de segmento en uso
+ */
+void initCongestion(unsigned int maxima, int seglen);
+
+/**
+ * Hace crecer la ventana de congestión con los datos confirmados por primera vez:
+ * en slow start, tantos bytes como se confirman (hasta el umbral); después, un segmento por ventana.
+ * Con el control por ritmo, actualiza el modelo con la muestra anotada por marcaCongestion
+ * y fija la ventana a partir de él. Se llama una vez por respuesta válida.
+ *
+ * @param[in] confirmados Bytes confirmados por primera vez
+ * @param[in] seglen Tamaño de segmento en uso
+ */
+void ackCongestion(unsigned long confirmados, int seglen);
+
+/**
+ * Reduce la ventana de congestión tras una pérdida: el umbral de slow start pasa a la
+ * mitad de los datos en vuelo y la ventana a un segmento
+ *
+ * @param[in] envuelo Bytes enviados y aún no confirmados
+ * @param[in] seglen Tamaño de segmento en uso
+ */
+void perdidaCongestion(unsigned long envuelo, int seglen);
+
+/**
+ * Reduce la ventana de congestión al empezar la recuperación de una pérdida detectada
+ * por confirmaciones duplicadas: ventana y umbral pasan a la mitad de los datos en vuelo,
+ * sin volver a slow start (con el control por ritmo no cambia)
+ *
+ * @param[in] envuelo Bytes enviados y aún no confirmados
+ * @param[in] seglen Tamaño de segmento en uso
+ * @return Ventana de congestión resultante, en bytes (al menos un segmento)
+ */
+unsigned long recuperacionCongestion(unsigned long envuelo, int seglen);
+
+/**
+ * Establece cuántas confirmaciones duplicadas provocan un reenvío rápido
+ *
+ * @param[in] umbral Número de confirmaciones duplicadas (0: sin reenvío rápido)
+ */
+void setReenvioRapido(int umbral);
+
+/**
+ * Reinicia la cuenta de confirmaciones duplicadas y la fase de recuperación
+ */
+void initReenvioRapido();
+
+/**
+ * Cuenta una respuesta con next igual a base (confirmación duplicada) y decide si hay que
+ * reenviar ya el primer mensaje sin confirmar. En ese caso empieza la fase de recuperación,
+ * que dura hasta que se confirme todo lo enviado hasta ahora; en ella no se cuentan duplicadas.
+ *
+ * @param[in] received Respuesta recibida (checksum ya comprobado)
+ * @param[in] base Primer byte sin confirmar
+ * @param[in] nextseq Siguiente byte a enviar por primera vez
+ * @return 1: reenviar ahora; 0: nada que hacer
+ */
+int dupReenvioRapido(struct rcftp_msg *received, uint32_t base, uint32_t nextseq);
+
+/**
+ * Procesa una confirmación que avanza base: reinicia la cuenta de duplicadas y termina
+ * la recuperación si next alcanza lo enviado al empezarla
+ *
+ * @param[in] next Nuevo primer byte sin confirmar
+ * @return 1: sigue la recuperación (confirmación parcial: hay otro hueco); 0: no
+ */
+int ackReenvioRapido(uint32_t next);
+
+/**
+ * Tras un timeout, deja de contar confirmaciones duplicadas hasta que se confirme
+ * todo lo enviado hasta ahora, pues las respuestas a los reenvíos repiten next
+ *
+ * @param[in] nextseq Siguiente byte a enviar por primera vez
+ */
+void timeoutReenvioRapido(uint32_t nextseq);
+
+/**
+ * Anota el envío de datos nuevos (control por ritmo) y retrasa el siguiente envío según el ritmo
+ *
+ * @param[in] numseq Número de secuencia del mensaje
+ * @param[in] len Longitud de los datos del mensaje
+ */
+void envioCongestion(uint32_t numseq, uint16_t len);
+
+/**
+ * Descarta como muestras de ritmo los envíos que se solapan con un reenvío
+ *
+ * @param[in] numseq Número de secuencia del mensaje reenviado
+ * @param[in] len Longitud de los datos del mensaje reenviado
+ */
+void reenvioCongestion(uint32_t numseq, uint16_t len);
+
+/**
+ * Marca como confirmados los envíos contenidos en [inicio,fin) y elige entre ellos
+ * la muestra de ritmo de la respuesta en proceso (antes de ackCongestion)
+ *
+ * @param[in] inicio Primer byte confirmado
+ * @param[in] fin Byte siguiente al último confirmado
+ * @param[in] acumulada 1: confirmación acumulativa, que confirma también los envíos que
+ *            empiezan antes de inicio (una confirmación anterior pudo acabar a mitad de uno)
+ */
+void marcaCongestion(uint32_t inicio, uint32_t fin, char acumulada);
+
+/**
+ * Comprueba si el ritmo de envío permite enviar ya; si no, arma un timer para que
+ * waittimeout vuelva cuando se pueda
+ *
+ * @return 1: se puede enviar; 0: hay que esperar
+ */
+int permiteCongestion();
+
+/**
+ * Reserva el espacio de una ráfaga de mensajes
+ *
+ * @param[out] r Ráfaga a inicializar (vacía)
+ * @param[in] maxlen Longitud máxima de datos de cada mensaje
+ */
+void initRafaga(struct rafaga *r, int maxlen);
+
+/**
+ * Devuelve el espacio del mensaje i-ésimo de una ráfaga
+ *
+ * @param[in] r Ráfaga
+ * @param[in] i Posición del mensaje (menor que MAXRAFAGA)
+ * @return Mensaje, con espacio para las cabeceras y los datos
+ */
+struct rcftp_msg *msgRafaga(struct rafaga *r, int i);
+
+/**
+ * Envía al servidor los mensajes de la ráfaga, con una sola llamada (sendmmsg) en GNU/Linux,
+ * agrupados con GSO si se ha activado con setGSO, y vacía la ráfaga
+ *
+ * @param[in] socket Descriptor del socket
+ * @param[in] servinfo Estructura con la dirección del servidor
+ * @param[in,out] r Ráfaga a enviar
+ */
+void sendRafaga(int socket, struct addrinfo *servinfo, struct rafaga *r);
+
+/**
+ * Envía al servidor las cabeceras de un mensaje RCFTP seguidas de unos datos que no están en
+ * su buffer (p. ej. los de la ventana de emisión), con un solo sendmsg y sin copiarlos
+ *
+ * @param[in] socket Descriptor del socket
+ * @param[in] servinfo Estructura con la dirección del servidor
+ * @param[in] msg Mensaje con las cabeceras ya rellenas (len debe ser la longitud total de los datos)
+ * @param[in] datos Datos a enviar tras las cabeceras
+ * @param[in] ndatos Número de iovec de datos (como mucho 2)
+ */
+void sendMsgDatos(int socket, struct addrinfo *servinfo, struct rcftp_msg *msg, struct iovec *datos, int ndatos);
+
+/**
+ * Obtiene la longitud con la que se envía un mensaje: en formato compacto si el servidor ha
+ * indicado que lo acepta (F_COMPACTO en una respuesta válida); si no, en el formato fijo de
+ * RCFTP_FIXEDLEN bytes, con los datos completados con ceros en el propio mensaje
+ *
+ * @param[in,out] msg Mensaje a enviar (en formato fijo, con espacio para RCFTP_BUFLEN bytes de datos)
+ * @return Bytes a enviar a partir del comienzo del mensaje
+ */
+int lenMsgEnvio(struct rcftp_msg *msg);
+
+/**
+ * Envía un mensaje RCFTP al servidor
+ *
+ * @param[in] socket Descriptor del socket
+ * @param[in] servinfo Estructura con la dirección del servidor
+ * @param[in] msg Mensaje a enviar
+ */
+void sendMsg(int socket, struct addrinfo *servinfo, struct rcftp_msg *msg);
+
 
 /**
  * Algoritmo 1 del cliente
@@ -55,7 +450,19 @@ void alg_stopwait(int socket, struct addrinfo *servinfo);
  * @param[in] socket Descriptor del socket
  * @param[in] servinfo Estructura con la dirección del servidor
  * @param[in] window Tamaño deseado de la ventana deslizante
+ * @param[in] segmento Tamaño de segmento a negociar con el servidor
  */
-void alg_ventana(int socket, struct addrinfo *servinfo,int window);
+void alg_ventana(int socket, struct addrinfo *servinfo,int window, unsigned int segmento);
 
 
+
+
+/**
+ * Algoritmo 4 del cliente
+ *
+ * @param[in] socket Descriptor del socket
+ * @param[in] servinfo Estructura con la dirección del servidor
+ * @param[in] window Tamaño deseado de la ventana deslizante
+ * @param[in] segmento Tamaño de segmento a negociar con el servidor
+ */
+void alg_repsel(int socket, struct addrinfo *servinfo, int window, unsigned int segmento);
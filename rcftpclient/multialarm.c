@@ -29,46 +29,378 @@
 
 #include <stdio.h>
 #include <stdlib.h> 
-#include <signal.h> // sigaction(), sigsuspend(), sig*()
-#include <unistd.h> // alarm()
-#include <sys/time.h> // gettimeofday()
-#include <time.h> // nanosleep()
+#include <unistd.h> // read()
+#include <time.h> // clock_gettime(), nanosleep()
 #include <errno.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/timerfd.h> // timerfd_create(), timerfd_settime()
+#include <sys/epoll.h> // epoll_create1(), epoll_ctl(), epoll_wait()
+#else
+#include <sys/select.h> // select()
+#endif
 
 #include "multialarm.h"
 
+/*
+ * Los timers se guardan en una rueda de tiempos jerárquica (timing wheel):
+ * NIVELES ruedas de RANURAS ranuras cada una. La ranura i del nivel n agrupa los timers que vencen
+ * en un mismo bloque de RANURAS^n ticks; al llegar a ese bloque se reparten (cascada) por el nivel
+ * inferior. Añadir, cancelar y vencer un timer tiene coste constante.
+ */
+#define BITSTICK 14 /* un tick son 2^14 ns (~16 us): los timers vencen como mucho un tick tarde */
+#define BITSRANURA 6
+#define RANURAS (1<<BITSRANURA) /* ranuras por nivel (una por bit de ocupadas[n]) */
+#define MASCARA (RANURAS-1)
+#define NIVELES 4 /* alcance: 2^(14+6*4) ns, unos 275 s; los posteriores se recolocan al llegar */
+
+#define BITSINDICE 16 /* bits del manejador para el índice del timer; el resto, generación */
+#define NINGUNO -1
+
+/* estados de un timer */
+#define LIBRE 0
+#define ARMADO 1
+#define VENCIDO 2 /* vencido y pendiente de recoger con getexpiredtimer() */
+
 /**
- * Contador de timeouts vencidos.
+ * Timer de la rueda, enlazado en la lista de su ranura (o en la de vencidos)
+ */
+struct timer {
+	uint64_t tick; /**< Tick en el que vence (redondeado hacia arriba) */
+	void *dato; /**< Dato asociado por el programa */
+	int ant,sig; /**< Anterior y siguiente en la lista */
+	unsigned short gen; /**< Generación, para detectar manejadores caducados */
+	unsigned char estado; /**< LIBRE, ARMADO o VENCIDO */
+	unsigned char heredado; /**< Añadido con addtimeout/adddelayedtimeout: cuenta en timeouts_vencidos */
+	unsigned char nivel,ranura; /**< Posición en la rueda (si ARMADO) */
+};
+
+/**
+ * Contador de timeouts vencidos en este hilo (de los añadidos con addtimeout y adddelayedtimeout).
  * Uso: comparar con otra variable inicializada a 0; si son distintas, tratar un timeout e incrementar en uno la otra variable.
+ * Solo se actualiza al llamar a waittimeout().
  */
-volatile int timeouts_vencidos=0;
+POR_HILO int timeouts_vencidos=0;
 
 /**
  * Duración de los timeouts, en microsegundos
  */
-static int duracion_timeout=0;
+static POR_HILO int duracion_timeout=0;
 
 /**
  * Tiempo de transmisión a simular, parando el proceso, en microsegundos
  */
-static struct timespec tiempo_transmision;
+static POR_HILO struct timespec tiempo_transmision;
 
 /*
- * Cola circular, con elementos válidos entre [firstelem,lastelem-1]
+ * Timers, lista de libres y rueda (cabeza y cola de la lista de cada ranura). Los timers y la
+ * lista de libres se reservan en el primer uso de cada hilo: en cada hilo solo hay punteros,
+ * y los hilos que no usan alarmas no reservan ni ponen a cero nada.
  */
-static struct timeval tv[MAXALARMS];
-static unsigned int firstelem=0;
-static unsigned int lastelem=0;
+static POR_HILO struct timer *timers=NULL;
+static POR_HILO int *libres=NULL;
+static POR_HILO int nlibres=-1; /* -1: sin inicializar */
+static POR_HILO int cabeza[NIVELES][RANURAS],cola[NIVELES][RANURAS];
+static POR_HILO uint64_t ocupadas[NIVELES]; /* bit i: ranura i con algún timer */
+static POR_HILO uint64_t tickactual; /* todos los ticks anteriores ya se han procesado */
+static POR_HILO int armados=0;
+
+/*
+ * Timers vencidos pendientes de recoger, en orden de vencimiento
+ */
+static POR_HILO int primervencido=NINGUNO,ultimovencido=NINGUNO;
+
+/*
+ * Timeouts heredados (addtimeout/adddelayedtimeout), en orden de creación, para canceltimeout().
+ * Puede contener manejadores ya vencidos, que se descartan al recorrerla.
+ */
+static POR_HILO int *heredados=NULL; /* MAXALARMS elementos, reservados junto con los timers */
+static POR_HILO unsigned int firstelem=0;
+static POR_HILO unsigned int lastelem=0;
+static POR_HILO int numheredados=0; /* heredados armados */
+static POR_HILO int ultimoheredado=NINGUNO; /* último añadido, para adddelayedtimeout */
+static POR_HILO uint64_t ultimovencimiento; /* vencimiento (ns) del último añadido */
+
+#ifdef __linux__
+/*
+ * timerfd programado al siguiente tick con trabajo, y epoll que lo espera junto al descriptor del programa
+ */
+static POR_HILO int tfd=-1;
+static POR_HILO int epfd=-1;
+static POR_HILO int fdregistrado=-1;
+#endif
+static POR_HILO uint64_t tickprogramado=0; /* tick al que está programada la alarma; 0: ninguno */
+
+
+/**************************************************************************/
+/* Funciones auxiliares de tiempo */
+/**************************************************************************/
+static uint64_t ahora() {
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_MONOTONIC,&t)==-1) {
+		perror("Error en clock_gettime");
+		exit(2);
+	}
+	return (uint64_t)t.tv_sec*1000000000+t.tv_nsec;
+}
+
+/**************************************************************************/
+/* Funciones auxiliares de la rueda */
+/**************************************************************************/
+static void inicializa() {
+	int i,n;
+
+	timers=calloc(MAXALARMS,sizeof(struct timer));
+	libres=malloc(MAXALARMS*sizeof(int));
+	heredados=malloc(MAXALARMS*sizeof(int));
+	if (timers==NULL || libres==NULL || heredados==NULL) {
+		perror("Error al reservar memoria para las alarmas");
+		exit(2);
+	}
+	for (i=0;i<MAXALARMS;i++)
+		libres[i]=MAXALARMS-1-i;
+	nlibres=MAXALARMS;
+	for (n=0;n<NIVELES;n++)
+		for (i=0;i<RANURAS;i++)
+			cabeza[n][i]=cola[n][i]=NINGUNO;
+	tickactual=ahora()>>BITSTICK;
+}
+
+static int manejador(int i) {
+	return (timers[i].gen<<BITSINDICE)|i;
+}
+
+// índice del timer de un manejador, o NINGUNO si ya no corresponde a ningún timer
+static int indice(int handle) {
+	int i=handle&((1<<BITSINDICE)-1);
+
+	if (handle<0 || timers==NULL || i>=MAXALARMS || timers[i].estado==LIBRE || manejador(i)!=handle)
+		return NINGUNO;
+	return i;
+}
+
+static void liberar(int i) {
+	timers[i].estado=LIBRE;
+	timers[i].gen=(timers[i].gen+1)&0x7fff; // el manejador sigue siendo positivo
+	libres[nlibres++]=i;
+}
+
+// enlaza el timer i al final de la lista [*prim,*ult]
+static void enlazar(int i, int *prim, int *ult) {
+	timers[i].ant=*ult;
+	timers[i].sig=NINGUNO;
+	if (*ult==NINGUNO)
+		*prim=i;
+	else
+		timers[*ult].sig=i;
+	*ult=i;
+}
+
+static void desenlazar(int i, int *prim, int *ult) {
+	if (timers[i].ant==NINGUNO)
+		*prim=timers[i].sig;
+	else
+		timers[timers[i].ant].sig=timers[i].sig;
+	if (timers[i].sig==NINGUNO)
+		*ult=timers[i].ant;
+	else
+		timers[timers[i].sig].ant=timers[i].ant;
+}
+
+static void vencer(int i) {
+	armados--;
+	if (timers[i].heredado) {
+		timeouts_vencidos++;
+		numheredados--;
+		liberar(i);
+	} else {
+		timers[i].estado=VENCIDO;
+		enlazar(i,&primervencido,&ultimovencido);
+	}
+}
+
+// coloca un timer armado en la ranura que le corresponde según lo que falta para su tick
+static void colocar(int i) {
+	uint64_t tick=timers[i].tick,delta;
+	int n;
+
+	if (tick<tickactual) { // ya ha vencido
+		vencer(i);
+		return;
+	}
+	delta=tick-tickactual;
+	for (n=0;n<NIVELES-1 && delta>=((uint64_t)1<<(BITSRANURA*(n+1)));n++)
+		;
+	if (delta>=((uint64_t)1<<(BITSRANURA*NIVELES))) // fuera de alcance: se recolocará al llegar
+		tick=tickactual+((uint64_t)1<<(BITSRANURA*NIVELES))-1;
+	timers[i].nivel=n;
+	timers[i].ranura=(tick>>(BITSRANURA*n))&MASCARA;
+	enlazar(i,&cabeza[n][timers[i].ranura],&cola[n][timers[i].ranura]);
+	ocupadas[n]|=(uint64_t)1<<timers[i].ranura;
+}
+
+static void quitar(int i) {
+	int n=timers[i].nivel,r=timers[i].ranura;
+
+	desenlazar(i,&cabeza[n][r],&cola[n][r]);
+	if (cabeza[n][r]==NINGUNO)
+		ocupadas[n]&=~((uint64_t)1<<r);
+}
+
+// reparte por los niveles inferiores la ranura del nivel n que corresponde a tickactual
+static void cascada(int n) {
+	int r=(tickactual>>(BITSRANURA*n))&MASCARA;
+	int i,sig;
+
+	i=cabeza[n][r];
+	cabeza[n][r]=cola[n][r]=NINGUNO;
+	ocupadas[n]&=~((uint64_t)1<<r);
+	if (r==0 && n+1<NIVELES) // empieza también un bloque del nivel superior
+		cascada(n+1);
+	for (;i!=NINGUNO;i=sig) {
+		sig=timers[i].sig;
+		colocar(i);
+	}
+}
+
+// procesa todos los ticks hasta hasta (incluido)
+static void avanzar(uint64_t hasta) {
+	int r,i,sig;
 
+	while (tickactual<=hasta) {
+		r=tickactual&MASCARA;
+		if (ocupadas[0] & ((uint64_t)1<<r)) {
+			i=cabeza[0][r];
+			cabeza[0][r]=cola[0][r]=NINGUNO;
+			ocupadas[0]&=~((uint64_t)1<<r);
+			for (;i!=NINGUNO;i=sig) {
+				sig=timers[i].sig;
+				vencer(i);
+			}
+		}
+		if (ocupadas[0]==0) { // sin nada en el nivel 0, saltamos al siguiente bloque
+			if ((tickactual|MASCARA)>=hasta) {
+				tickactual=hasta+1;
+				if ((tickactual&MASCARA)==0)
+					cascada(1);
+				break;
+			}
+			tickactual=(tickactual|MASCARA)+1;
+		} else {
+			tickactual++;
+		}
+		if ((tickactual&MASCARA)==0)
+			cascada(1);
+	}
+}
+
+// siguiente tick en el que hay que hacer algo (vencer o repartir), o 0 si no hay timers armados
+static uint64_t siguientetick() {
+	uint64_t bloque,rotadas,candidato,mejor=0;
+	int n,desp;
+
+	if (armados==0)
+		return 0;
+	for (n=0;n<NIVELES;n++) {
+		if (ocupadas[n]==0)
+			continue;
+		// en el nivel n, la ranura r se procesa al empezar el siguiente bloque con índice r
+		bloque=tickactual>>(BITSRANURA*n);
+		if (n>0)
+			bloque++;
+		desp=bloque&MASCARA;
+		rotadas=(ocupadas[n]>>desp)|(desp?ocupadas[n]<<(RANURAS-desp):0);
+		candidato=(bloque+__builtin_ctzll(rotadas))<<(BITSRANURA*n);
+		if (mejor==0 || candidato<mejor)
+			mejor=candidato;
+	}
+	return mejor;
+}
 
 /**************************************************************************/
-/* Gestor de interrupción de alarma */
+/* Programa la alarma al siguiente tick con trabajo (o la desactiva), si ha cambiado */
 /**************************************************************************/
-void handle_sigalrm(int sig) {
-	timeouts_vencidos++;
-	signal(SIGALRM,handle_sigalrm);
-	canceltimeout();
-	/* Lo recomendable sería llamar a setnextalarm() desde el programa principal, al detectar un timeout vencido, pero por legibilidad lo situamos aquí */
+static void programaalarma(int forzar) {
+	uint64_t tick=siguientetick();
+#ifdef __linux__
+	struct itimerspec alarma;
+#endif
+
+	if (tick==tickprogramado && !forzar)
+		return;
+	tickprogramado=tick;
+#ifdef __linux__
+	if (tfd<0)
+		return;
+	alarma.it_interval.tv_sec=0;
+	alarma.it_interval.tv_nsec=0;
+	// it_value a 0 desactiva la alarma; un tick ya pasado salta en seguida
+	alarma.it_value.tv_sec=(tickprogramado<<BITSTICK)/1000000000;
+	alarma.it_value.tv_nsec=(tickprogramado<<BITSTICK)%1000000000;
+	if (timerfd_settime(tfd,TFD_TIMER_ABSTIME,&alarma,NULL)==-1) {
+		perror("Error en timerfd_settime");
+		exit(2);
+	}
+#endif
+	// sin timerfd, la espera se calcula en cada llamada a waittimeout
+}
+
+/**************************************************************************/
+/* Procesa los ticks transcurridos y reprograma la alarma */
+/**************************************************************************/
+static void actualizatimeouts() {
+	if (nlibres<0)
+		inicializa();
+	avanzar(ahora()>>BITSTICK);
+	programaalarma(0);
+}
+
+// arma un timer que vence en el instante vence (ns); devuelve su índice, o NINGUNO si no caben más
+static int armar(uint64_t vence, void *dato, unsigned char heredado) {
+	int i;
+
+	if (nlibres<0)
+		inicializa();
+	if (nlibres==0)
+		return NINGUNO;
+	i=libres[--nlibres];
+	timers[i].tick=(vence+(1<<BITSTICK)-1)>>BITSTICK;
+	timers[i].dato=dato;
+	timers[i].estado=ARMADO;
+	timers[i].heredado=heredado;
+	armados++;
+	colocar(i);
+	if (timers[i].estado==ARMADO && (tickprogramado==0 || timers[i].tick<tickprogramado))
+		programaalarma(0);
+	return i;
+}
+
+// añade un timeout heredado a la lista de canceltimeout(); 0 si no cabe
+static int addheredado(uint64_t vence) {
+	unsigned int j,k;
+	int i;
+
+	// descartamos los ya vencidos del principio
+	while (firstelem!=lastelem && indice(heredados[firstelem])==NINGUNO)
+		firstelem=(firstelem+1)%MAXALARMS;
+	if (firstelem==((lastelem+1)%MAXALARMS)) { // lista llena: la compactamos
+		for (j=k=firstelem;j!=lastelem;j=(j+1)%MAXALARMS)
+			if (indice(heredados[j])!=NINGUNO) {
+				heredados[k]=heredados[j];
+				k=(k+1)%MAXALARMS;
+			}
+		lastelem=k;
+	}
+	if (firstelem==((lastelem+1)%MAXALARMS) || (i=armar(vence,NULL,1))==NINGUNO) {
+		fprintf(stderr,"addtimeout: No se ha podido añadir alarma; se ha alcanzado el límite de alarmas pendientes (%d)\n",MAXALARMS);
+		return 0;
+	}
+	numheredados++;
+	ultimoheredado=heredados[lastelem]=manejador(i);
+	ultimovencimiento=vence;
+	lastelem=(lastelem+1)%MAXALARMS;
+	return 1;
 }
 
 /**************************************************************************/
@@ -93,153 +425,210 @@ void settimeoutduration(unsigned long usec, unsigned long usleep) {
 /* Devuelve 1 si se ha podido añadir; 0 si no se ha podido añadir */
 /**************************************************************************/
 int addtimeout() {
-	struct timezone tz;
-	struct itimerval timeout;
-
 	if (duracion_timeout==0) {
 		fprintf(stderr,"Error: intentando añadir un timeout sin haber especificado su duración\n");
 		exit(3);
 	}
-	if (firstelem==((lastelem+1)%MAXALARMS)) { // vector lleno
-		fprintf(stderr,"addtimeout: No se ha podido añadir alarma; se ha alcanzado el límite de alarmas pendientes (%d)\n",MAXALARMS);
-		//exit(3);
+	return addtimeoutduration(duracion_timeout);
+}
+
+/**************************************************************************/
+/* Añade una alarma para saltar dentro de usec microsegundos */
+/* Duerme el proceso durante el tiempo de transmisión especificado */
+/* Devuelve 1 si se ha podido añadir; 0 si no se ha podido añadir */
+/**************************************************************************/
+int addtimeoutduration(unsigned long usec) {
+	if (usec==0) {
+		fprintf(stderr,"Error: No se puede especificar una duración de 0\n");
+		exit(3);
+	}
+	if (!addheredado(ahora()+(uint64_t)usec*1000))
 		return 0;
-	} else { // añadimos tiempo actual al vector
-		if (gettimeofday(&tv[lastelem],&tz)==-1) {
-			perror("Error en gettimeofday");
-			exit(2);
-		}
-		if (firstelem==lastelem) { // ninguna alarma activa
-			//fprintf(stderr,"Activando alarma\n");
-			timeout.it_value.tv_sec=duracion_timeout/1000000;
-			timeout.it_value.tv_usec=duracion_timeout%1000000;
-			timeout.it_interval.tv_sec=0;
-			timeout.it_interval.tv_usec=0;
-			setitimer(ITIMER_REAL,&timeout,NULL);
-		}
-		//fprintf(stderr,"Añadiendo alarma\n");
-		lastelem=(lastelem+1)%MAXALARMS;
-		//fprintf(stderr,"Alarmas activas: %d\n",(MAXALARMS+(lastelem-firstelem))%MAXALARMS);
-
-		// dormimos el tiempo requerido para realizar la transmisión
-		// si nos interrumpen, no hacemos nada (podríamos ponernos a dormir otra vez)
-		if ((nanosleep(&tiempo_transmision,NULL)==-1) && (errno!=EINTR)) {
-			perror("Error en nanosleep");
-			exit(2);
-		}
 
-		return 1;
+	// dormimos el tiempo requerido para realizar la transmisión
+	// sin señales, la espera solo se interrumpe si el programa recibe alguna
+	if ((nanosleep(&tiempo_transmision,NULL)==-1) && (errno!=EINTR)) {
+		perror("Error en nanosleep");
+		exit(2);
 	}
+	return 1;
 }
 
 
 /**************************************************************************/
 /* Añade una alarma para saltar en max(duracion_timeout,timeoutanterior+delay) microsegundos */
-/* NO HAY QUE ALTERNAR LLAMADAS addtimeout y adddelayedtimeout: podrían desordenar el vector */
 /* Devuelve 1 si se ha podido añadir; 0 si no se ha podido añadir */
 /**************************************************************************/
 int adddelayedtimeout(unsigned long delay) {
-	struct timezone tz;
-	struct itimerval timeout;
-	struct timeval delayed;
+	uint64_t vence;
 
 	if (duracion_timeout==0) {
 		fprintf(stderr,"Error: intentando añadir un timeout sin haber especificado su duración\n");
 		exit(3);
 	}
-	if (firstelem==((lastelem+1)%MAXALARMS)) { // vector lleno
-		fprintf(stderr,"addtimeout: No se ha podido añadir alarma; se ha alcanzado el límite de alarmas pendientes (%d)\n",MAXALARMS);
-		//exit(3);
+	vence=ahora()+(uint64_t)duracion_timeout*1000;
+	// si el timeout anterior sigue pendiente, este vence como pronto delay después
+	if (indice(ultimoheredado)!=NINGUNO && ultimovencimiento+(uint64_t)delay*1000>vence)
+		vence=ultimovencimiento+(uint64_t)delay*1000;
+	return addheredado(vence);
+}
+
+
+
+/**************************************************************************/
+/* Cancela el timeout más antiguo y programa la siguiente alarma, si existe */
+/**************************************************************************/
+int canceltimeout() {
+	while (firstelem!=lastelem && indice(heredados[firstelem])==NINGUNO)
+		firstelem=(firstelem+1)%MAXALARMS;
+	if (firstelem==lastelem) {
+		fprintf(stderr,"Error: no queda ningún timeout que cancelar\n");
 		return 0;
-	} else { // añadimos tiempo actual al vector
-		if (gettimeofday(&tv[lastelem],&tz)==-1) {
-			perror("Error en gettimeofday");
-			exit(2);
-		}
-		if (getnumtimeouts()!=0) { // hay un timeout anterior
-			delayed.tv_sec=tv[(lastelem+MAXALARMS-1)%MAXALARMS].tv_sec
-					+(tv[(lastelem+MAXALARMS-1)%MAXALARMS].tv_usec+delay)/1000000;
-			delayed.tv_usec=(tv[(lastelem+MAXALARMS-1)%MAXALARMS].tv_usec+delay)%1000000;
-			if (delayed.tv_sec>tv[lastelem].tv_sec || (delayed.tv_sec==tv[lastelem].tv_sec&&
-					delayed.tv_usec>tv[lastelem].tv_sec)) { // si el retardado es mayor
-				tv[lastelem].tv_sec=delayed.tv_sec;
-				tv[lastelem].tv_usec=delayed.tv_usec;
-			}
-		} else {
-		//if (firstelem==lastelem) { // ninguna alarma activa
-			//fprintf(stderr,"Activando alarma\n");
-			timeout.it_value.tv_sec=duracion_timeout/1000000;
-			timeout.it_value.tv_usec=duracion_timeout%1000000;
-			timeout.it_interval.tv_sec=0;
-			timeout.it_interval.tv_usec=0;
-			setitimer(ITIMER_REAL,&timeout,NULL);
-		}
-		//fprintf(stderr,"Añadiendo alarma\n");
-		lastelem=(lastelem+1)%MAXALARMS;
-		//fprintf(stderr,"Alarmas activas: %d\n",(MAXALARMS+(lastelem-firstelem))%MAXALARMS);
-		return 1;
 	}
+	canceltimer(heredados[firstelem]);
+	firstelem=(firstelem+1)%MAXALARMS;
+	return (numheredados>0);
 }
 
+/**************************************************************************/
+/* Añade un timer con un dato asociado */
+/**************************************************************************/
+int addtimer(unsigned long usec, void *dato) {
+	int i=armar(ahora()+(uint64_t)usec*1000,dato,0);
 
+	if (i==NINGUNO) {
+		fprintf(stderr,"addtimer: No se ha podido añadir el timer; se ha alcanzado el límite de timers pendientes (%d)\n",MAXALARMS);
+		return -1;
+	}
+	return manejador(i);
+}
 
 /**************************************************************************/
-/* Actualiza el vector de alarmas pendientes, los timeouts vencidos y programa la siguiente alarma, si existe. Debe llamarse desde el programa principal para cancelar un timeout (el más antiguo) que aún no ha vencido. */
+/* Cancela un timer por su manejador */
 /**************************************************************************/
-int canceltimeout() {
-	long timeelapsed;
-	struct timeval tactual;
-	struct timezone tz;
-	char buscar_alarma=1;
-	struct itimerval timeout;
+int canceltimer(int handle) {
+	int i=indice(handle);
 
-	if (getnumtimeouts()==0) {
-		fprintf(stderr,"Error: no queda ningún timeout que cancelar\n");
+	if (i==NINGUNO)
 		return 0;
+	if (timers[i].estado==ARMADO) {
+		quitar(i);
+		armados--;
+		if (timers[i].heredado)
+			numheredados--;
+	} else { // vencido pero aún no recogido
+		desenlazar(i,&primervencido,&ultimovencido);
 	}
-		
-	while (buscar_alarma) {
-		//fprintf(stderr,"Quitando alarma\n");
-		firstelem=(firstelem+1)%MAXALARMS; // quitamos alarma vencida
-		if (firstelem!=lastelem) { // hay alarmas pendientes
-			if (gettimeofday(&tactual,&tz)==-1) {
-				perror("Error en gettimeofday");
+	liberar(i);
+	// la alarma puede quedar programada antes de tiempo: al saltar se reprograma
+	return 1;
+}
+
+/**************************************************************************/
+/* Devuelve un timer vencido y lo libera */
+/**************************************************************************/
+int getexpiredtimer(void **dato) {
+	int i=primervencido,handle;
+
+	if (i==NINGUNO)
+		return -1;
+	desenlazar(i,&primervencido,&ultimovencido);
+	handle=manejador(i);
+	if (dato!=NULL)
+		*dato=timers[i].dato;
+	liberar(i);
+	return handle;
+}
+
+/**************************************************************************/
+/* Actualiza los timeouts vencidos y, si se pide, espera a fd o al siguiente timeout */
+/**************************************************************************/
+int waittimeout(int fd, int block) {
+	int listo=0;
+#ifdef __linux__
+	struct epoll_event ev[2];
+	uint64_t expiraciones;
+	int i,n;
+#else
+	fd_set lectura;
+	struct timeval espera,*pespera=NULL;
+	uint64_t tactual,tespera;
+	int n;
+#endif
+
+	int vencidos=timeouts_vencidos;
+	actualizatimeouts();
+	// nada que esperar, o timeouts ya vencidos (quizá durante el nanosleep de addtimeout)
+	if (!block || vencidos!=timeouts_vencidos || primervencido!=NINGUNO || (fd<0 && armados==0))
+		return 0;
+
+#ifdef __linux__
+	if (tfd<0) {
+		if ((tfd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC))==-1) {
+			perror("Error en timerfd_create");
+			exit(2);
+		}
+		if ((epfd=epoll_create1(EPOLL_CLOEXEC))==-1) {
+			perror("Error en epoll_create1");
+			exit(2);
+		}
+		ev[0].events=EPOLLIN;
+		ev[0].data.fd=tfd;
+		if (epoll_ctl(epfd,EPOLL_CTL_ADD,tfd,&ev[0])==-1) {
+			perror("Error en epoll_ctl");
+			exit(2);
+		}
+		programaalarma(1);
+	}
+	if (fd!=fdregistrado) {
+		if (fdregistrado>=0)
+			epoll_ctl(epfd,EPOLL_CTL_DEL,fdregistrado,NULL); // puede haberse cerrado ya
+		ev[0].events=EPOLLIN;
+		ev[0].data.fd=fd;
+		if (fd>=0 && epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev[0])==-1) {
+			perror("Error en epoll_ctl");
+			exit(2);
+		}
+		fdregistrado=fd;
+	}
+	if ((n=epoll_wait(epfd,ev,2,-1))==-1 && errno!=EINTR) {
+		perror("Error en epoll_wait");
+		exit(2);
+	}
+	for (i=0;i<n;i++) {
+		if (ev[i].data.fd==tfd) { // vaciamos el contador del timerfd
+			if (read(tfd,&expiraciones,sizeof(expiraciones))==-1 && errno!=EAGAIN) {
+				perror("Error leyendo del timerfd");
 				exit(2);
 			}
-			timeelapsed=1000000*(tactual.tv_sec-tv[firstelem].tv_sec);
-			timeelapsed+=tactual.tv_usec-tv[firstelem].tv_usec;
-			if (duracion_timeout-timeelapsed<0)
-				timeouts_vencidos++;
-			else
-				buscar_alarma=0;
-		} else // no hay alarmas pendientes
-			buscar_alarma=0;
-	}
-	if (firstelem!=lastelem) {// hay alarmas pendientes
-		if (duracion_timeout-timeelapsed<10) // damos margen minimo a alarmas muy seguidas
-			timeelapsed=duracion_timeout-10;
-		//fprintf(stderr,"Activando alarma en %ld mus\n",duracion_timeout-timeelapsed);
-		timeout.it_value.tv_sec=(duracion_timeout-timeelapsed)/1000000;
-		timeout.it_value.tv_usec=(duracion_timeout-timeelapsed)%1000000;
-		timeout.it_interval.tv_sec=0;
-		timeout.it_interval.tv_usec=0;
-		setitimer(ITIMER_REAL,&timeout,NULL);
-		return 1;
-	} else {
-		//fprintf(stderr,"No hay alarmas pendientes\n");
-		timeout.it_value.tv_sec=0;
-		timeout.it_value.tv_usec=0;
-		timeout.it_interval.tv_sec=0;
-		timeout.it_interval.tv_usec=0;
-		setitimer(ITIMER_REAL,&timeout,NULL);
-		return 0;
+		} else if (ev[i].data.fd==fd) {
+			listo=1;
+		}
+	}
+#else
+	FD_ZERO(&lectura);
+	if (fd>=0)
+		FD_SET(fd,&lectura);
+	if (tickprogramado!=0) { // esperamos como mucho hasta el siguiente tick con trabajo
+		tactual=ahora();
+		tespera=(tickprogramado<<BITSTICK)>tactual?((tickprogramado<<BITSTICK)-tactual+999)/1000:0;
+		espera.tv_sec=tespera/1000000;
+		espera.tv_usec=tespera%1000000;
+		pespera=&espera;
 	}
+	if ((n=select(fd+1,&lectura,NULL,NULL,pespera))==-1 && errno!=EINTR) {
+		perror("Error en select");
+		exit(2);
+	}
+	listo=(n>0 && fd>=0 && FD_ISSET(fd,&lectura));
+#endif
+	actualizatimeouts();
+	return listo;
 }
 
 /**************************************************************************/
 /* Devuelve el número de timeouts programados (pendientes de vencer) */
 /**************************************************************************/
 int getnumtimeouts() {
-	return ((lastelem+MAXALARMS)-firstelem)%MAXALARMS;
+	return numheredados;
 }
-
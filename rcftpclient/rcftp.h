@@ -30,17 +30,38 @@
 /*********************************************************/
 
 #include <netinet/in.h>
+#include <stddef.h>
 
 /**
- * Longitud de buffer de datos
+ * Longitud de buffer de datos (versión 1)
  */
 #define RCFTP_BUFLEN 512
 
+/**
+ * Longitud máxima de datos de un segmento en versión 2 (cabe en un datagrama UDP)
+ */
+#define RCFTP_MAXBUFLEN 65000
+
+/**
+ * Tamaño máximo de los datos de un datagrama UDP sobre IPv4 (65535 menos 20 de IP y 8 de UDP):
+ * lo que el cliente agrupa en un envío con GSO y lo que el servidor recibe agrupado con GRO
+ */
+#define MAXDATAGRAMA 65507
+
 /**
  * Versión del protocolo
  */
 #define RCFTP_VERSION_1 1
 
+/**
+ * Versión 2 del protocolo: segmentos de tamaño negociado, hasta RCFTP_MAXBUFLEN
+ *
+ * El cliente indica en el campo next de sus mensajes el tamaño de segmento que propone,
+ * y no envía más de RCFTP_BUFLEN bytes hasta recibir una respuesta de versión 2, que lleva
+ * en numseq el tamaño aceptado por el servidor. El resto de campos es igual que en versión 1.
+ */
+#define RCFTP_VERSION_2 2
+
 /**
  * Flag por defecto
  */
@@ -57,6 +78,34 @@
  * Flag de aviso de finalización forzosa
  */
 #define F_ABORT 	4
+/**
+ * Flag de primer mensaje de un flujo de una transferencia en paralelo
+ *
+ * El cliente puede dividir un fichero en rangos y enviar cada uno por un flujo (socket) distinto.
+ * En cada flujo, numseq es la posición de los datos en el fichero, y el mensaje que empieza en
+ * el primer byte del rango lleva F_FLUJO y, en next, el identificador de la transferencia (en lugar
+ * del tamaño de segmento propuesto). El servidor escribe los rangos de una misma transferencia
+ * y un mismo cliente en el mismo fichero, cada uno en su posición.
+ */
+#define F_FLUJO 	8
+/**
+ * Flag de anuncio del tamaño del fichero
+ *
+ * Mensaje sin datos que el cliente envía una sola vez al empezar, sin esperar respuesta, con
+ * numseq igual al primer byte que envía y el tamaño total del fichero en next. Es solo una
+ * indicación: el servidor puede reservar el fichero de antemano, y no lo confirma.
+ */
+#define F_TAMANO	16
+/**
+ * Flag de formato compacto
+ *
+ * El cliente lo pone en todos sus mensajes para ofrecer el formato compacto, y el servidor que
+ * lo acepta responde en ese formato y con el flag. Hasta recibir una respuesta con F_COMPACTO, el
+ * cliente envía en formato fijo, así que sigue funcionando con un servidor que no lo conoce (y
+ * que ignora el flag). La longitud del datagrama no basta para distinguir los formatos: un
+ * segmento compacto de RCFTP_BUFLEN bytes de datos mide lo mismo que un mensaje en formato fijo.
+ */
+#define F_COMPACTO	32
 
 /**
  * Estructura para el formato de mensaje RCFTP
@@ -71,13 +120,44 @@ struct __attribute__ ((packed)) rcftp_msg {
 #else
 struct rcftp_msg {
 #endif
-    uint8_t	version;		/**< Versión RCFTP_VERSION_1; cualquier otro es inválido */
+    uint8_t	version;		/**< Versión RCFTP_VERSION_1 o RCFTP_VERSION_2; cualquier otro es inválido */
     uint8_t	flags;			/**< Flags. Máscara de bits de los defines F_X */
     uint16_t	sum;		/**< Checksum calculado con xsum */
     uint32_t	numseq;		/**< Número de secuencia, medido en bytes */
     uint32_t	next;		/**< Siguiente numseq esperado, medido en bytes */
     uint16_t	len;		/**< Longitud de datos válidos, no cabeceras */
-    uint8_t	buffer[RCFTP_BUFLEN];	/**< Datos, de longitud fija RCFTP_BUFLEN (512)*/
+    uint8_t	buffer[RCFTP_MAXBUFLEN];	/**< Datos: hasta RCFTP_BUFLEN (512) en versión 1, hasta RCFTP_MAXBUFLEN en versión 2 */
+};
+
+/**
+ * Longitud de las cabeceras de un mensaje RCFTP (todo salvo buffer)
+ *
+ * Un mensaje puede viajar en formato compacto, con RCFTP_HDRLEN+len bytes, o en el
+ * formato fijo original, con RCFTP_FIXEDLEN bytes. El checksum cubre los bytes
+ * que viajan; en formato fijo los bytes de buffer a partir de len deberían ser 0, con lo
+ * que el checksum es el mismo en ambos formatos.
+ */
+#define RCFTP_HDRLEN (offsetof(struct rcftp_msg,buffer))
+
+/**
+ * Longitud de un mensaje en formato fijo (cabeceras y RCFTP_BUFLEN bytes de datos)
+ */
+#define RCFTP_FIXEDLEN (RCFTP_HDRLEN+RCFTP_BUFLEN)
+
+/**
+ * Bloque de confirmación selectiva (SACK)
+ *
+ * En repetición selectiva, las respuestas del servidor llevan en buffer un bloque por
+ * cada rango de datos recibido fuera de orden, y len indica la longitud total de los bloques.
+ * El primer bloque es el que contiene el último mensaje recibido. Los campos van en formato de red.
+ */
+#ifdef __GNUC__
+struct __attribute__ ((packed)) rcftp_sack {
+#else
+struct rcftp_sack {
+#endif
+    uint32_t	inicio;		/**< Primer número de secuencia recibido del rango */
+    uint32_t	fin;		/**< Número de secuencia siguiente al último recibido del rango */
 };
 
 
@@ -101,6 +181,26 @@ void print_rcftp_msg(struct rcftp_msg *mensaje, int len);
 void print_flags(uint8_t flags);
 
 
+/**
+ * Calcula la longitud del mensaje en formato compacto (cabeceras + datos válidos)
+ *
+ * @param[in] mensaje Mensaje con el campo len relleno
+ * @return Longitud en bytes del mensaje en formato compacto
+ */
+int rcftp_msglen(struct rcftp_msg *mensaje);
+
+
+/**
+ * Comprueba que la longitud de un mensaje recibido corresponde a alguno de los formatos
+ * y que la longitud de datos no supera la máxima de su versión
+ *
+ * @param[in] mensaje Mensaje a comprobar
+ * @param[in] len Longitud recibida
+ * @return 1: formato compacto o fijo; 0: longitud incorrecta
+ */
+int islenvalid(struct rcftp_msg *mensaje, int len);
+
+
 /**
  * Comprueba el checksum de un mensaje
  * 
@@ -124,3 +224,47 @@ int issumvalid(struct rcftp_msg *mensaje,int len);
  */
 uint16_t xsum(char *buf, int len);
 
+
+/**
+ * Calcula la suma de 16-bit con acarreo sin negar (suma parcial), como si buf
+ * empezara en una posición par. Permite calcular el checksum por partes.
+ *
+ * @param[in] buf Datos a sumar
+ * @param[in] len Longitud de los datos (en bytes)
+ * @return Suma parcial (sin negar)
+ */
+uint16_t xsumparcial(char *buf, int len);
+
+
+/**
+ * Copia datos y calcula a la vez su suma parcial, recorriéndolos una sola vez
+ *
+ * @param[out] dst Destino de la copia
+ * @param[in] src Datos a copiar y sumar
+ * @param[in] len Longitud de los datos (en bytes)
+ * @return Suma parcial de los datos (sin negar), como la de xsumparcial
+ */
+uint16_t xsumcopia(char *dst, char *src, int len);
+
+
+/**
+ * Combina dos sumas parciales
+ *
+ * @param[in] suma Suma parcial de los datos anteriores
+ * @param[in] parcial Suma parcial del bloque a añadir
+ * @param[in] offset Posición (en bytes) del bloque a añadir respecto al inicio de la suma
+ * @return Suma parcial del conjunto (sin negar)
+ */
+uint16_t xsumcombina(uint16_t suma, uint16_t parcial, int offset);
+
+
+/**
+ * Calcula el checksum de un mensaje a partir de la suma parcial de sus datos,
+ * sumando solo las cabeceras (coste constante). Es el checksum del mensaje en formato
+ * compacto, y también en formato fijo si el resto de buffer vale 0.
+ *
+ * @param[in] mensaje Mensaje con las cabeceras ya rellenas (el campo sum se ignora)
+ * @param[in] sumadatos Suma parcial de los datos del buffer
+ * @return Campo Checksum de RCFTP (suma negada), igual al de xsum sobre el mensaje
+ */
+uint16_t xsummensaje(struct rcftp_msg *mensaje, uint16_t sumadatos);
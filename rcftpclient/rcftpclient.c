@@ -20,11 +20,16 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <stdint.h>
 #include <math.h>
 #include "rcftp.h"
 #include "rcftpclient.h"
 #include "multialarm.h"
 #include "misfunciones.h"
+#include "vemision.h"
 
 
 /**************************************************************************/
@@ -49,13 +54,20 @@
 // para estadísticas de velocidad efectiva
 static unsigned int numbytesleidos=0;
 
+// rango de la entrada estándar a enviar en una transferencia en paralelo (-n); finrango<0: todo
+static off_t posrango=0;
+static off_t finrango=-1;
+
+// entrada estándar proyectada en memoria (mmap) si es un fichero; NULL: se lee con read/pread
+static char *entrada=NULL;
+
 // variable para indicar si mostrar información extra durante la ejecución
 // como la mayoría de las funciones necesitaran consultarla, la definimos global
 char verb;
 
 // variable externa que muestra el número de timeouts vencidos
 // Uso: Comparar con otra variable inicializada a 0; si son distintas, tratar un timeout e incrementar en uno la otra variable
-extern volatile const int timeouts_vencidos;
+extern POR_HILO const int timeouts_vencidos;
 
 // variable externa (misfunciones.c) con la cadena de autores a mostrar
 extern char* autores;
@@ -71,22 +83,45 @@ int main(int argc,char *argv[]) {
     char *port,*dest; // punteros a strings especificando puerto y destino
 	struct addrinfo *servinfo=NULL; // puntero a dirección del servidor
 	unsigned int window; // tamaño de la ventana deslizante
+	unsigned int segmento; // tamaño de segmento a proponer (versión 2 si >RCFTP_BUFLEN)
 	unsigned long ttrans; // tiempo de transmisión a simular
 	unsigned long timeout; // tiempo de expiración a simular
+	char gso; // enviar las ráfagas con segmentación en el kernel (UDP GSO)
+	char ritmo; // control de congestión por ritmo de entrega en lugar de por pérdidas
+	int duplicados; // confirmaciones duplicadas que provocan un reenvío rápido (0: ninguno)
+	int flujos; // flujos en paralelo en los que dividir el fichero
+	char tamano; // anunciar al servidor el tamaño del fichero
 
 	/* imprimir nombre de autores */
 	printf("%s\n",autores);
 
 	/* leer parametros de entrada */
-    initargs(argc,argv,&verb,&alg,&window,&ttrans,&timeout,&dest,&port);
+    initargs(argc,argv,&verb,&alg,&window,&segmento,&gso,&ritmo,&duplicados,&flujos,&tamano,&ttrans,&timeout,&dest,&port);
+
+	/* dividir el fichero en flujos en paralelo; cada proceso hijo sigue con su rango */
+	if (flujos>1)
+		repartirflujos(flujos);
+	/* si la entrada es un fichero, leerla (y reenviarla) directamente de memoria */
+	mapearentrada();
+	/* anunciar el tamaño del fichero (en un flujo, el del fichero completo) */
+	if (tamano)
+		anunciartamano();
 
 	/* obtener estructura de direccion del servidor */
 	servinfo=obtener_struct_direccion(dest, port, verb);
     /* configurar socket */
     sock=initsocket(servinfo,verb);
+	/* tamaño de segmento según la MTU del camino, si así se ha pedido */
+	if (segmento==0)
+		segmento=segmentomtu(sock,servinfo,verb);
+	setGSO(gso);
+	setRitmo(ritmo);
+	setReenvioRapido(duplicados);
 
 	/* inicializamos los tiempos a simular */
 	settimeoutduration(timeout,ttrans);
+	/* el timeout especificado es el inicial; después se adapta al RTT medido */
+	initRTO(timeout);
 	
 	/* anotamos la hora antes de empezar la transmisión */
 	if (gettimeofday(&horainicio,NULL)<0) {
@@ -98,7 +133,8 @@ int main(int argc,char *argv[]) {
 	switch(alg) {
 		case 1: alg_basico(sock,servinfo); break;
 		case 2: alg_stopwait(sock,servinfo); break;
-		case 3: alg_ventana(sock,servinfo,window); break;
+		case 3: alg_ventana(sock,servinfo,window,segmento); break;
+		case 4: alg_repsel(sock,servinfo,window,segmento); break;
 		default: printf("Algoritmo desconocido\n"); break;
 	}
 
@@ -110,7 +146,7 @@ int main(int argc,char *argv[]) {
 
 
 /**************************************************************************/
-/* readtobuffer -- lee de la entrada estándar no más de RCFTP_BUFLEN */
+/* readtobuffer -- lee de la entrada estándar no más de RCFTP_MAXBUFLEN */
 /**************************************************************************/
 int readtobuffer(char * buffer, int maxlen) {
 	ssize_t len;
@@ -119,13 +155,29 @@ int readtobuffer(char * buffer, int maxlen) {
 	if (maxlen<0) {
 		fprintf(stderr,"Error: readtobuffer: intentando leer %d bytes de datos\n",maxlen);
 		exit(1);
-	} else if (maxlen > RCFTP_BUFLEN) {
-		fprintf(stderr,"Warning: readtobuffer: intentando leer más de RCFTP_BUFLEN bytes\n");
+	} else if (maxlen > RCFTP_MAXBUFLEN) {
+		fprintf(stderr,"Warning: readtobuffer: intentando leer más de RCFTP_MAXBUFLEN bytes\n");
 	} else if ((maxlen<RCFTP_BUFLEN) && verb) {
 		fprintf(stderr,"Warning: readtobuffer: intentando leer menos de RCFTP_BUFLEN bytes\n");
 	}
 
-	len = read(0, buffer, maxlen);
+	if (entrada!=NULL) {
+		// entrada proyectada en memoria: copiamos del fichero, sin llamadas al sistema
+		if (maxlen > finrango-posrango)
+			maxlen = finrango-posrango;
+		memcpy(buffer, &entrada[posrango], maxlen);
+		len = maxlen;
+		posrango+=len;
+	} else if (finrango<0) {
+		len = read(0, buffer, maxlen);
+	} else {
+		// flujo de una transferencia en paralelo: solo leemos de nuestro rango del fichero
+		if (maxlen > finrango-posrango)
+			maxlen = finrango-posrango;
+		len = pread(0, buffer, maxlen, posrango);
+		if (len>0)
+			posrango+=len;
+	}
 	// lee del teclado; sobreescribe buffer; devuelve el número de bytes leídos
 	//
 	// bloqueante: no sale hasta haber leído algo o error
@@ -157,6 +209,140 @@ int readtobuffer(char * buffer, int maxlen) {
 }
 
 
+/**************************************************************************/
+/* setrango -- limita la lectura de la entrada estándar a un rango */
+/**************************************************************************/
+void setrango(off_t inicio, off_t fin) {
+	posrango=inicio;
+	finrango=fin;
+}
+
+
+/**************************************************************************/
+/* repartirflujos -- divide el fichero entre varios procesos, uno por flujo */
+/**************************************************************************/
+void repartirflujos(int flujos) {
+	struct stat st;
+	struct timeval horainicio;
+	pid_t hijos[MAXFLUJOS];
+	uint32_t id;
+	off_t inicio, fin;
+	int i, estado, errores=0;
+
+	if (fstat(0,&st)<0) {
+		perror("Error al consultar la entrada estándar (fstat)");
+		exit(1);
+	}
+	if (!S_ISREG(st.st_mode)) {
+		fprintf(stderr,"Error: para enviar en varios flujos la entrada estándar debe ser un fichero\n");
+		exit(1);
+	}
+	if (st.st_size>UINT32_MAX) {
+		fprintf(stderr,"Error: el fichero no cabe en los números de secuencia (máximo %u bytes)\n",UINT32_MAX);
+		exit(1);
+	}
+	// no tiene sentido tener flujos sin datos
+	if (st.st_size<flujos)
+		flujos=st.st_size;
+	if (flujos<=1)
+		return;
+
+	// identificador común a todos los flujos, para que el servidor los junte en un fichero
+	id=((uint32_t)getpid()<<16) ^ (uint32_t)time(NULL);
+	if (verb)
+		printf("Enviando %lld bytes en %d flujos (transferencia %08x)\n",(long long)st.st_size,flujos,id);
+	if (gettimeofday(&horainicio,NULL)<0) {
+		perror("Error al intentar obtener la hora del sistema\n");
+		exit(1);
+	}
+	// que los hijos no hereden (y repitan) lo pendiente de imprimir
+	fflush(stdout);
+
+	for (i=0; i<flujos; i++) {
+		inicio=st.st_size*i/flujos;
+		fin=st.st_size*(i+1)/flujos;
+		hijos[i]=fork();
+		if (hijos[i]<0) {
+			perror("Error al crear el proceso de un flujo (fork)");
+			exit(1);
+		} else if (hijos[i]==0) {
+			// el hijo envía su rango como una transmisión normal
+			setrango(inicio,fin);
+			setFlujo(inicio,id);
+			return;
+		}
+	}
+
+	for (i=0; i<flujos; i++) {
+		if (waitpid(hijos[i],&estado,0)<0) {
+			perror("Error al esperar a un flujo (waitpid)");
+			exit(1);
+		}
+		if (!WIFEXITED(estado) || WEXITSTATUS(estado)!=0)
+			errores++;
+	}
+
+	// resumen de la transferencia completa; cada flujo ha mostrado el suyo
+	numbytesleidos=errores ? 0 : st.st_size;
+	printf("=============== transferencia en %d flujos ===============\n",flujos);
+	printf("Flujos con error: %d\n",errores);
+	muestrainforesumen(horainicio);
+	exit(errores ? 1 : 0);
+}
+
+
+/**************************************************************************/
+/* mapearentrada -- proyecta en memoria el fichero de la entrada estándar */
+/**************************************************************************/
+void mapearentrada() {
+	struct stat st;
+	off_t inicio;
+	void *mapa;
+
+	// solo un fichero regular con datos, cuyos bytes quepan en los números de secuencia
+	if ((fstat(0,&st)<0) || !S_ISREG(st.st_mode) || (st.st_size==0) || (st.st_size>UINT32_MAX))
+		return;
+	// sin rango (-n) se envía desde la posición actual hasta el final, y numseq 0 es la posición actual;
+	// en un flujo, numseq es directamente la posición en el fichero
+	inicio=(finrango<0)?lseek(0,0,SEEK_CUR):0;
+	if ((inicio<0) || (inicio>=st.st_size))
+		return;
+	mapa=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,0,0);
+	if (mapa==MAP_FAILED) {
+		if (verb)
+			fprintf(stderr,"No se puede proyectar la entrada estándar (%s): se leerá con read\n",strerror(errno));
+		return;
+	}
+	madvise(mapa,st.st_size,MADV_SEQUENTIAL);
+	entrada=mapa;
+	if (finrango<0) {
+		posrango=inicio;
+		finrango=st.st_size;
+	}
+	// la ventana de emisión no copia los datos: los reenvía leyéndolos del fichero
+	setwindowmap(entrada+inicio);
+	if (verb)
+		printf("Entrada estándar proyectada en memoria (%lld bytes)\n",(long long)st.st_size);
+}
+
+
+/**************************************************************************/
+/* anunciartamano -- pide anunciar al servidor el tamaño del fichero de entrada */
+/**************************************************************************/
+void anunciartamano() {
+	struct stat st;
+
+	// es solo una indicación: si no se puede saber, se envía sin anunciarlo
+	if ((fstat(0,&st)<0) || !S_ISREG(st.st_mode) || (st.st_size>UINT32_MAX)) {
+		fprintf(stderr,"Aviso: la entrada estándar no es un fichero de hasta %u bytes; no se anuncia su tamaño\n",UINT32_MAX);
+		return;
+	}
+	if (verb)
+		printf("Anunciando un fichero de %lld bytes\n",(long long)st.st_size);
+	setTamano(st.st_size);
+}
+
+
 /**************************************************************************/
 /* muestrainforesumen -- Muestra info y calcula el tiempo transcurrido y la velocidad efectiva aproximada */
 /**************************************************************************/
@@ -194,15 +380,26 @@ void muestrainforesumen(struct timeval horainicio) {
 /* Imprime un resumen del uso del programa */
 /**************************************************************************/
 void printuso(char *progname) {
-    fprintf(stderr,"Uso: %s [-v] -a[alg] [-t[Ttrans]] [-T[timeout]] [-w[tam]] -d<dirección> -p<puerto>\n",progname);
+    fprintf(stderr,"Uso: %s [-v] -a[alg] [-t[Ttrans]] [-T[timeout]] [-w[tam]] [-s[tam]] [-g] [-c] [-f[n]] [-n[flujos]] [-l] -d<dirección> -p<puerto>\n",progname);
 	fprintf(stderr,"  -v\t\tMuestra detalles en salida estándar\n");
 	fprintf(stderr,"  -a[alg]\tAlgoritmo de secuenciación a utilizar:\n");
 	fprintf(stderr,"      1\t\tAlgoritmo básico\n");
 	fprintf(stderr,"      2\t\tAlgoritmo Stop&Wait\n");
 	fprintf(stderr,"      3\t\tAlgoritmo de ventana deslizante Go-Back-n\n");
+	fprintf(stderr,"      4\t\tAlgoritmo de ventana deslizante con repetición selectiva (servidor con -a4)\n");
 	fprintf(stderr,"  -t[Ttrans]\tTiempo de transmisión a simular, en microsegundos (por defecto: 200000)\n");
-	fprintf(stderr,"  -T[timeout]\tTiempo de expiración a simular, en microsegundos (por defecto: 1000000)\n");
-	fprintf(stderr,"  -w[tam]\tTamaño (en bytes) de la ventana de emisión (sólo usado con -a3) (por defecto: 2048)\n");
+	fprintf(stderr,"  -T[timeout]\tTiempo de expiración inicial, en microsegundos; después se adapta al RTT medido (por defecto: 1000000)\n");
+	fprintf(stderr,"  -w[tam]\tTamaño máximo (en bytes) de la ventana de emisión (sólo usado con -a3 y -a4); la ventana efectiva se adapta a la congestión (por defecto: 2048; hasta %u, con %d mensajes en vuelo como mucho)\n",MAXVEMISION,MAXENVUELO);
+	fprintf(stderr,"  -s[tam]\tTamaño (en bytes) de segmento a negociar con el servidor (sólo usado con -a3 y -a4)\n");
+	fprintf(stderr,"      \t\thasta %d; si supera %d usa la versión 2 del protocolo; 0: según la MTU del camino (por defecto: %d)\n",RCFTP_MAXBUFLEN,RCFTP_BUFLEN,RCFTP_BUFLEN);
+	fprintf(stderr,"  -g\t\tEnvía cada ráfaga de segmentos iguales como un solo datagrama segmentado por el kernel (UDP GSO)\n");
+	fprintf(stderr,"  -c\t\tControl de congestión por ritmo: envía al ancho de banda estimado con el ritmo de entrega\n");
+	fprintf(stderr,"      \t\ty el RTT mínimo, sin reducir la ventana ante pérdidas (sólo usado con -a3 y -a4)\n");
+	fprintf(stderr,"  -f[n]\t\tReenvía sin esperar al timeout tras n confirmaciones duplicadas (sólo usado con -a3 y -a4)\n");
+	fprintf(stderr,"      \t\t0: sin reenvío rápido (por defecto: %d)\n",REENVIO_RAPIDO);
+	fprintf(stderr,"  -n[flujos]\tDivide el fichero en rangos y los envía en paralelo, cada uno por un socket (servidor con -m;\n");
+	fprintf(stderr,"      \t\tsólo usado con -a3 y -a4; la entrada estándar debe ser un fichero; hasta %d) (por defecto: 1)\n",MAXFLUJOS);
+	fprintf(stderr,"  -l\t\tAnuncia el tamaño del fichero para que el servidor lo reserve (servidor con -o; sólo usado con -a3 y -a4)\n");
 	fprintf(stderr,"  -d<dirección>\tDirección del servidor\n");
 	fprintf(stderr,"  -p<puerto>\tServicio o número de puerto del servidor\n");
 }
@@ -211,12 +408,18 @@ void printuso(char *progname) {
 /**************************************************************************/
 /* initargs -- read command line parameters */
 /**************************************************************************/
-void initargs(int argc, char **argv, char *verb, int* alg, unsigned int* window, unsigned long* ttrans, unsigned long* timeout, char** dest, char** port) {
+void initargs(int argc, char **argv, char *verb, int* alg, unsigned int* window, unsigned int* segmento, char* gso, char* ritmo, int* duplicados, int* flujos, char* tamano, unsigned long* ttrans, unsigned long* timeout, char** dest, char** port) {
     char *progname = *argv;
 
 	// default values
 	*verb=0;
 	*window=2048;
+	*segmento=RCFTP_BUFLEN;
+	*gso=0;
+	*ritmo=0;
+	*duplicados=REENVIO_RAPIDO;
+	*flujos=1;
+	*tamano=0;
 	*ttrans=200000;
 	*timeout=1000000;
 	// error values
@@ -244,6 +447,30 @@ void initargs(int argc, char **argv, char *verb, int* alg, unsigned int* window,
     			*window=atoi(++*argv);
     			break;
 
+    		case 's':
+    			*segmento=strtoul(++*argv,NULL,10);
+    			break;
+
+    		case 'g':
+    			*gso=1;
+    			break;
+
+    		case 'c':
+    			*ritmo=1;
+    			break;
+
+    		case 'f':
+    			*duplicados=atoi(++*argv);
+    			break;
+
+    		case 'n':
+    			*flujos=atoi(++*argv);
+    			break;
+
+    		case 'l':
+    			*tamano=1;
+    			break;
+
     		case 't':
     			*ttrans=strtoul(++*argv,NULL,10);
     			break;
@@ -286,10 +513,30 @@ void initargs(int argc, char **argv, char *verb, int* alg, unsigned int* window,
 		printuso(progname);
 		exit(1);    	
     }
-	else if (*window<=0) {
+	else if (*window<=0 || *window>MAXVEMISION) {
 		fprintf(stderr,"Ventana no especificada correctamente\n");
 		printuso(progname);
 		exit(1);    	
+    }
+	else if (*segmento>RCFTP_MAXBUFLEN) {
+		fprintf(stderr,"Tamaño de segmento no especificado correctamente (máximo %d)\n",RCFTP_MAXBUFLEN);
+		printuso(progname);
+		exit(1);    	
+    }
+	else if	(*duplicados<0) {
+		fprintf(stderr,"Número de confirmaciones duplicadas no especificado correctamente\n");
+		printuso(progname);
+		exit(1);    	
+    }
+	else if	(*flujos<1 || *flujos>MAXFLUJOS || (*flujos>1 && *alg!=3 && *alg!=4)) {
+		fprintf(stderr,"Número de flujos no especificado correctamente (máximo %d, sólo con -a3 y -a4)\n",MAXFLUJOS);
+		printuso(progname);
+		exit(1);    	
+    }
+	else if	(*tamano && *alg!=3 && *alg!=4) {
+		fprintf(stderr,"El anuncio del tamaño del fichero sólo se usa con -a3 y -a4\n");
+		printuso(progname);
+		exit(1);    	
     }
 	else if	(*ttrans==0) {
 		fprintf(stderr,"Tiempo de transmisión no especificado correctamente\n");
@@ -303,7 +550,7 @@ void initargs(int argc, char **argv, char *verb, int* alg, unsigned int* window,
     }
 
 	if (*verb) {
-		fprintf(stderr,"Valores de parámetros: a=%d, w=%d, tt=%ld, T=%ld, d=%s, p=%s\n",*alg,*window,*ttrans,*timeout,*dest,*port);
+		fprintf(stderr,"Valores de parámetros: a=%d, w=%d, s=%d, g=%d, c=%d, f=%d, n=%d, tt=%ld, T=%ld, d=%s, p=%s\n",*alg,*window,*segmento,*gso,*ritmo,*duplicados,*flujos,*ttrans,*timeout,*dest,*port);
 	}	
 }
 
@@ -11,12 +11,18 @@
  * @param[out] verb Flag de verbose
  * @param[out] alg Algoritmo a usar en el cliente
  * @param[out] window Tamaño de la ventana de emisión
+ * @param[out] segmento Tamaño de segmento a negociar (0: según la MTU del camino)
+ * @param[out] gso Flag para enviar las ráfagas con UDP GSO
+ * @param[out] ritmo Flag para el control de congestión por ritmo de entrega
+ * @param[out] duplicados Confirmaciones duplicadas que provocan un reenvío rápido (0: ninguno)
+ * @param[out] flujos Número de flujos en paralelo en los que dividir el fichero
+ * @param[out] tamano Flag para anunciar al servidor el tamaño del fichero
  * @param[out] ttrans Tiempo de transmisión a simular
  * @param[out] timeout Tiempo de expiración a simular
  * @param[out] dest String con la dirección de destino
  * @param[out] port String con el servicio/número de puerto
  */
-void initargs(int argc, char **argv, char *verb, int* alg, unsigned int* window, unsigned long* ttrans, unsigned long* timeout, char** dest, char** port);
+void initargs(int argc, char **argv, char *verb, int* alg, unsigned int* window, unsigned int* segmento, char* gso, char* ritmo, int* duplicados, int* flujos, char* tamano, unsigned long* ttrans, unsigned long* timeout, char** dest, char** port);
 
 
 /**
@@ -31,6 +37,42 @@ void initargs(int argc, char **argv, char *verb, int* alg, unsigned int* window,
 int readtobuffer(char * buffer, int maxlen);
 
 
+/**
+ * Limita la lectura de la entrada estándar (con readtobuffer) a un rango del fichero
+ *
+ * @param[in] inicio Posición del primer byte a leer
+ * @param[in] fin Posición siguiente al último byte a leer
+ */
+void setrango(off_t inicio, off_t fin);
+
+
+/**
+ * Divide el fichero de la entrada estándar en rangos y crea un proceso hijo por rango, que vuelve
+ * de la función para enviarlo por su propio socket como un flujo de la misma transferencia.
+ * El proceso padre espera a todos los hijos, muestra el resumen de la transferencia completa y termina.
+ * Si el fichero es demasiado pequeño para dividirlo, vuelve sin hacer nada.
+ *
+ * @param[in] flujos Número de flujos en paralelo (como mucho MAXFLUJOS)
+ */
+void repartirflujos(int flujos);
+
+
+/**
+ * Si la entrada estándar es un fichero, lo proyecta en memoria (mmap): readtobuffer copia
+ * de él sin llamadas al sistema, y la ventana de emisión toma los datos a reenviar directamente
+ * del fichero en lugar de guardar una copia. Si no se puede, se sigue leyendo con read.
+ * Hay que llamarla tras repartirflujos (en un flujo, proyecta el fichero completo).
+ */
+void mapearentrada();
+
+
+/**
+ * Consulta el tamaño del fichero de la entrada estándar y pide anunciarlo al servidor.
+ * Si la entrada no es un fichero (o no cabe en los números de secuencia), solo avisa.
+ */
+void anunciartamano();
+
+
 /**
  * Muestra info y calcula el tiempo transcurrido desde horainicio y la velocidad efectiva conseguida
  *
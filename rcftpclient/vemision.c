@@ -32,23 +32,164 @@
 #include <string.h>
 #include <netinet/in.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
+#include "rcftp.h"
 #include "vemision.h"
 
 /**
- * Cola circular, con datos válidos entre [firstelem,lastelem-1], y datos a REenviar en resendelem
+ * Cola circular de capacidad potencia de 2, indexada con el número de secuencia módulo la
+ * capacidad (numseq&mascara). Los datos válidos son los de números de secuencia
+ * [numseqfirst,numseqlast-1], y los datos a REenviar empiezan en numseqresend; todas las
+ * cuentas son módulo 2^32, así que la ventana funciona igual cuando los números de secuencia
+ * dan la vuelta.
  */
-static char vemision[MAXVEMISION];
+static char *vemision=NULL;
+static unsigned int capacidad=0; // bytes reservados (potencia de 2; crece según haga falta hasta cubrir totalelems)
+static unsigned int mascara=0; // capacidad-1
 static unsigned int totalelems=0; // tamaño de ventana a usar
-static unsigned int firstelem=0; // primer byte añadido
-static unsigned int lastelem=0; // último byte añadido
-static unsigned int resendelem=0;
-static char vvacia=1; // para diferenciar entre vacía y llena si firstelem==lastelem
+static unsigned int efectiva=0; // máximo de datos sin confirmar (ventana de congestión); 0: totalelems
 
 /*
- * Número de secuencia del elemento en firstelem
+ * Números de secuencia del primer byte almacenado, del siguiente al último y del siguiente a reenviar
  */
 static uint32_t numseqfirst=0;
+static uint32_t numseqlast=0;
+static uint32_t numseqresend=0;
+
+/*
+ * Fichero de entrada proyectado en memoria (setwindowmap), con el byte de número de secuencia n
+ * en mapa[n]; NULL: los datos se copian a vemision. Con mapa, la cola circular solo lleva la cuenta.
+ */
+static char *mapa=NULL;
+
+
+/*
+ * Datos almacenados en la ventana (enviados y aún no confirmados)
+ */
+static int ocupados() {
+	return numseqlast-numseqfirst;
+}
+
+
+/*
+ * Copia len bytes a la ventana a partir del número de secuencia numseq (con vuelta al inicio si hace falta).
+ * Si sum!=NULL, calcula a la vez la suma parcial (xsumparcial) de los datos copiados.
+ */
+static void copiaraventana(uint32_t numseq, char * data, int len, uint16_t * sum) {
+	unsigned int pos=numseq&mascara;
+	int primero=capacidad-pos; // bytes hasta el final de la ventana
+
+	if (mapa!=NULL) { // los datos ya están en el fichero: no hay nada que copiar
+		if (sum!=NULL)
+			*sum=xsumparcial(data,len);
+	} else if (primero>=len) { // cabe en bloque
+		if (sum!=NULL)
+			*sum=xsumcopia(&vemision[pos],data,len);
+		else
+			memcpy(&vemision[pos],data,len);
+	} else { // cabe en dos trozos
+		if (sum!=NULL) {
+			*sum=xsumcopia(&vemision[pos],data,primero);
+			*sum=xsumcombina(*sum,xsumcopia(&vemision[0],&data[primero],len-primero),primero);
+		} else {
+			memcpy(&vemision[pos],data,primero);
+			memcpy(&vemision[0],&data[primero],len-primero);
+		}
+	}
+}
+
+/*
+ * Copia len bytes de la ventana a partir del número de secuencia numseq (con vuelta al inicio si hace falta).
+ * Si sum!=NULL, calcula a la vez la suma parcial (xsumparcial) de los datos copiados.
+ */
+static void copiardeventana(char * buffer, uint32_t numseq, int len, uint16_t * sum) {
+	unsigned int pos=numseq&mascara;
+	int primero=capacidad-pos; // bytes hasta el final de la ventana
+
+	if (mapa!=NULL) { // directamente del fichero (caché de páginas), sin vuelta al inicio
+		if (sum!=NULL)
+			*sum=xsumcopia(buffer,&mapa[numseq],len);
+		else
+			memcpy(buffer,&mapa[numseq],len);
+	} else if (primero>=len) { // todos los datos en bloque
+		if (sum!=NULL)
+			*sum=xsumcopia(buffer,&vemision[pos],len);
+		else
+			memcpy(buffer,&vemision[pos],len);
+	} else { // datos al final e inicio de ventana
+		if (sum!=NULL) {
+			*sum=xsumcopia(buffer,&vemision[pos],primero);
+			*sum=xsumcombina(*sum,xsumcopia(&buffer[primero],&vemision[0],len-primero),primero);
+		} else {
+			memcpy(buffer,&vemision[pos],primero);
+			memcpy(&buffer[primero],&vemision[0],len-primero);
+		}
+	}
+}
+
+/*
+ * Describe len bytes de la ventana a partir del número de secuencia numseq con uno o dos iovec
+ * (dos si dan la vuelta al inicio), sin copiarlos. Si sum!=NULL, calcula la suma parcial de los datos.
+ * Devuelve el número de iovec usados.
+ */
+static int iovdeventana(struct iovec * iov, uint32_t numseq, int len, uint16_t * sum) {
+	unsigned int pos=numseq&mascara;
+	int primero=capacidad-pos; // bytes hasta el final de la ventana
+	int n=1;
+
+	if (mapa!=NULL) { // directamente del fichero, sin vuelta al inicio
+		iov[0].iov_base=&mapa[numseq];
+		iov[0].iov_len=len;
+	} else if (primero>=len) { // todos los datos en bloque
+		iov[0].iov_base=&vemision[pos];
+		iov[0].iov_len=len;
+	} else { // datos al final e inicio de ventana
+		iov[0].iov_base=&vemision[pos];
+		iov[0].iov_len=primero;
+		iov[1].iov_base=&vemision[0];
+		iov[1].iov_len=len-primero;
+		n=2;
+	}
+	if (sum!=NULL) {
+		*sum=xsumparcial(iov[0].iov_base,iov[0].iov_len);
+		if (n>1)
+			*sum=xsumcombina(*sum,xsumparcial(iov[1].iov_base,iov[1].iov_len),iov[0].iov_len);
+	}
+	return n;
+}
+
+/*
+ * Reserva una cola de al menos necesarios bytes (potencia de 2), conservando los datos almacenados
+ */
+static void crecerventana(unsigned int necesarios) {
+	unsigned int nueva=(capacidad>0)?capacidad:VEMISION_INICIAL;
+	char *anterior=vemision;
+	unsigned int capanterior=capacidad;
+	int usados=ocupados();
+
+	while (nueva<necesarios)
+		nueva*=2;
+	vemision=malloc(nueva);
+	if (vemision==NULL) {
+		fprintf(stderr,"ERROR: no se puede reservar memoria para una ventana de emisión de %u bytes\n",nueva);
+		exit(3);
+	}
+	capacidad=nueva;
+	mascara=nueva-1;
+	// los datos pasan a su posición en la nueva cola (la anterior es más pequeña: pueden dar la vuelta de otra forma)
+	if (usados>0) {
+		unsigned int pos=numseqfirst&(capanterior-1);
+		int primero=capanterior-pos;
+		if (primero>=usados) {
+			copiaraventana(numseqfirst,&anterior[pos],usados,NULL);
+		} else {
+			copiaraventana(numseqfirst,&anterior[pos],primero,NULL);
+			copiaraventana(numseqfirst+primero,&anterior[0],usados-primero,NULL);
+		}
+	}
+	free(anterior);
+}
 
 
 void setwindowsize(unsigned int total) {
@@ -59,91 +200,166 @@ void setwindowsize(unsigned int total) {
 	       exit(3);
 	} else {
 		totalelems=total;
+		// la cola empieza con VEMISION_INICIAL bytes y crece con los datos en vuelo (con mapa no hace falta)
+		if (mapa==NULL)
+			crecerventana(VEMISION_INICIAL);
 	}
 }
 
 
+void setwindowstart(uint32_t numseq) {
+	numseqfirst=numseq;
+	numseqlast=numseq;
+	numseqresend=numseq;
+}
+
+
+void setwindowmap(char * datos) {
+	mapa=datos;
+}
+
+
+void seteffectivewindow(unsigned int tam) {
+	efectiva=tam;
+}
+
+
 int getfreespace() {
-	if ((lastelem==firstelem)&&(vvacia))
-		return totalelems;
+	int usados=ocupados();
+
+	if ((efectiva!=0)&&(efectiva<totalelems))
+		return (usados<(int)efectiva)?efectiva-usados:0;
 	else
-		return (totalelems-(lastelem-firstelem))%totalelems;
+		return totalelems-usados;
 }
 
 
 int addsentdatatowindow(char * data, int len) {
+	return addsentdatatowindowsum(data,len,NULL);
+}
+
+
+int addsentdatatowindowsum(char * data, int len, uint16_t * sum) {
 	if (getfreespace()<len) { // no cabe
 		//return 0;
 		fprintf(stderr,"addsentdatatowindow: intentando añadir a la ventana de emisión más datos (%d B) que el espacio libre de que dispone (%d B)\n",len,getfreespace());
 		exit(3);
 	} else { // cabe
-		if ((totalelems-lastelem)>len) { // cabe en bloque
-			memcpy(&vemision[lastelem],data,len);
-		} else { // cabe en dos trozos
-			memcpy(&vemision[lastelem],data,totalelems-lastelem);
-			memcpy(&vemision[0],&data[totalelems-lastelem],len-(totalelems-lastelem));
-		}
-		lastelem=(lastelem+len)%totalelems;
-		vvacia=0;
+		if ((mapa==NULL) && ((unsigned int)(ocupados()+len)>capacidad))
+			crecerventana(ocupados()+len);
+		copiaraventana(numseqlast,data,len,sum);
+		numseqlast+=len;
 		return len;
 	}
 }
 
-// libera hasta next (no incluido)
+// libera hasta next (no incluido); next-numseqfirst es la distancia módulo 2^32, así que
+// vale igual cuando los números de secuencia dan la vuelta
 void freewindow(uint32_t next) {
-	if (((next<=numseqfirst) && (numseqfirst<(uint32_t)(numseqfirst+totalelems-getfreespace()))) // next menor
-			|| (next>(uint32_t)(numseqfirst+totalelems-getfreespace()))) { // next mayor
-		fprintf(stderr,"freewindow: intentando liberar datos (hasta el número de secuencia %d) no almacenados en la ventana de emisión [%d,%d]\n",next-1,numseqfirst,numseqfirst+totalelems-getfreespace());
+	uint32_t liberar=next-numseqfirst;
+
+	if (liberar>(uint32_t)ocupados()) { // next menor que numseqfirst o mayor que el último almacenado
+		fprintf(stderr,"freewindow: intentando liberar datos (hasta el número de secuencia %u) no almacenados en la ventana de emisión [%u,%u]\n",next-1,numseqfirst,numseqlast);
 		exit(3);
 	} else { // ok
-		firstelem=(firstelem+(next-numseqfirst))%totalelems;
 		numseqfirst=next;
-		if (firstelem==lastelem) {
-			vvacia=1;
-			resendelem=firstelem;
-		} else if (((firstelem<=lastelem) && (resendelem<firstelem || resendelem>=lastelem)) ||
-		    ((firstelem>lastelem) && (resendelem<firstelem && resendelem>=lastelem))) // arrastra resendelem
-			resendelem=firstelem;
+		// arrastra numseqresend si ha quedado fuera de la ventana
+		if ((uint32_t)(numseqresend-numseqfirst)>=(uint32_t)ocupados())
+			numseqresend=numseqfirst;
 		return;
 	}
 }
 
 
+void rewindresend() {
+	numseqresend=numseqfirst;
+}
+
+
 uint32_t getdatatoresend(char * buffer, int * len) {
-	uint32_t numseq;
+	return getdatatoresendsum(buffer,len,NULL);
+}
+
+
+/*
+ * Toma hasta len bytes a reenviar: ajusta len a los que hay, devuelve el número de secuencia
+ * del primero y avanza numseqresend
+ */
+static uint32_t tomarreenvio(int * len) {
+	uint32_t numseq=numseqresend;
 
 	// calculamos si tenemos los len bytes para dar o no
-	if (resendelem<lastelem) { // los datos a enviar están ordenados
-		if ((lastelem-resendelem)<*len)
-			*len=lastelem-resendelem;
-	} else { // datos en final e inicio de ventana circular
-		if ((totalelems-resendelem+lastelem)<*len)
-			*len=totalelems-resendelem+lastelem;
-	}
+	if ((int)(numseqlast-numseqresend)<*len)
+		*len=numseqlast-numseqresend;
 
-	// calculamos el número de secuencia
-	numseq=numseqfirst+(totalelems+resendelem-firstelem)%totalelems;
-	// copiamos los datos
-	if (resendelem+(*len)<=totalelems) { // todos los datos en bloque
-		memcpy(buffer,&vemision[resendelem],*len);
-	} else { // datos al final e inicio de ventana
-		memcpy(buffer,&vemision[resendelem],totalelems-resendelem);
-		memcpy(&buffer[totalelems-resendelem],&vemision[0],*len-(totalelems-resendelem));
-	}
 	// actualizamos indice
-	resendelem=(resendelem+(*len))%totalelems;
-	if (resendelem==lastelem)
-		resendelem=firstelem;
+	numseqresend+=*len;
+	if (numseqresend==numseqlast)
+		numseqresend=numseqfirst;
+
+	return numseq;
+}
+
 
+uint32_t getdatatoresendsum(char * buffer, int * len, uint16_t * sum) {
+	uint32_t numseq=tomarreenvio(len);
+
+	// copiamos los datos
+	copiardeventana(buffer,numseq,*len,sum);
+	return numseq;
+}
+
+
+uint32_t getiovtoresend(struct iovec * iov, int * niov, int * len, uint16_t * sum) {
+	uint32_t numseq=tomarreenvio(len);
+
+	*niov=iovdeventana(iov,numseq,*len,sum);
 	return numseq;
 }
 
+int getdatafromwindow(uint32_t numseq, char * buffer, int len) {
+	return getdatafromwindowsum(numseq,buffer,len,NULL);
+}
+
+
+/*
+ * Comprueba que el byte numseq está en la ventana y ajusta len a los datos que hay a partir de él
+ */
+static void comprobarventana(uint32_t numseq, int * len) {
+	uint32_t offset=numseq-numseqfirst;
+	int usados=ocupados();
+
+	if (offset>=(uint32_t)usados) {
+		fprintf(stderr,"getdatafromwindow: intentando obtener datos (número de secuencia %u) no almacenados en la ventana de emisión [%u,%u]\n",numseq,numseqfirst,numseqlast);
+		exit(3);
+	}
+	if (offset+*len>(uint32_t)usados)
+		*len=usados-offset;
+}
+
+
+int getdatafromwindowsum(uint32_t numseq, char * buffer, int len, uint16_t * sum) {
+	comprobarventana(numseq,&len);
+	copiardeventana(buffer,numseq,len,sum);
+	return len;
+}
+
+
+int getiovfromwindow(uint32_t numseq, struct iovec * iov, int * niov, int len, uint16_t * sum) {
+	comprobarventana(numseq,&len);
+	*niov=iovdeventana(iov,numseq,len,sum);
+	return len;
+}
+
 void printvemision() {
-	if ((firstelem==lastelem)&&vvacia)
+	if (numseqfirst==numseqlast)
 		printf("[]");
-	else if (resendelem==firstelem)
-		printf("[(%d)...%d]",numseqfirst,numseqfirst+(totalelems+lastelem-1-firstelem)%totalelems);
+	else if (numseqresend==numseqfirst)
+		printf("[(%u)...%u]",numseqfirst,numseqlast-1);
+	else
+		printf("[%u...(%u)...%u]",numseqfirst,numseqresend,numseqlast-1);
+	if ((efectiva!=0)&&(efectiva<totalelems))
+		printf(" \t%d bytes libres (ventana efectiva %u)\n",getfreespace(),efectiva);
 	else
-		printf("[%d...(%d)...%d]",numseqfirst,numseqfirst+(totalelems+resendelem-firstelem)%totalelems,numseqfirst+(totalelems+lastelem-1-firstelem)%totalelems);
-	printf(" \t%d bytes libres\n",getfreespace());
+		printf(" \t%d bytes libres\n",getfreespace());
 }
@@ -31,22 +31,51 @@
 /*********************************************************/
 
 /**
- * Tamaño de memoria a reservar para la ventana de emisión, en bytes
+ * Tamaño máximo de la ventana de emisión, en bytes: menos de la mitad del espacio de números
+ * de secuencia, para que las comparaciones módulo 2^32 sigan siendo válidas
  */
-#define MAXVEMISION 10240
+#define MAXVEMISION (1U<<30)
+
+/**
+ * Memoria que se reserva al principio para la ventana de emisión, en bytes (potencia de 2);
+ * se duplica cada vez que los datos en vuelo no caben, hasta cubrir el tamaño de la ventana
+ */
+#define VEMISION_INICIAL 65536
 
 /**************************************************************************/
 /* cabeceras de funciones públicas VEMISION                             */
 /**************************************************************************/
 
 /**
- * Establece el tamaño de la ventana de emisión (<=MAXVEMISION)
+ * Establece el tamaño de la ventana de emisión (<=MAXVEMISION, salvo con setwindowmap)
  * @param[in] tamaño a usar
  */
 void setwindowsize(unsigned int total);
 
 /**
- * Calcula el espacio libre en la ventana de emisión
+ * Establece el número de secuencia del primer byte que se añada a la ventana (por defecto 0);
+ * hay que llamarla con la ventana vacía
+ * @param[in] numseq Número de secuencia inicial
+ */
+void setwindowstart(uint32_t numseq);
+
+/**
+ * Toma los datos de la ventana de un fichero proyectado en memoria en lugar de copiarlos:
+ * añadir datos solo los anota, y reenviarlos los lee del fichero. Así la ventana no ocupa
+ * memoria y puede superar MAXVEMISION. Hay que llamarla antes de setwindowsize
+ * @param[in] datos Dirección del byte con número de secuencia 0 (el byte n está en datos[n])
+ */
+void setwindowmap(char * datos);
+
+/**
+ * Limita los datos sin confirmar a menos del tamaño de la ventana (p. ej. según la
+ * ventana de congestión); se puede cambiar en cualquier momento
+ * @param[in] tamaño efectivo a usar (0 o >= tamaño de la ventana: toda la ventana)
+ */
+void seteffectivewindow(unsigned int tam);
+
+/**
+ * Calcula el espacio libre en la ventana de emisión, respetando el tamaño efectivo
  * @return espacio libre en la ventana de emisión
  */
 int getfreespace();
@@ -59,12 +88,28 @@ int getfreespace();
  */
 int addsentdatatowindow(char * data, int len);
 
+/**
+ * Añade datos a la ventana de emisión como addsentdatatowindow, calculando a la vez
+ * la suma parcial de los datos (xsumparcial) para no tener que recorrerlos otra vez
+ * @param[in] datos a añadir
+ * @param[in] longitud de datos a añadir
+ * @param[out] suma parcial de los datos añadidos
+ * @return longitud de datos añadidos (=longitud de datos a añadir)
+ */
+int addsentdatatowindowsum(char * data, int len, uint16_t * sum);
+
 /**
  * Libera espacio en la ventana de emisión
  * @param[in] número de secuencia (no incluido) hasta el que liberar
  */
 void freewindow(uint32_t next);
 
+/**
+ * Hace que getdatatoresend vuelva a empezar por el primer byte de la ventana
+ * (p. ej. al detectar una pérdida por confirmaciones duplicadas)
+ */
+void rewindresend();
+
 /**
  * Pide datos para reenviar
  * @param[out] datos a reenviar
@@ -73,6 +118,59 @@ void freewindow(uint32_t next);
  */
 uint32_t getdatatoresend(char * buffer, int *len);
 
+/**
+ * Pide datos para reenviar como getdatatoresend, calculando a la vez su suma parcial
+ * @param[out] datos a reenviar
+ * @param[in/out] longitud de datos solicitados y longitud de datos añadidos
+ * @param[out] suma parcial de los datos copiados
+ * @return número de secuencia a poner en los datos
+ */
+uint32_t getdatatoresendsum(char * buffer, int *len, uint16_t * sum);
+
+/**
+ * Pide datos de la ventana a partir de un número de secuencia concreto,
+ * sin modificar la posición de reenvío de getdatatoresend
+ * @param[in] número de secuencia del primer byte a copiar
+ * @param[out] datos copiados
+ * @param[in] longitud de datos solicitados
+ * @return longitud de datos copiados (puede ser menor si la ventana no tiene tantos)
+ */
+int getdatafromwindow(uint32_t numseq, char * buffer, int len);
+
+/**
+ * Pide datos de la ventana como getdatafromwindow, calculando a la vez su suma parcial
+ * @param[in] número de secuencia del primer byte a copiar
+ * @param[out] datos copiados
+ * @param[in] longitud de datos solicitados
+ * @param[out] suma parcial de los datos copiados
+ * @return longitud de datos copiados
+ */
+int getdatafromwindowsum(uint32_t numseq, char * buffer, int len, uint16_t * sum);
+
+/**
+ * Pide datos para reenviar como getdatatoresendsum, pero sin copiarlos: los describe con
+ * iovec que apuntan a la ventana, para enviarlos con sendmsg tras las cabeceras. Los iovec
+ * solo son válidos hasta que se libere o se añada algo a la ventana
+ * @param[out] iovec con los datos (al menos 2: la cola circular puede dar la vuelta)
+ * @param[out] número de iovec usados
+ * @param[in/out] longitud de datos solicitados y longitud de datos obtenidos
+ * @param[out] suma parcial de los datos (NULL: no calcularla)
+ * @return número de secuencia a poner en los datos
+ */
+uint32_t getiovtoresend(struct iovec * iov, int * niov, int * len, uint16_t * sum);
+
+/**
+ * Pide datos de la ventana a partir de un número de secuencia como getdatafromwindowsum,
+ * pero sin copiarlos, como getiovtoresend
+ * @param[in] número de secuencia del primer byte
+ * @param[out] iovec con los datos (al menos 2)
+ * @param[out] número de iovec usados
+ * @param[in] longitud de datos solicitados
+ * @param[out] suma parcial de los datos (NULL: no calcularla)
+ * @return longitud de datos obtenidos
+ */
+int getiovfromwindow(uint32_t numseq, struct iovec * iov, int * niov, int len, uint16_t * sum);
+
 /**
  * Imprime la ventana de emisión
  */
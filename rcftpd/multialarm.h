@@ -34,20 +34,24 @@
 #define MULTIALARM
 
 /**
- * Número máximo de alarmas a tener en cuenta
+ * Número máximo de alarmas (timeouts y timers) pendientes a la vez (como mucho 65536)
  */
-#define MAXALARMS 128
+#define MAXALARMS 65536
+
+/**
+ * Todo el estado de multialarm (timers, timeouts, timerfd) es propio de cada hilo: cada hilo
+ * que lo usa tiene sus propias alarmas, sin compartir nada con los demás (gcc y compatibles)
+ */
+#ifdef __GNUC__
+#define POR_HILO __thread
+#else
+#define POR_HILO
+#endif
 
 /**************************************************************************/
 /* cabeceras de funciones públicas MULTIALARM                             */
 /**************************************************************************/
 
-/**
- * Gestor de interrupción de alarma.
- * Necesita asociación a la señal de alarma desde el programa principal.
- */
-void handle_sigalrm(int sig);
-
 /**
  * Especifica la duración del timeout a utilizar
  *
@@ -59,22 +63,74 @@ void settimeoutduration(unsigned long usec, unsigned long usleep);
 /**
  *  Añade una alarma para vencer tras duracion_timeout microsegundos
  *  En cada llamada, llama a nanosleep() con el tiempo de transmisión especificado antes
+ *  (la espera no se interrumpe aunque venza otro timeout mientras tanto)
  *
  *  @return 1: timeout añadido; 0: no se ha podido añadir (número máximo alcanzado)
  */
 int addtimeout();
 
 /**
- * Actualiza el vector de alarmas pendientes, los timeouts vencidos y programa la siguiente alarma, si existe. Debe llamarse desde el programa principal para cancelar un timeout (el más antiguo) que aún no ha vencido.
+ *  Añade una alarma como addtimeout, pero con la duración indicada en lugar de la establecida
+ *  con settimeoutduration (que sigue siendo necesaria para el tiempo de transmisión).
+ *  Cada timeout puede tener una duración distinta; canceltimeout sigue cancelando el añadido hace más tiempo.
  *
- * Además de lo anterior, aunque lo correcto sería usar esta función desde el programa principal cada vez que saltara la alarma, por legibilidad se llama dentro del gestor de interrupción de alarma, con lo que al vencer un timeout no es necesario realizar la llamada.
+ *  @param[in] usec Duración del timeout, en microsegundos
+ *  @return 1: timeout añadido; 0: no se ha podido añadir (número máximo alcanzado)
+ */
+int addtimeoutduration(unsigned long usec);
+
+/**
+ * Cancela el timeout más antiguo (el primero añadido con addtimeout o adddelayedtimeout)
+ * que aún no ha vencido.
  *
- * @return 1: timeout cancelado; 0: no hay ningún timeout programado
+ * @return 1: quedan timeouts programados; 0: no queda ningún timeout programado
  */
 int canceltimeout();
 
 /**
- * Devuelve el número de timeouts programados (pendientes de vencer)
+ * Añade un timer que vence tras usec microsegundos, con un dato asociado. A diferencia de
+ * addtimeout, no duerme el proceso ni cuenta en timeouts_vencidos: al vencer se obtiene con
+ * getexpiredtimer. Añadir, cancelar y vencer un timer tiene coste constante.
+ *
+ * @param[in] usec Duración del timer, en microsegundos
+ * @param[in] dato Dato a devolver al vencer (p.ej. el mensaje a reenviar)
+ * @return Manejador del timer (>=0); -1 si se ha alcanzado el máximo de MAXALARMS
+ */
+int addtimer(unsigned long usec, void *dato);
+
+/**
+ * Cancela un timer por su manejador, tanto si está pendiente como si ha vencido y aún
+ * no se ha obtenido con getexpiredtimer. Un manejador ya cancelado u obtenido se ignora.
+ *
+ * @param[in] handle Manejador devuelto por addtimer (o de un timeout)
+ * @return 1: timer cancelado; 0: el manejador ya no corresponde a ningún timer
+ */
+int canceltimer(int handle);
+
+/**
+ * Obtiene uno de los timers vencidos (en orden de vencimiento) y lo libera.
+ * Los vencimientos se detectan al llamar a waittimeout.
+ *
+ * @param[out] dato Dato asociado al timer (puede ser NULL si no interesa)
+ * @return Manejador del timer vencido; -1 si no queda ninguno
+ */
+int getexpiredtimer(void **dato);
+
+/**
+ * Actualiza los timeouts vencidos (timeouts_vencidos) y, si se pide, espera antes a que
+ * el descriptor fd tenga datos para leer o venza el siguiente timeout, lo que ocurra antes.
+ * No espera si hay timers vencidos sin obtener con getexpiredtimer.
+ * Los timeouts solo se contabilizan al llamar a esta función: no se usan señales.
+ * En GNU/Linux la espera usa un timerfd (CLOCK_MONOTONIC) y epoll; en otros sistemas, select.
+ *
+ * @param[in] fd Descriptor a esperar (socket), o -1 para esperar solo a los timeouts
+ * @param[in] block 1: esperar; 0: solo actualizar los timeouts vencidos, sin esperar
+ * @return 1: fd tiene datos para leer; 0: no (ha vencido algún timeout, o no se ha esperado)
+ */
+int waittimeout(int fd, int block);
+
+/**
+ * Devuelve el número de timeouts programados (pendientes de vencer), sin contar los añadidos con addtimer
  *
  * @return Número de timeouts programados (pendientes de vencer)
  */
@@ -87,7 +143,6 @@ int getnumtimeouts();
 /**
  * Añade una alarma para vencer tras max(duracion_timeout,timeout_anterior+delay) microsegundos.
  * Función para el servidor: NO USAR EN EL CLIENTE.
- * NO HAY QUE ALTERNAR LLAMADAS addtimeout y adddelayedtimeout: podrían desordenar el vector de tiempos.
  * Uso en el servidor: timeout=2*T_t+2*T_p, delay=2*T_t
  * 
  * @param[in] delay Tiempo de transmisión a simular, en microsegundos	
@@ -28,8 +28,157 @@
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "rcftp.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define XSUM_SIMD /**< Versiones SSE2/AVX2 de la suma de xsum, elegidas al arrancar */
+#endif
+
+
+/**
+ * Suma de palabras de 16 bits, sin plegar acarreos (versión escalar)
+ *
+ * @param[in] sp Palabras a sumar (alineadas a 2 bytes)
+ * @param[in] slen Número de palabras
+ * @return Suma en 32 bits (módulo 2^32)
+ */
+static uint32_t xsum16_escalar(const uint16_t *sp, int slen) {
+  register uint32_t sum = 0;
+
+  for(; slen > 0; slen--,sp++) {
+    sum += *sp;
+  }
+  return sum;
+}
+
+/**
+ * Copia y suma palabras de 16 bits en una sola pasada (versión escalar)
+ *
+ * @param[out] dst Destino de la copia
+ * @param[in] src Palabras a copiar y sumar (sin requisitos de alineamiento)
+ * @param[in] slen Número de palabras
+ * @return Suma en 32 bits (módulo 2^32)
+ */
+static uint32_t xsum16copia_escalar(char *dst, const char *src, int slen) {
+  register uint32_t sum = 0;
+  uint16_t w;
+
+  for(; slen > 0; slen--, src += 2, dst += 2) {
+    memcpy(&w, src, 2);
+    memcpy(dst, &w, 2);
+    sum += w;
+  }
+  return sum;
+}
+
+#ifdef XSUM_SIMD
+/**
+ * Suma de palabras de 16 bits con SSE2: 8 palabras por iteración en 4 acumuladores de 32 bits.
+ * Como todas las sumas son módulo 2^32, el resultado es idéntico al de la versión escalar.
+ */
+__attribute__((target("sse2")))
+static uint32_t xsum16_sse2(const uint16_t *sp, int slen) {
+  __m128i acc = _mm_setzero_si128();
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t lanes[4];
+  __m128i v;
+
+  for(; slen >= 8; slen -= 8, sp += 8) {
+    v = _mm_loadu_si128((const __m128i *)sp);
+    acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+    acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + xsum16_escalar(sp, slen);
+}
+
+/**
+ * Suma de palabras de 16 bits con AVX2: 16 palabras por iteración en 8 acumuladores de 32 bits
+ */
+__attribute__((target("avx2")))
+static uint32_t xsum16_avx2(const uint16_t *sp, int slen) {
+  __m256i acc = _mm256_setzero_si256();
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t lanes[8];
+  __m256i v;
+
+  for(; slen >= 16; slen -= 16, sp += 16) {
+    v = _mm256_loadu_si256((const __m256i *)sp);
+    acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+    acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7]
+    + xsum16_escalar(sp, slen);
+}
+
+/**
+ * Copia y suma de palabras de 16 bits con SSE2
+ */
+__attribute__((target("sse2")))
+static uint32_t xsum16copia_sse2(char *dst, const char *src, int slen) {
+  __m128i acc = _mm_setzero_si128();
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t lanes[4];
+  __m128i v;
+
+  for(; slen >= 8; slen -= 8, src += 16, dst += 16) {
+    v = _mm_loadu_si128((const __m128i *)src);
+    _mm_storeu_si128((__m128i *)dst, v);
+    acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+    acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + xsum16copia_escalar(dst, src, slen);
+}
+
+/**
+ * Copia y suma de palabras de 16 bits con AVX2
+ */
+__attribute__((target("avx2")))
+static uint32_t xsum16copia_avx2(char *dst, const char *src, int slen) {
+  __m256i acc = _mm256_setzero_si256();
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t lanes[8];
+  __m256i v;
+
+  for(; slen >= 16; slen -= 16, src += 32, dst += 32) {
+    v = _mm256_loadu_si256((const __m256i *)src);
+    _mm256_storeu_si256((__m256i *)dst, v);
+    acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+    acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7]
+    + xsum16copia_escalar(dst, src, slen);
+}
+#endif
+
+/**
+ * Versiones de la suma (y copia con suma) de 16 bits a usar; las elige xsum_init según la CPU
+ */
+static uint32_t (*xsum16)(const uint16_t *sp, int slen) = xsum16_escalar;
+static uint32_t (*xsum16copia)(char *dst, const char *src, int slen) = xsum16copia_escalar;
+
+#ifdef XSUM_SIMD
+/**
+ * Elige al arrancar la mejor versión de la suma disponible en la CPU (cpuid)
+ */
+__attribute__((constructor))
+static void xsum_init(void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    xsum16 = xsum16_avx2;
+    xsum16copia = xsum16copia_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    xsum16 = xsum16_sse2;
+    xsum16copia = xsum16copia_sse2;
+  }
+}
+#endif
+
 
 int issumvalid(struct rcftp_msg *mensaje,int len) {
 	if (xsum((char*)mensaje,len)==0)
@@ -39,12 +188,29 @@ int issumvalid(struct rcftp_msg *mensaje,int len) {
 }
 
 
+int rcftp_msglen(struct rcftp_msg *mensaje) {
+	return RCFTP_HDRLEN+ntohs(mensaje->len);
+}
+
+
+int islenvalid(struct rcftp_msg *mensaje, int len) {
+	if (len==(int)RCFTP_FIXEDLEN) // formato fijo
+		return (ntohs(mensaje->len)<=RCFTP_BUFLEN);
+	else if (len<(int)RCFTP_HDRLEN)
+		return 0;
+	else if (ntohs(mensaje->len)>(mensaje->version==RCFTP_VERSION_2?RCFTP_MAXBUFLEN:RCFTP_BUFLEN))
+		return 0;
+	else // formato compacto
+		return (len==rcftp_msglen(mensaje));
+}
+
+
 void print_flags(uint8_t flags) {
 	char hayflags=0;
 
 	if (flags==0)
 		printf("sin flags");
-	else if (flags>=(2*F_ABORT))
+	else if (flags>=(2*F_COMPACTO))
 		printf("valor de flags no válido");
 	else {
 		if ((flags/F_BUSY)%2==1) {
@@ -61,6 +227,21 @@ void print_flags(uint8_t flags) {
 			printf("abortar");
 			hayflags=1;
 		}
+		if ((flags/F_FLUJO)%2==1) {
+			if (hayflags) printf(", ");
+			printf("flujo");
+			hayflags=1;
+		}
+		if ((flags/F_TAMANO)%2==1) {
+			if (hayflags) printf(", ");
+			printf("tamaño");
+			hayflags=1;
+		}
+		if ((flags/F_COMPACTO)%2==1) {
+			if (hayflags) printf(", ");
+			printf("compacto");
+			hayflags=1;
+		}
 	}
 }
 
@@ -68,8 +249,8 @@ void print_flags(uint8_t flags) {
 void print_rcftp_msg(struct rcftp_msg *mensaje, int len) {
 	uint16_t aux;
 
-	if (len!=sizeof(struct rcftp_msg)) {
-		printf("Error: el tamaño del mensaje recibido (%d) no es el esperado (%zd)\n",len,sizeof(struct rcftp_msg));
+	if (!islenvalid(mensaje,len)) {
+		printf("Error: el tamaño del mensaje recibido (%d) no es el esperado (%zd o %zd)\n",len,RCFTP_HDRLEN+ntohs(mensaje->len),RCFTP_FIXEDLEN);
 		printf("Imposible interpretar mensaje\n");
 	} else {
 
@@ -89,16 +270,16 @@ void print_rcftp_msg(struct rcftp_msg *mensaje, int len) {
 		printf(" (error, esperaba ");
 		aux=mensaje->sum;
 		mensaje->sum=0;
-		printf("0x%x)\n",ntohs(xsum((char*)mensaje,sizeof(struct rcftp_msg))));
+		printf("0x%x)\n",ntohs(xsum((char*)mensaje,len)));
 		mensaje->sum=aux;
 	}
 	}
 }
 
 
-uint16_t xsum(char *buf, int len) {
+uint16_t xsumparcial(char *buf, int len) {
   register uint16_t	*sp;
-  register int16_t	slen;
+  register int		slen;
   register uint32_t	sum;		/* >= 32-bit space to keep sum */
   union { uint16_t s; uint8_t c[2]; } xun;
   int unaligned;
@@ -117,9 +298,8 @@ uint16_t xsum(char *buf, int len) {
 
   /* LINT NOTE: next line has possible ptr alignment message, even
      though we've made sure that buf is aligned */
-  for(sp = (uint16_t *)buf; slen > 0; slen--,sp++) {
-    sum += *sp;
-  }
+  sp = (uint16_t *)buf;
+  sum += xsum16(sp, slen);
 
   /* is there a trailing odd byte? */
   if ((len & 0x1) != 0) {
@@ -137,6 +317,54 @@ uint16_t xsum(char *buf, int len) {
 
   if (unaligned != 0)          /* byteswap */
     { sum = ((sum & 0xFF)<<8) + ((sum & 0xFF00)>>8); }
-  //return (sum);
-  return (~sum);
+  return (sum);
+}
+
+
+uint16_t xsum(char *buf, int len) {
+  return (~xsumparcial(buf, len));
+}
+
+
+uint16_t xsumcopia(char *dst, char *src, int len) {
+  register uint32_t	sum;
+  union { uint16_t s; uint8_t c[2]; } xun;
+
+  sum = xsum16copia(dst, src, len/2);
+
+  /* is there a trailing odd byte? */
+  if ((len & 0x1) != 0) {
+    dst[len - 1] = src[len - 1];
+    xun.s = 0; xun.c[0] = src[len - 1];
+    sum += xun.s;
+  }
+
+  /* Fold in all the carries to get a single 16 bit value */
+  sum = (sum & 0xFFFF) + (((uint32_t)(sum & 0xFFFF0000))>>16);
+  if (sum > 0xFFFF)
+    { sum = (sum & 0xFFFF) + 1; }
+  return (sum);
+}
+
+
+uint16_t xsumcombina(uint16_t suma, uint16_t parcial, int offset) {
+  uint32_t sum;
+
+  if ((offset & 0x1) != 0)          /* el bloque empieza en posición impar: byteswap */
+    { parcial = ((parcial & 0xFF)<<8) + ((parcial & 0xFF00)>>8); }
+  sum = (uint32_t)suma + parcial;
+  if (sum > 0xFFFF)
+    { sum = (sum & 0xFFFF) + 1; }
+  return (sum);
+}
+
+
+uint16_t xsummensaje(struct rcftp_msg *mensaje, uint16_t sumadatos) {
+  uint16_t aux, sum;
+
+  aux = mensaje->sum;
+  mensaje->sum = 0;
+  sum = xsumparcial((char*)mensaje, RCFTP_HDRLEN);
+  mensaje->sum = aux;
+  return (~xsumcombina(sum, sumadatos, RCFTP_HDRLEN));
 }
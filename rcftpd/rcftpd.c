@@ -27,10 +27,16 @@
 /* Implementación de funciones del servidor (daemon) rcftpd       */
 /******************************************************************/
 
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg(), sendmmsg(), fallocate(), sync_file_range()
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -42,14 +48,23 @@
 #include <time.h>
 #include <sys/time.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include "rcftp.h"
 #include "rcftpd.h"
-#include <signal.h>
 #include "multialarm.h"
 
-// el servidor utiliza multialarm y timeouts para simular el retardo de la red
+// el servidor utiliza multialarm y timers para simular el retardo de la red
 // por eso el valor de TIMEOUT debe ser menor al del cliente
-extern volatile const int timeouts_vencidos;
+
+// número de la última sesión abierta, común a todos los hilos (da nombre a f_recibido.<número>)
+static unsigned int numsesiones=0;
+
+// semilla de los números aleatorios (rand_r), propia de cada hilo para no compartir el estado de rand()
+static POR_HILO unsigned int semilla;
+
+// cola del hilo escritor del hilo actual: el bucle de recepción no escribe en disco
+static POR_HILO struct escritor *escritorhilo;
 
 /**************************************************************************/
 /* MAIN                                                                   */
@@ -59,22 +74,51 @@ extern volatile const int timeouts_vencidos;
  * Programa principal: procesa argumentos, activa el socket y procesa mensajes
  */
 int main(int argc,char *argv[]) {
-	int	s;
+	int	s,i;
 	unsigned int	prgflags;
 	char *port;
 	unsigned long ttrans=T_TRANS,tprop=T_PROP; // timeout_cliente < 2 ttrans + 2 tprop
 	// Estadísticamente, uno de cada "error_frequency" mensajes debería ser erróneo.
 	int error_frequency = ERR_FREQ;
-
-	initargs(argc,argv,&prgflags,&port,&ttrans,&tprop,&error_frequency);
+	int acumular = 1; // mensajes en orden confirmados con una sola respuesta
+	int hilos = 1; // hilos trabajadores, cada uno con su socket
+	static struct trabajador trabajadores[MAXHILOS];
+
+	initargs(argc,argv,&prgflags,&port,&ttrans,&tprop,&error_frequency,&acumular,&hilos);
+
+	if (hilos>1) {
+		// un socket por hilo en el mismo puerto: el kernel reparte los clientes por su dirección,
+		// y cada hilo atiende a los suyos con sus propias sesiones y timers, sin bloqueos
+		for (i=0;i<hilos;i++) {
+			trabajadores[i].s=start_server(port,1);
+			trabajadores[i].semilla=semilla+i;
+			trabajadores[i].progflags=prgflags;
+			trabajadores[i].ttrans=ttrans;
+			trabajadores[i].tprop=tprop;
+			trabajadores[i].error_frequency=error_frequency;
+			trabajadores[i].acumular=acumular;
+		}
+		printf("Servidor RCFTP en puerto %s (%d hilos)\n",port,hilos);
+		for (i=0;i<hilos;i++) {
+			if ((errno=pthread_create(&trabajadores[i].hilo,NULL,trabajador,&trabajadores[i]))!=0) {
+				perror("Error al crear un hilo trabajador");
+				exit(S_SYSERROR);
+			}
+		}
+		// con -m los hilos no terminan
+		for (i=0;i<hilos;i++)
+			pthread_join(trabajadores[i].hilo,NULL);
+		exit(S_OK);
+	}
 
 	/* start server up */
-	if ((s = start_server(port)) < 0) { 
+	if ((s = start_server(port,0)) < 0) { 
 		exit(S_SYSERROR); 
 	}
+	printf("Servidor RCFTP en puerto %s\n",port);
 
 	/* process requests */
-	process_requests(s,prgflags,ttrans,tprop,error_frequency);
+	process_requests(s,prgflags,ttrans,tprop,error_frequency,acumular);
 
 	close(s);
 	printf("Compara los ficheros para verificar los datos recibidos.\n");
@@ -86,24 +130,33 @@ int main(int argc,char *argv[]) {
 /* Imprime un resumen del uso del programa */
 /**************************************************************************/
 void printuso(char *progname) {
-	fprintf(stderr,"Uso: %s -p<puerto> [-v] [-a[alg]] [-e[frec]] [-t[Ttrans]] [-r[Tprop]]\n",progname);
+	fprintf(stderr,"Uso: %s -p<puerto> [-v] [-g] [-m] [-n[hilos]] [-o] [-a[alg]] [-e[frec]] [-t[Ttrans]] [-r[Tprop]] [-d[n]]\n",progname);
 	fprintf(stderr,"  -p<puerto>\tEspecifica el servicio o número de puerto\n");
 	fprintf(stderr,"  -v\t\tMuestra detalles en salida estándar\n");
+	fprintf(stderr,"  -g\t\tRecibe datagramas agrupados por el kernel (UDP GRO) y los separa en mensajes\n");
+	fprintf(stderr,"  -m\t\tAtiende hasta %d clientes a la vez, escribiendo lo de cada uno en f_recibido.<sesión>,\n",MAXSESIONES);
+	fprintf(stderr,"      \t\tsin terminar (por defecto: un solo cliente, en f_recibido, y a los demás F_BUSY)\n");
+	fprintf(stderr,"  -n[hilos]\tComo -m, repartiendo los clientes entre [hilos] hilos con un socket cada uno\n");
+	fprintf(stderr,"      \t\ten el mismo puerto (SO_REUSEPORT; por defecto: uno por núcleo, hasta %d)\n",MAXHILOS);
+	fprintf(stderr,"  -o\t\tReserva y proyecta en memoria (mmap) los ficheros cuyo tamaño anuncia el cliente\n");
 	fprintf(stderr,"  -a[alg]\tAjusta el comportamiento al algoritmo del cliente (por defecto: 0):\n");
 	fprintf(stderr,"      0:\tSin mensajes incorrectos\n");
 	fprintf(stderr,"      1:\tFuerza mensajes incorrectos hasta su corrección\n");
 	fprintf(stderr,"      2:\tFuerza mensajes incorrectos/pérdidas/duplicados hasta su corrección\n");
 	fprintf(stderr,"      3:\tFuerza mensajes incorrectos/pérdidas/duplicados\n");
+	fprintf(stderr,"      4:\tComo 3, almacenando mensajes fuera de orden (repetición selectiva)\n");
 	fprintf(stderr,"  -e[frec]\tFuerza en media un mensaje incorrecto de cada [frec] (por defecto: %d)\n",ERR_FREQ);
 	fprintf(stderr,"  -t[Ttrans]\tTiempo de transmisión a simular, en microsegundos (por defecto: %d)\n",T_TRANS);
 	fprintf(stderr,"  -r[Tprop]\tTiempo de propagación a simular, en microsegundos (por defecto: %d)\n",T_PROP);
+	fprintf(stderr,"  -d[n]\t\tConfirmaciones retardadas: una respuesta cada n mensajes en orden o tras 2*Ttrans,\n");
+	fprintf(stderr,"      \t\tinmediata ante huecos, duplicados o F_FIN (por defecto: todos; sin n: %d)\n",ACUMULAR);
 	fprintf(stderr,"Nota: Los algoritmos 1-3 generan errores aleatoriamente. Además, los algoritmos 1 y 2\nmantienen el error generado hasta que el cliente responda correctamente.\n");
 }
 
 /**************************************************************************/
 /* initargs - read flags, set flags bits and seed random number generator */
 /**************************************************************************/
-void initargs(int argc, char **argv, unsigned int *flags, char** port, unsigned long *ttrans, unsigned long*tprop, int *error_frequency) {
+void initargs(int argc, char **argv, unsigned int *flags, char** port, unsigned long *ttrans, unsigned long*tprop, int *error_frequency, int *acumular, int *hilos) {
 	char *progname = *argv;
 	int algcli=0;
 
@@ -125,6 +178,29 @@ void initargs(int argc, char **argv, unsigned int *flags, char** port, unsigned
 					*port=(++*argv);
 					break;
 
+				case 'g':
+					*flags |= F_GRO;
+					break;
+
+				case 'm':
+					*flags |= F_MULTI;
+					break;
+
+				case 'o':
+					*flags |= F_MAPEO;
+					break;
+
+				case 'n': // hilos trabajadores; implica -m
+					*flags |= F_MULTI;
+					*hilos=atoi(++*argv);
+					if (*hilos<=0)
+						*hilos=sysconf(_SC_NPROCESSORS_ONLN);
+					if (*hilos<=0)
+						*hilos=1;
+					if (*hilos>MAXHILOS)
+						*hilos=MAXHILOS;
+					break;
+
 				case 'a': // algoritmo del cliente
 					algcli = atoi(++*argv);
 					break;
@@ -141,6 +217,12 @@ void initargs(int argc, char **argv, unsigned int *flags, char** port, unsigned
 					*tprop=strtoul(++*argv,NULL,10);
 					break;
 
+				case 'd':
+					*acumular=atoi(++*argv);
+					if (*acumular<=0)
+						*acumular=ACUMULAR;
+					break;
+
 				default:
 					printuso(progname);
 					exit(S_ABORT);
@@ -169,6 +251,8 @@ void initargs(int argc, char **argv, unsigned int *flags, char** port, unsigned
 		*flags |= F_FUNKY;
 	} else if (algcli==3) { // sliding-window con errores, no fuerzan reenvío
 		*flags |= F_ROCKNROLL;
+	} else if (algcli==4) { // repetición selectiva, con los errores de sliding-window
+		*flags |= F_ROCKNROLL | F_SELREPEAT;
 	} else {
 		fprintf(stderr,"Algoritmo del cliente desconocido\n");
 		printuso(progname);
@@ -190,13 +274,13 @@ void initargs(int argc, char **argv, unsigned int *flags, char** port, unsigned
 	}
 
 	// inicializa aleatoriedad
-	srand((int) time((time_t *)0));
+	semilla=(unsigned int) time((time_t *)0);
 }
 
 /**************************************************************************/
 /*       start up the server: get a socket */
 /**************************************************************************/
-int start_server(char* port) {
+int start_server(char* port, int compartido) {
 	int sock, status;
 	struct addrinfo hints, *servinfo; 
 
@@ -218,6 +302,20 @@ int start_server(char* port) {
 		exit(S_SYSERROR);
 	}
 
+	// permite que los sockets de los demás hilos se asocien al mismo puerto
+	if (compartido) {
+#ifdef SO_REUSEPORT
+		int activar=1;
+		if (setsockopt(sock,SOL_SOCKET,SO_REUSEPORT,&activar,sizeof(activar))!=0) {
+			perror("Error activando SO_REUSEPORT");
+			exit(S_SYSERROR);
+		}
+#else
+		fprintf(stderr,"Error: SO_REUSEPORT no disponible; usa -m sin -n\n");
+		exit(S_SYSERROR);
+#endif
+	}
+
 	// asocia socket a puerto
 	if (bind(sock, servinfo->ai_addr, servinfo->ai_addrlen) != 0) {
 		perror("Error asociando el socket");
@@ -225,7 +323,6 @@ int start_server(char* port) {
 	}
 
 	freeaddrinfo(servinfo);
-	printf("Servidor RCFTP en puerto %s\n",port);
 
 	return sock;
 }
@@ -233,288 +330,725 @@ int start_server(char* port) {
 /**************************************************************************/
 /* handle all requests -- does not return unless fatal error              */
 /**************************************************************************/
-void process_requests(int s, unsigned int progflags, unsigned long ttrans, unsigned long tprop,int error_frequency) {
+void process_requests(int s, unsigned int progflags, unsigned long ttrans, unsigned long tprop,int error_frequency,int acumular) {
 	ssize_t recvsize;
-	struct sockaddr_storage	remote,peer;
-	struct rcftp_msg	recvbuffer;
-	struct rcftp_msg	sendbuffer,sendbuffer_win[WINDOWSIZE];
-	int error,error_win[WINDOWSIZE];
-	// firstmsg y lastmsg gestionan y numeran los envíos pendientes
-	unsigned int firstmsg=0,lastmsg=0;
-	socklen_t remotelen,peerlen;
-	FILE * fsalida;
-	uint32_t next_calculado, // next calculado a partir del válido
-			 next_valido; // next válido (correcto en el servidor)
-	int cont,vecesaenviar;
+	struct sockaddr_storage	remote;
+	struct rcftp_msg	*recvbuffer;
+	struct recibido *rafagarecv; // mensajes recibidos con una sola llamada
+	struct tablasesiones tabla; // sesiones abiertas, por dirección del cliente
+	struct sesion *ses,*pendientes[MAXSESIONES]; // sesiones con envíos vencidos
+	struct temporizador *temp;
+	int nrecibidos=0,npendientes,m,resultado;
+	int maxsesiones=(progflags & F_MULTI)?MAXSESIONES:1;
 	int sockflags;
-	char primeraconexion=1;
-	int timeouts_procesados=0;
-	int ultimomensajeenviado=0;
-	struct timeval horainicio; // variable inicializada al recibir primer 
-	// mensaje para estadísticas al final (muestrainforesumen)
+	socklen_t remotelen;
+	char terminar=0;
 
-
-	// abrir fichero
-	fsalida=fopen("f_recibido","w");
-	if (fsalida==NULL) {
-		perror("Error al abrir el fichero \"f_recibido\" para escritura");
+	// la ráfaga no cabe en la pila de un hilo: cada llamada (cada hilo) reserva la suya
+	rafagarecv=malloc(MAXRAFAGA*sizeof(struct recibido));
+	if (rafagarecv==NULL) {
+		perror("Error al reservar memoria para la recepción");
 		exit(S_SYSERROR);
 	}
-	if (progflags & F_VERBOSE)
-		fprintf(stderr,"Fichero \"f_recibido\" abierto para escritura\n");
+	memset(&tabla,0,sizeof(tabla));
+	iniciarescritor();
 
 	// pasamos a socket no bloqueante
 	sockflags=fcntl(s,F_GETFL,0);
 	fcntl(s,F_SETFL,sockflags|O_NONBLOCK);
 
-	// especificamos el manejador de alarmas
-	signal(SIGALRM,handle_sigalrm);
+	// recepción de datagramas agrupados, si se ha pedido y está disponible
+	if ((progflags & F_GRO) && !activargro(s))
+		progflags &= ~F_GRO;
 
-	// establecemos el retardo general a simular en los mensajes: Ttranst+2Tprop
-	// se asume que el cliente ya simula un Ttrans
-	settimeoutduration(ttrans+2*tprop,0);
-	
 	// bucle: recibir, procesar mensaje y responder
-	while (!ultimomensajeenviado) {
+	// sin -m, se atiende a un único cliente y se termina al confirmar su F_FIN
+	while (!terminar) {
 
-		// recibir mensaje ****************************************************
-		recvsize=recibirmensaje(s,&recvbuffer,sizeof(recvbuffer),&remote,&remotelen);
+		// esperar a que llegue algún mensaje o venza algún envío planificado,
+		// salvo si en la última recepción no cupieron todos los mensajes en cola
+		waittimeout(s,nrecibidos<MAXRAFAGA);
 
-		if (recvsize>0) { // recepción correcta de mensaje
-
-			// verificar si es el primer mensaje ******************************
-			if (primeraconexion) {
-				primeraconexion=0;
-				// a partir de ahora solo atenderemos a peer
-				peer=remote;
-				peerlen=remotelen;
-				if (progflags & F_VERBOSE) {
-					print_peer(peer);
-				}
-				// numseq inicial 0 para que funcione lanzando el cliente antes que el servidor
-				next_valido=0;
-				if (gettimeofday(&horainicio,NULL)<0) {
-                    perror("Error al intentar obtener la hora del sistema\n");
-                    exit(1);
-                }
-			}
+		// recibir mensajes (todos los que haya en cola, con una sola llamada) **
+		nrecibidos=recibirmensajes(s,rafagarecv,MAXRAFAGA,progflags & F_GRO);
 
-			// print request if in verbose mode *******************************
-			if (progflags & F_VERBOSE) {
-				printf("\n");
-				printf("Mensaje RCFTP " ANSI_COLOR_CYAN "recibido" ANSI_COLOR_RESET ":\n");
-				print_rcftp_msg(&recvbuffer,recvsize);
-			}
+		for (m=0;m<nrecibidos;m++) {
+			recvbuffer=&rafagarecv[m].msg;
+			recvsize=rafagarecv[m].len;
+			remote=rafagarecv[m].remote;
+			remotelen=rafagarecv[m].remotelen;
 
-			// si lo recibido no tiene el tamaño esperado, abortar
-			if (recvsize!=sizeof(struct rcftp_msg)) {
-				fprintf(stderr,"Mensaje con tamaño incorrecto recibido\n");
-				exit(S_CLIERROR);
-			}
+			if (recvsize>0) { // recepción correcta de mensaje
 
-			// si el interlocutor es distinto: responder inmediatamente F_BUSY sin errores
-			if ((peerlen!=remotelen) || (memcmp(&remote,&peer,remotelen)!=0)) {
-				responderbusy(s,remote,remotelen,progflags);
-			} else {
-				// mensaje de interlocutor correcto *******************************
+				// print request if in verbose mode *******************************
+				if (progflags & F_VERBOSE) {
+					printf("\n");
+					printf("Mensaje RCFTP " ANSI_COLOR_CYAN "recibido" ANSI_COLOR_RESET ":\n");
+					print_rcftp_msg(recvbuffer,recvsize);
+				}
 
-				// if flag abort present, abort
-				if (recvbuffer.flags & F_ABORT) {
-					fprintf(stderr,"Flag F_ABORT recibido\n");
-					exit(S_CLIERROR);
+				// si lo recibido no tiene el tamaño esperado, abortar
+				if (!islenvalid(recvbuffer,recvsize)) {
+					fprintf(stderr,"Mensaje con tamaño incorrecto recibido\n");
+					if (!(progflags & F_MULTI))
+						exit(S_CLIERROR);
+					continue;
 				}
 
+				// buscar la sesión del interlocutor, o abrir una nueva si caben más; con -m solo
+				// la abre el primer mensaje de una transferencia (numseq 0, o F_FLUJO en un flujo de una
+				// transferencia en paralelo), no los retrasados de una ya cerrada
+				ses=buscarsesion(&tabla,&remote,remotelen);
+				// anuncio del tamaño del fichero: sin respuesta ni errores simulados, y solo en una sesión abierta
+				if (recvbuffer->flags & F_TAMANO) {
+					if ((ses!=NULL) && (progflags & F_MAPEO) && (ses->salida.mapa==NULL) && issumvalid(recvbuffer,recvsize))
+						mapearsalida(&ses->salida,ntohl(recvbuffer->next),ses->inicio,progflags);
+					continue;
+				}
+				if ((ses==NULL) && (tabla.n<maxsesiones) && (!(progflags & F_MULTI) || (recvbuffer->numseq==0) || (recvbuffer->flags & F_FLUJO)))
+					ses=nuevasesion(&tabla,&remote,remotelen,recvbuffer,progflags);
+				if (ses==NULL) { // interlocutor sin sesión: responder inmediatamente F_BUSY sin errores
+					responderbusy(s,remote,remotelen,progflags,esformatocompacto(recvbuffer,recvsize));
+					continue;
+				}
 
-				// calcular next ***********************************************
-				// empezar sin flags activos
-				sendbuffer.flags=F_NOFLAGS;
-				// si version,next,checksum ok: escribir datos y calcular nuevo next 
-				if (mensajevalido(recvbuffer)) { 
-					next_calculado=calcnextexpected(next_valido,ntohl(recvbuffer.numseq), 
-							ntohs(recvbuffer.len),recvbuffer.buffer,fsalida,&sendbuffer.flags,progflags);
-					// si hemos recibido todo y el interlocutor solicita FIN, contestamos con F_FIN
-					if ((next_calculado==(next_valido-(next_valido-ntohl(recvbuffer.numseq))+ntohs(recvbuffer.len))) && (recvbuffer.flags & F_FIN)) {
-						sendbuffer.flags|=F_FIN;
-					}
-				} else { // podríamos ignorar el mensaje, pero mejor dejar claro que es un error
-					// el mismo nextexpected
-					fprintf(stderr,"Detectado error en cliente\n");
-					exit(S_CLIERROR);
+				resultado=procesarmensaje(ses,recvbuffer,recvsize,progflags,ttrans,tprop,error_frequency,acumular);
+				if (resultado!=S_OK) {
+					if (!(progflags & F_MULTI))
+						exit(resultado);
+					cerrarsesion(&tabla,ses,progflags);
 				}
+			} // fin de acciones específicas tras una recepción **************************
+		}
 
+		// atender los timers vencidos: envíos planificados, confirmaciones retenidas e inactividad
+		npendientes=0;
+		while (getexpiredtimer((void **)&temp)!=-1) {
+			ses=temp->sesion;
+			switch (temp->tipo) {
+				case T_ENVIO:
+					ses->vencidos++;
+					if (!ses->pendiente) {
+						ses->pendiente=1;
+						pendientes[npendientes++]=ses;
+					}
+					break;
 
-				// construir el mensaje válido ***********************************
-				// los flags los hemos ido rellenando al calcular el next
-				sendbuffer.version=RCFTP_VERSION_1;
-				sendbuffer.numseq=htonl(0);
-				// sendbuffer.len=htons(adddata()); // nunca respondemos con datos
-				sendbuffer.len=htons(0);
-				sendbuffer.next=htonl(next_calculado);
-				sendbuffer.sum=0;
-				sendbuffer.sum=xsum((char*)&sendbuffer,sizeof(sendbuffer));
-				// en este punto el mensaje "correcto" está listo
-
-
-				// generar error **************************************************
-				// no forzamos errores con flags activos 
-				if (sendbuffer.flags!=F_NOFLAGS) {
-					error=E_NONE;
-				} else {
-					if ((progflags & F_ROCKNROLL) || (error==E_EXTRA) || (next_calculado>next_valido)) {
-						error=get_random_error(progflags,error_frequency); // obtener error aleatorio
-					} // else (SALSA/FUNKY y no avanzamos), repetir error anterior
-				}
-				////////////////////////////////////////////////////////////////////////
-				// MODIFICAR ESTA VARIABLE PARA FORZAR CIERTO TIPO DE ERROR, por ejemplo:
-				// if (error!=E_NONE) error=E_VERSION_LOST;
-				////////////////////////////////////////////////////////////////////////
-
-
-				// construir mensaje erróneo y especificar next_valido ********************
-				if (error!=E_NONE) {
-					vecesaenviar=generar_mensaje_erroneo(&sendbuffer, progflags, &error, next_valido,next_calculado);
-					// descartar datos ya recibidos si el error implica pérdida de datos
-					if (error==E_NEXT_LOWER) { // next menor pero correcto
-						if (fseek(fsalida,-((long)next_calculado-ntohl(sendbuffer.next)),SEEK_CUR)==-1) {
-							perror("Error en fseek");
-							exit(S_SYSERROR);
-						}
-						next_valido=ntohl(sendbuffer.next); // <>next_calculado
-					} else if // recepción perdida (*_LOST), que equivale a:
-						((error==E_KILL_LOST) || // (envío y recepción perdida, o
-						 // distinto de E_NEXT_MUCHLOWER y next<=valido)
-						 ((error!=E_NEXT_MUCHLOWER)&&(ntohl(sendbuffer.next)<=next_valido))) {
-						if (next_calculado-next_valido>0) { 
-							if (fseek(fsalida,-((long)next_calculado-next_valido),SEEK_CUR)==-1) {
-								perror("Error en fseek");
-								exit(S_SYSERROR);
+				case T_ACK: // ha vencido el plazo de la respuesta retenida: la planificamos ya
+					ses->timerack=-1;
+					if (ses->retenidas>0) {
+						if (progflags & F_VERBOSE)
+							printf("Plazo de confirmación vencido\n");
+						ses->retenidas=0;
+						if (!planificarenvio(ses,(struct rcftp_msg *)ses->retenida,E_NONE,ttrans,tprop,progflags)) {
+							// la sesión se cierra junto a las que tienen envíos vencidos
+							ses->estado=SES_ERROR;
+							if (!ses->pendiente) {
+								ses->pendiente=1;
+								pendientes[npendientes++]=ses;
 							}
 						}
-						//next_valido=next_valido; // <>next_calculado, <>next_enviado
-					} else { // next sin error (next_calculado>next_valido)
-						next_valido=next_calculado; // =ntohl(sendbuffer->next)
 					}
-				} else { // E_NONE
-					vecesaenviar=1;
-					next_valido=next_calculado; // =ntohl(sendbuffer->next)
-				}
-
+					break;
 
-				// planificamos el envío del mensaje ************************************
-				for (cont=0;cont<vecesaenviar;cont++) {
-					// control de flujo: no hay que desbordar colas de mensajes ni de alarmas
-					if ((firstmsg==(lastmsg+1)%WINDOWSIZE) || (adddelayedtimeout(ttrans)==0)) { 
-						fprintf(stderr,"Error en control de flujo: demasiados mensajes recibidos en poco tiempo (el cliente esta desbordando al servidor)\n");
-						// deberíamos ignorar el envío, pero mejor enfatizamos que es un error
-						exit(S_CLIERROR);
+				case T_INACTIVIDAD: // sin recibir nada del cliente durante INACTIVIDAD: abandonar la sesión
+					ses->timerinactividad=-1;
+					if (ses->firstmsg!=ses->lastmsg || ahorausec()-ses->ultimarecepcion<INACTIVIDAD) {
+						ses->timerinactividad=addtimer(INACTIVIDAD,&ses->tinactividad);
 					} else {
-						sendbuffer_win[lastmsg]=sendbuffer;
-						if (cont==0 && vecesaenviar>1) {
-							error_win[lastmsg]=E_NONE;
-						} else {
-							error_win[lastmsg]=error;
-						}
-						if (progflags & F_VERBOSE) 
-							printf("Planificando envío %d (%s)\n",lastmsg,strerrorrcftpd(error_win[lastmsg]));
-						lastmsg=(lastmsg+1)%WINDOWSIZE;
+						fprintf(stderr,"Sesión %u abandonada por inactividad\n",ses->numero);
+						if (!(progflags & F_MULTI))
+							exit(S_CLIERROR);
+						cerrarsesion(&tabla,ses,progflags);
 					}
-				}
-				if (vecesaenviar==0) {
-					printf("No planificando envío (%s)\n",strerrorrcftpd(error));
-				}
+					break;
 			}
-		} // fin de acciones específicas tras una recepción **************************
+		}
 
-		// enviamos tantos mensajes como timeouts_vencidos ***************************
-		while ((!ultimomensajeenviado) && (timeouts_vencidos>timeouts_procesados)) {
-			if (firstmsg==lastmsg) {
-				fprintf(stderr,"Error: planificados más envíos que mensajes\n");
-				exit(S_PROGERROR);
-			}
-			if (progflags & F_VERBOSE) {
-				printf("\n");
-				printf("Realizando envío %d (%s)\n",firstmsg,strerrorrcftpd(error_win[firstmsg]));
-			}
-			enviamensaje(s,sendbuffer_win[firstmsg],peer,peerlen,progflags);
-		
-			// realizar acciones dependiendo de flags (solo en envio sin error)
-			if ((sendbuffer_win[firstmsg].flags & F_ABORT) && (error_win[firstmsg]==E_NONE)) {
+		// enviamos, por sesión, tantos mensajes como envíos vencidos, con una sola llamada ****
+		for (m=0;m<npendientes;m++) {
+			ses=pendientes[m];
+			ses->pendiente=0;
+			enviarvencidos(s,ses,progflags);
+			if (ses->estado==SES_ABORTADA) {
 				fprintf(stderr,"Flag F_ABORT transmitido\n");
-				exit(S_ABORT);
+				if (!(progflags & F_MULTI))
+					exit(S_ABORT);
+			} else if ((ses->estado==SES_ERROR) && !(progflags & F_MULTI)) {
+				exit(S_CLIERROR);
 			}
-			if ((sendbuffer_win[firstmsg].flags & F_FIN) && ((error_win[firstmsg]==E_NONE) || (error_win[firstmsg]==E_EXTRA))) {
-				if (progflags & F_VERBOSE) {
-					printf("Flag F_FIN recibido y confirmado\n");
-				}
-				ultimomensajeenviado=1;
+			if (ses->estado!=SES_ACTIVA) {
+				cerrarsesion(&tabla,ses,progflags);
+				terminar=!(progflags & F_MULTI);
 			}
+		}
+	}
+	free(rafagarecv);
+	// que los ficheros estén completos antes de volver
+	terminarescritor();
+}
+
+
+/**************************************************************************/
+/* Hilo trabajador: atiende a los clientes de su socket */
+/**************************************************************************/
+void *trabajador(void *arg) {
+	struct trabajador *t=arg;
+
+	// semilla, timers y sesiones de este hilo: nada se comparte con los demás
+	semilla=t->semilla;
+	process_requests(t->s,t->progflags,t->ttrans,t->tprop,t->error_frequency,t->acumular);
+	close(t->s);
+	return NULL;
+}
+
+
+/**************************************************************************/
+/* Procesa un mensaje del cliente de una sesión y planifica la respuesta */
+/**************************************************************************/
+int procesarmensaje(struct sesion *ses, struct rcftp_msg *recvbuffer, ssize_t recvsize, unsigned int progflags,
+		unsigned long ttrans, unsigned long tprop, int error_frequency, int acumular) {
+	struct rcftp_msg sendbuffer;
+	uint32_t next_calculado, // next calculado a partir del válido
+			 next_anterior, // next válido antes de procesar el mensaje
+			 fin_mensaje; // hasta dónde se descartan datos si se simula una pérdida
+	int cont,vecesaenviar;
+	char retener;
+
+	ses->ultimarecepcion=ahorausec();
+	// respondemos en el mismo formato (compacto o fijo) que usa el cliente, que lo indica con
+	// F_COMPACTO (un segmento compacto completo mide lo mismo que un mensaje en formato fijo)
+	ses->compacto=esformatocompacto(recvbuffer,recvsize);
+	ses->version=recvbuffer->version;
+	// mensaje de interlocutor correcto *******************************
+
+	// if flag abort present, abort
+	if (recvbuffer->flags & F_ABORT) {
+		fprintf(stderr,"Flag F_ABORT recibido\n");
+		return S_CLIERROR;
+	}
 
-			firstmsg=(firstmsg+1)%WINDOWSIZE;
-			timeouts_procesados++;
+
+	// calcular next ***********************************************
+	// empezar sin flags activos
+	sendbuffer.flags=F_NOFLAGS;
+	// si version,next,checksum ok: escribir datos y calcular nuevo next 
+	next_anterior=ses->next_valido;
+	if (mensajevalido(recvbuffer,recvsize)) { 
+		next_calculado=calcnextexpected(ses->next_valido,ntohl(recvbuffer->numseq), 
+				ntohs(recvbuffer->len),recvbuffer->buffer,&ses->salida,&sendbuffer.flags,progflags);
+		// si hemos recibido todo y el interlocutor solicita FIN, contestamos con F_FIN
+		if ((next_calculado==(ses->next_valido-(ses->next_valido-ntohl(recvbuffer->numseq))+ntohs(recvbuffer->len))) && (recvbuffer->flags & F_FIN)) {
+			sendbuffer.flags|=F_FIN;
 		}
+	} else { // podríamos ignorar el mensaje, pero mejor dejar claro que es un error
+		// el mismo nextexpected
+		fprintf(stderr,"Detectado error en cliente\n");
+		return S_CLIERROR;
+	}
+	// si el escritor no ha podido escribir en el fichero, abortamos esta sesión (solo esta)
+	if (__atomic_load_n(ses->salida.error,__ATOMIC_ACQUIRE)) {
+		fprintf(stderr,"Error al escribir en fichero (sesión %u): %s\n",ses->numero,strerror(*ses->salida.error));
+		sendbuffer.flags|=F_ABORT;
 	}
 
-	/* muestra info y calcula la velocidad efectiva conseguida (aproximadamente) */
-	muestrainforesumen(horainicio, next_valido);
+
+	// construir el mensaje válido ***********************************
+	// los flags los hemos ido rellenando al calcular el next
+	sendbuffer.version=ses->version;
+	// si el cliente envía u ofrece el formato compacto, confirmamos que lo aceptamos
+	if (ses->compacto)
+		sendbuffer.flags|=F_COMPACTO;
+	// en versión 2, numseq lleva el tamaño de segmento aceptado (con F_FLUJO, next no propone ninguno)
+	if ((ses->version==RCFTP_VERSION_2) && (recvbuffer->flags & F_FLUJO))
+		sendbuffer.numseq=htonl(RCFTP_BUFLEN);
+	else if (ses->version==RCFTP_VERSION_2)
+		sendbuffer.numseq=htonl(ntohl(recvbuffer->next)<RCFTP_MAXBUFLEN?ntohl(recvbuffer->next):RCFTP_MAXBUFLEN);
+	else
+		sendbuffer.numseq=htonl(0);
+	// sendbuffer.len=htons(adddata()); // nunca respondemos con datos
+	sendbuffer.len=htons(0);
+	// en repetición selectiva, confirmamos todo lo almacenado fuera de orden
+	if (progflags & F_SELREPEAT)
+		sendbuffer.len=htons(bloquessack(&ses->salida.recibidos,next_calculado,ntohl(recvbuffer->numseq),sendbuffer.buffer));
+	sendbuffer.next=htonl(next_calculado);
+	sendbuffer.sum=0;
+	sendbuffer.sum=xsum((char*)&sendbuffer,rcftp_msglen(&sendbuffer));
+	// en este punto el mensaje "correcto" está listo
+
+
+	// generar error **************************************************
+	// no forzamos errores con flags activos (F_COMPACTO solo indica el formato)
+	if ((sendbuffer.flags & ~F_COMPACTO)!=F_NOFLAGS) {
+		ses->error=E_NONE;
+	} else {
+		if ((progflags & F_ROCKNROLL) || (ses->error==E_EXTRA) || (next_calculado>ses->next_valido)) {
+			ses->error=get_random_error(progflags,error_frequency); // obtener error aleatorio
+		} // else (SALSA/FUNKY y no avanzamos), repetir error anterior
+	}
+	////////////////////////////////////////////////////////////////////////
+	// MODIFICAR ESTA VARIABLE PARA FORZAR CIERTO TIPO DE ERROR, por ejemplo:
+	// if (ses->error!=E_NONE) ses->error=E_VERSION_LOST;
+	////////////////////////////////////////////////////////////////////////
+
+
+	// construir mensaje erróneo y especificar next_valido ********************
+	if (ses->error!=E_NONE) {
+		vecesaenviar=generar_mensaje_erroneo(&sendbuffer, progflags, &ses->error, ses->next_valido,next_calculado);
+		// descartar datos ya recibidos si el error implica pérdida de datos: basta con quitarlos
+		// de los recibidos, y los datos reenviados se escribirán sobre los ya encolados. Solo
+		// los de este mensaje: los almacenados antes fuera de orden ya se han confirmado con
+		// SACK, y deben seguir almacenados
+		fin_mensaje=ntohl(recvbuffer->numseq)+ntohs(recvbuffer->len);
+		if (fin_mensaje>next_calculado)
+			fin_mensaje=next_calculado;
+		if (ses->error==E_NEXT_LOWER) { // next menor pero correcto
+			if (fin_mensaje>ntohl(sendbuffer.next))
+				quitarintervalo(&ses->salida.recibidos,ntohl(sendbuffer.next),fin_mensaje);
+			ses->next_valido=ntohl(sendbuffer.next); // <>next_calculado
+		} else if // recepción perdida (*_LOST), que equivale a:
+			((ses->error==E_KILL_LOST) || // (envío y recepción perdida, o
+			 // distinto de E_NEXT_MUCHLOWER y next<=valido)
+			 ((ses->error!=E_NEXT_MUCHLOWER)&&(ntohl(sendbuffer.next)<=ses->next_valido))) {
+			if (fin_mensaje>ses->next_valido)
+				quitarintervalo(&ses->salida.recibidos,ses->next_valido,fin_mensaje);
+			//next_valido=next_valido; // <>next_calculado, <>next_enviado
+		} else { // next sin error (next_calculado>next_valido)
+			ses->next_valido=next_calculado; // =ntohl(sendbuffer->next)
+		}
+	} else { // E_NONE
+		vecesaenviar=1;
+		ses->next_valido=next_calculado; // =ntohl(sendbuffer->next)
+	}
+
+
+	// confirmaciones retardadas: la respuesta correcta a un mensaje en orden, sin flags
+	// ni bloques SACK, se retiene hasta acumular varias o vencer el plazo;
+	// la siguiente respuesta es acumulada y sustituye a las retenidas
+	retener=(acumular>1) && (ses->error==E_NONE) && ((sendbuffer.flags & ~F_COMPACTO)==F_NOFLAGS) && (ntohs(sendbuffer.len)==0)
+			&& (ntohl(recvbuffer->numseq)==next_anterior) && (next_calculado>next_anterior);
+	if (retener && (++ses->retenidas<acumular)) {
+		memcpy(ses->retenida,&sendbuffer,rcftp_msglen(&sendbuffer));
+		if ((ses->timerack<0) && ((ses->timerack=addtimer(2*ttrans,&ses->tack))<0)) {
+			fprintf(stderr,"Error: no se ha podido añadir el plazo de una confirmación retardada\n");
+			exit(S_PROGERROR);
+		}
+		if (progflags & F_VERBOSE)
+			printf("Reteniendo respuesta (%d de %d)\n",ses->retenidas,acumular);
+	} else {
+		if (ses->timerack>=0) {
+			canceltimer(ses->timerack);
+			ses->timerack=-1;
+		}
+		ses->retenidas=0;
+
+		// planificamos el envío del mensaje ************************************
+		for (cont=0;cont<vecesaenviar;cont++) {
+			if (!planificarenvio(ses,&sendbuffer,(cont==0 && vecesaenviar>1)?E_NONE:ses->error,ttrans,tprop,progflags))
+				return S_CLIERROR;
+		}
+		if (vecesaenviar==0) {
+			printf("No planificando envío (%s)\n",strerrorrcftpd(ses->error));
+		}
+	}
+	return S_OK;
 }
 
 
 /**************************************************************************/
-/* Recibe mensaje (y hace las verificaciones oportunas) */
+/* Planifica el envío de una respuesta tras el retardo simulado */
 /**************************************************************************/
-ssize_t recibirmensaje(int socket, struct rcftp_msg *buffer, int buflen, struct sockaddr_storage *remote, socklen_t *remotelen) {
-	ssize_t recvsize;
+int planificarenvio(struct sesion *ses, struct rcftp_msg *mensaje, int error, unsigned long ttrans, unsigned long tprop, unsigned int progflags) {
+	uint64_t ahora,vence;
+
+	// retardo a simular: Ttrans+2Tprop (se asume que el cliente ya simula un Ttrans),
+	// y si la respuesta anterior sigue pendiente, como pronto Ttrans después de ella
+	ahora=ahorausec();
+	vence=ahora+ttrans+2*tprop;
+	if ((ses->firstmsg!=ses->lastmsg) && (ses->ultimovencimiento+ttrans>vence))
+		vence=ses->ultimovencimiento+ttrans;
+
+	// control de flujo: no hay que desbordar colas de mensajes ni de alarmas
+	if ((ses->firstmsg==(ses->lastmsg+1)%WINDOWSIZE) || ((ses->timers[ses->lastmsg]=addtimer(vence-ahora,&ses->tenvio))<0)) { 
+		fprintf(stderr,"Error en control de flujo: demasiados mensajes recibidos en poco tiempo (el cliente esta desbordando al servidor)\n");
+		// deberíamos ignorar el envío, pero mejor enfatizamos que es un error
+		return 0;
+	}
+	ses->ultimovencimiento=vence;
+	memcpy(ses->cola[ses->lastmsg],mensaje,rcftp_msglen(mensaje));
+	ses->error_win[ses->lastmsg]=error;
+	if (progflags & F_VERBOSE) 
+		printf("Planificando envío %d (%s)\n",ses->lastmsg,strerrorrcftpd(error));
+	ses->lastmsg=(ses->lastmsg+1)%WINDOWSIZE;
+	return 1;
+}
+
+
+/**************************************************************************/
+/* Envía las respuestas de una sesión cuyo retardo ha vencido */
+/**************************************************************************/
+void enviarvencidos(int s, struct sesion *ses, unsigned int progflags) {
+	struct rcftp_msg *rafagaenv[WINDOWSIZE]; // mensajes a enviar con una sola llamada
+	int nenviar=0;
+
+	while ((ses->estado==SES_ACTIVA) && (ses->vencidos>0)) {
+		if (ses->firstmsg==ses->lastmsg) {
+			fprintf(stderr,"Error: planificados más envíos que mensajes\n");
+			exit(S_PROGERROR);
+		}
+		if (progflags & F_VERBOSE) {
+			printf("\n");
+			printf("Realizando envío %d (%s)\n",ses->firstmsg,strerrorrcftpd(ses->error_win[ses->firstmsg]));
+		}
+		rafagaenv[nenviar]=(struct rcftp_msg *)ses->cola[ses->firstmsg];
 	
-	*remotelen = sizeof(*remote);
-	recvsize = recvfrom(socket,(char *)buffer,buflen,0,(struct sockaddr *)remote,remotelen);
-	if (recvsize<0 && errno!=EAGAIN) { // en caso de socket no bloqueante
-		//if (recvsize<0 && errno!=EINTR) { // en caso de socket bloqueante (no funciona en GNU/Linux)
-		perror("Error en recvfrom: ");
+		// realizar acciones dependiendo de flags (solo en envio sin error)
+		if ((rafagaenv[nenviar]->flags & F_ABORT) && (ses->error_win[ses->firstmsg]==E_NONE)) {
+			ses->estado=SES_ABORTADA;
+		}
+		if ((rafagaenv[nenviar]->flags & F_FIN) && ((ses->error_win[ses->firstmsg]==E_NONE) || (ses->error_win[ses->firstmsg]==E_EXTRA))) {
+			if (progflags & F_VERBOSE) {
+				printf("Flag F_FIN recibido y confirmado\n");
+			}
+			ses->estado=SES_FINALIZADA;
+		}
+
+		nenviar++;
+		ses->firstmsg=(ses->firstmsg+1)%WINDOWSIZE;
+		ses->vencidos--;
+	}
+	if (nenviar>0)
+		enviamensajes(s,rafagaenv,nenviar,ses->peer,ses->peerlen,progflags,ses->compacto);
+}
+
+
+/**************************************************************************/
+/* Hora actual (reloj monotónico), en microsegundos */
+/**************************************************************************/
+uint64_t ahorausec() {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return (uint64_t)t.tv_sec*1000000+t.tv_nsec/1000;
+}
+
+
+/**************************************************************************/
+/* Cubeta de la tabla de sesiones que corresponde a una dirección */
+/**************************************************************************/
+unsigned int cubetasesion(struct sockaddr_storage *remote, socklen_t remotelen) {
+	unsigned char *p=(unsigned char *)remote;
+	uint32_t h=2166136261u; // FNV-1a
+	socklen_t i;
+
+	for (i=0;i<remotelen;i++)
+		h=(h^p[i])*16777619u;
+	return h&(CUBETAS-1);
+}
+
+
+/**************************************************************************/
+/* Busca la sesión de un cliente por su dirección */
+/**************************************************************************/
+struct sesion *buscarsesion(struct tablasesiones *tabla, struct sockaddr_storage *remote, socklen_t remotelen) {
+	struct sesion *ses;
+
+	for (ses=tabla->cubetas[cubetasesion(remote,remotelen)];ses!=NULL;ses=ses->siguiente) {
+		if ((ses->peerlen==remotelen) && (memcmp(&ses->peer,remote,remotelen)==0))
+			return ses;
+	}
+	return NULL;
+}
+
+
+/**************************************************************************/
+/* Abre una sesión para un cliente nuevo */
+/**************************************************************************/
+struct sesion *nuevasesion(struct tablasesiones *tabla, struct sockaddr_storage *remote, socklen_t remotelen,
+		struct rcftp_msg *primero, unsigned int progflags) {
+	struct sesion *ses;
+	char nombre[32];
+	unsigned int c;
+	int modo=(progflags & F_MAPEO)?O_RDWR:O_WRONLY; // proyectar un fichero (mmap) exige poder leerlo
+	ses=calloc(1,sizeof(struct sesion));
+	if (ses==NULL) {
+		perror("Error al reservar memoria para una sesión");
 		exit(S_SYSERROR);
-	} else if (*remotelen>sizeof(*remote)) {
-		fprintf(stderr,"Error: la dirección del cliente ha sido truncada\n");
+	}
+#ifdef __GNUC__
+	ses->numero=__sync_add_and_fetch(&numsesiones,1); // puede abrirlas otro hilo a la vez
+#else
+	ses->numero=++numsesiones;
+#endif
+
+	// abrir fichero: sin -m, el de siempre; con -m, uno por sesión; en un flujo, el de su
+	// transferencia, sin truncarlo (otros flujos pueden haber escrito ya) y en la posición del rango
+	if (primero->flags & F_FLUJO) {
+		ses->inicio=ntohl(primero->numseq);
+		snprintf(nombre,sizeof(nombre),"f_recibido.t%08x",ntohl(primero->next));
+		ses->salida.fd=open(nombre,modo|O_CREAT,0644);
+	} else {
+		if (progflags & F_MULTI)
+			snprintf(nombre,sizeof(nombre),"f_recibido.%u",ses->numero);
+		else
+			snprintf(nombre,sizeof(nombre),"f_recibido");
+		ses->salida.fd=open(nombre,modo|O_CREAT|O_TRUNC,0644);
+	}
+	if (ses->salida.fd<0) {
+		fprintf(stderr,"Error al abrir el fichero \"%s\" para escritura: %s\n",nombre,strerror(errno));
+		if (!(progflags & F_MULTI))
+			exit(S_SYSERROR);
+		free(ses);
+		return NULL; // se le responderá F_BUSY
+	}
+	ses->salida.error=calloc(1,sizeof(int));
+	if (ses->salida.error==NULL) {
+		perror("Error al reservar memoria para una sesión");
 		exit(S_SYSERROR);
 	}
-	return recvsize;
+	if (progflags & F_VERBOSE)
+		fprintf(stderr,"Fichero \"%s\" abierto para escritura\n",nombre);
+
+	// a partir de ahora esta sesión atiende a remote
+	ses->peer=*remote;
+	ses->peerlen=remotelen;
+	if ((progflags & F_VERBOSE) || (progflags & F_MULTI)) {
+		flockfile(stdout); // sin mezclarse con lo que escriban otros hilos
+		if (primero->flags & F_FLUJO)
+			printf("Sesión %u (fichero \"%s\" desde el byte %u): ",ses->numero,nombre,ses->inicio);
+		else if (progflags & F_MULTI)
+			printf("Sesión %u (fichero \"%s\"): ",ses->numero,nombre);
+		print_peer(ses->peer);
+		funlockfile(stdout);
+	}
+	// numseq inicial 0 para que funcione lanzando el cliente antes que el servidor
+	ses->next_valido=ses->inicio;
+	ses->error=E_NONE;
+	ses->compacto=1;
+	ses->version=RCFTP_VERSION_1;
+	ses->estado=SES_ACTIVA;
+	ses->timerack=-1;
+	ses->tenvio.sesion=ses;
+	ses->tenvio.tipo=T_ENVIO;
+	ses->tack.sesion=ses;
+	ses->tack.tipo=T_ACK;
+	ses->tinactividad.sesion=ses;
+	ses->tinactividad.tipo=T_INACTIVIDAD;
+	ses->ultimarecepcion=ahorausec();
+	// sin -m no se abandona la sesión: el servidor espera a su único cliente
+	ses->timerinactividad=(progflags & F_MULTI)?addtimer(INACTIVIDAD,&ses->tinactividad):-1;
+	if (gettimeofday(&ses->horainicio,NULL)<0) {
+		perror("Error al intentar obtener la hora del sistema\n");
+		exit(1);
+	}
+
+	c=cubetasesion(remote,remotelen);
+	ses->siguiente=tabla->cubetas[c];
+	tabla->cubetas[c]=ses;
+	tabla->n++;
+	return ses;
 }
 
+
+/**************************************************************************/
+/* Cierra una sesión: muestra el resumen, cierra el fichero y libera todo */
+/**************************************************************************/
+void cerrarsesion(struct tablasesiones *tabla, struct sesion *ses, unsigned int progflags) {
+	struct sesion **p;
+	unsigned int i;
+
+	/* muestra info y calcula la velocidad efectiva conseguida (aproximadamente) */
+	flockfile(stdout);
+	if (progflags & F_MULTI)
+		printf("Sesión %u terminada\n",ses->numero);
+	muestrainforesumen(ses->horainicio, ses->next_valido-ses->inicio);
+	funlockfile(stdout);
+
+	// los timers pendientes (o vencidos sin atender) ya no corresponden a nadie
+	for (i=ses->firstmsg;i!=ses->lastmsg;i=(i+1)%WINDOWSIZE)
+		canceltimer(ses->timers[i]);
+	if (ses->timerack>=0)
+		canceltimer(ses->timerack);
+	if (ses->timerinactividad>=0)
+		canceltimer(ses->timerinactividad);
+	// el escritor lo cierra tras escribir lo que quede encolado (lo proyectado ya está en el fichero)
+	if (ses->salida.mapa!=NULL)
+		munmap(ses->salida.mapa,ses->salida.tamano);
+	encolarcierre(&ses->salida);
+
+	for (p=&tabla->cubetas[cubetasesion(&ses->peer,ses->peerlen)];*p!=ses;p=&(*p)->siguiente)
+		;
+	*p=ses->siguiente;
+	tabla->n--;
+	free(ses);
+}
+
+
+/**************************************************************************/
+/* Recibe los mensajes disponibles (y hace las verificaciones oportunas) */
+/**************************************************************************/
+int recibirmensajes(int socket, struct recibido *rafaga, int n, unsigned int gro) {
+	int i,nrecibidos;
+#ifdef __linux__
+	struct mmsghdr hdrs[MAXRAFAGA];
+	struct iovec iov[MAXRAFAGA];
+
+#ifdef UDP_GRO
+	if (gro)
+		return recibiragrupados(socket,rafaga,n);
+#endif
+	if (n>MAXRAFAGA)
+		n=MAXRAFAGA;
+	memset(hdrs,0,n*sizeof(hdrs[0]));
+	for (i=0;i<n;i++) {
+		iov[i].iov_base=&rafaga[i].msg;
+		iov[i].iov_len=sizeof(rafaga[i].msg);
+		hdrs[i].msg_hdr.msg_iov=&iov[i];
+		hdrs[i].msg_hdr.msg_iovlen=1;
+		hdrs[i].msg_hdr.msg_name=&rafaga[i].remote;
+		hdrs[i].msg_hdr.msg_namelen=sizeof(rafaga[i].remote);
+	}
+	nrecibidos=recvmmsg(socket,hdrs,n,0,NULL);
+	if (nrecibidos<0 && errno!=EAGAIN) { // en caso de socket no bloqueante
+		perror("Error en recvmmsg: ");
+		exit(S_SYSERROR);
+	} else if (nrecibidos<0) {
+		nrecibidos=0;
+	}
+	for (i=0;i<nrecibidos;i++) {
+		rafaga[i].len=hdrs[i].msg_len;
+		rafaga[i].remotelen=hdrs[i].msg_hdr.msg_namelen;
+	}
+#else
+	for (nrecibidos=0;nrecibidos<n;nrecibidos++) {
+		rafaga[nrecibidos].remotelen=sizeof(rafaga[nrecibidos].remote);
+		rafaga[nrecibidos].len=recvfrom(socket,(char *)&rafaga[nrecibidos].msg,sizeof(rafaga[nrecibidos].msg),0,
+				(struct sockaddr *)&rafaga[nrecibidos].remote,&rafaga[nrecibidos].remotelen);
+		if (rafaga[nrecibidos].len<0 && errno!=EAGAIN) { // en caso de socket no bloqueante
+			perror("Error en recvfrom: ");
+			exit(S_SYSERROR);
+		} else if (rafaga[nrecibidos].len<0) {
+			break;
+		}
+	}
+#endif
+	for (i=0;i<nrecibidos;i++) {
+		if (rafaga[i].remotelen>sizeof(rafaga[i].remote)) {
+			fprintf(stderr,"Error: la dirección del cliente ha sido truncada\n");
+			exit(S_SYSERROR);
+		}
+	}
+	return nrecibidos;
+}
+
+/**************************************************************************/
+/* Activa la recepción de datagramas agrupados (UDP GRO) */
+/**************************************************************************/
+int activargro(int s) {
+#if defined(__linux__) && defined(UDP_GRO)
+	int on=1;
+
+	if (setsockopt(s,IPPROTO_UDP,UDP_GRO,&on,sizeof(on))==0)
+		return 1;
+	perror("No se puede activar UDP GRO (se recibe cada mensaje por separado)");
+#else
+	fprintf(stderr,"UDP GRO no disponible en este sistema (se recibe cada mensaje por separado)\n");
+#endif
+	return 0;
+}
+
+#if defined(__linux__) && defined(UDP_GRO)
+/**************************************************************************/
+/* Recibe datagramas agrupados y los separa en mensajes */
+/**************************************************************************/
+int recibiragrupados(int socket, struct recibido *rafaga, int n) {
+	// datagrama agrupado pendiente de separar (puede no caber entero en la ráfaga)
+	static POR_HILO uint8_t agrupado[MAXDATAGRAMA];
+	static POR_HILO ssize_t tamagrupado=0,posagrupado=0;
+	static POR_HILO int tamsegmento;
+	static POR_HILO struct sockaddr_storage remote;
+	static POR_HILO socklen_t remotelen;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr hdr;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int nrecibidos,tam;
+
+	for (nrecibidos=0;nrecibidos<n;nrecibidos++) {
+		if (posagrupado>=tamagrupado) {
+			memset(&hdr,0,sizeof(hdr));
+			iov.iov_base=agrupado;
+			iov.iov_len=sizeof(agrupado);
+			hdr.msg_iov=&iov;
+			hdr.msg_iovlen=1;
+			hdr.msg_name=&remote;
+			hdr.msg_namelen=sizeof(remote);
+			hdr.msg_control=control;
+			hdr.msg_controllen=sizeof(control);
+			tamagrupado=recvmsg(socket,&hdr,0);
+			if (tamagrupado<0 && errno!=EAGAIN) { // en caso de socket no bloqueante
+				perror("Error en recvmsg: ");
+				exit(S_SYSERROR);
+			} else if (tamagrupado<0) {
+				tamagrupado=0;
+				break;
+			}
+			if (hdr.msg_namelen>sizeof(remote)) {
+				fprintf(stderr,"Error: la dirección del cliente ha sido truncada\n");
+				exit(S_SYSERROR);
+			}
+			remotelen=hdr.msg_namelen;
+			posagrupado=0;
+			// sin agrupar, el datagrama es un único mensaje
+			tamsegmento=tamagrupado;
+			for (cmsg=CMSG_FIRSTHDR(&hdr);cmsg!=NULL;cmsg=CMSG_NXTHDR(&hdr,cmsg)) {
+				if (cmsg->cmsg_level==IPPROTO_UDP && cmsg->cmsg_type==UDP_GRO)
+					memcpy(&tamsegmento,CMSG_DATA(cmsg),sizeof(tamsegmento));
+			}
+			if (tamsegmento<=0) // datagrama vacío: se procesa como mensaje de longitud 0
+				tamsegmento=tamagrupado+1;
+		}
+		// el último mensaje del grupo puede ser más corto
+		tam=tamagrupado-posagrupado;
+		if (tam>tamsegmento)
+			tam=tamsegmento;
+		rafaga[nrecibidos].len=(tam>(int)sizeof(rafaga[nrecibidos].msg))?(ssize_t)sizeof(rafaga[nrecibidos].msg):tam;
+		memcpy(&rafaga[nrecibidos].msg,&agrupado[posagrupado],rafaga[nrecibidos].len);
+		rafaga[nrecibidos].remote=remote;
+		rafaga[nrecibidos].remotelen=remotelen;
+		posagrupado+=tamsegmento;
+	}
+	return nrecibidos;
+}
+#endif
+
 /**************************************************************************/
 /* Calcula el siguiente next expected y escribe en fichero  */
 /**************************************************************************/
 uint32_t calcnextexpected(uint32_t oldexpected, uint32_t numseq, uint16_t len, 
-		uint8_t* buffer, FILE *fsalida, uint8_t *flags, unsigned int prgflags) {
-	size_t wrsize;
-	uint16_t firstbyte,bytestowrite;
-	uint32_t nextexpected=oldexpected;
+		uint8_t* buffer, struct salida *salida, uint8_t *flags, unsigned int prgflags) {
+	// un next menor simulado puede quedar dentro de datos ya almacenados (y confirmados con
+	// SACK), que el cliente no reenviará: el next llega hasta donde acaban
+	uint32_t nextexpected=finintervalo(&salida->recibidos,oldexpected);
 
-	if (len>RCFTP_BUFLEN) {
-		fprintf(stderr,"Recibido mensaje informando de longitud %d>%d\n",len,RCFTP_BUFLEN);
+	if (len>RCFTP_MAXBUFLEN) {
+		fprintf(stderr,"Recibido mensaje informando de longitud %d>%d\n",len,RCFTP_MAXBUFLEN);
 		exit(S_CLIERROR);
 	}
 	if (nextexpected>=numseq &&	nextexpected<numseq+len) {
 		if ((nextexpected!=numseq) && (prgflags & F_VERBOSE))
 			fprintf(stderr,"Recibido mensaje con numseq=%d cuando esperaba numseq=%d\n(No implica necesariamente que el cliente esté respondiendo mal)\n",numseq,nextexpected);
-		firstbyte=nextexpected-numseq;
-		bytestowrite=len-firstbyte;
-		// guardar datos
-		wrsize=fwrite(&buffer[firstbyte],sizeof(char),bytestowrite,fsalida);
-		// vaciamos el buffer para poder ver mejor lo escrito
-		fflush(fsalida);
-		if (wrsize!=bytestowrite) {
-			if (wrsize<0) {
-				perror("Error al escribir (fwrite) en fichero");
-				// el servidor no intenta recuperarse
-				*flags|=F_ABORT;
-				//nextexpected+=0;
-			}
-			else {
-				fprintf(stderr,"Guardados %d bytes al intentar guardar %d bytes de un mensaje de %d bytes\n",
-						(int)wrsize,(int)bytestowrite,(int)len);
-				// esto no debería pasar, pero el emisor debería responder bien
-				nextexpected+=wrsize;
-			}
-		} else { // escrito correctamente
-			nextexpected+=bytestowrite;
+		// los datos recibidos antes fuera de orden pueden haberse vuelto contiguos
+		if (escribirdatos(nextexpected,&buffer[nextexpected-numseq],numseq+len-nextexpected,salida))
+			nextexpected=finintervalo(&salida->recibidos,nextexpected);
+	} else if ((prgflags & F_SELREPEAT) && (numseq>nextexpected) && (len>0)) { // fuera de orden: en su posición
+		if (finintervalo(&salida->recibidos,numseq)>=numseq+len) {
+			; // ya lo teníamos (duplicado)
+		} else if (escribirdatos(numseq,buffer,len,salida)) {
+			if (prgflags & F_VERBOSE)
+				fprintf(stderr,"Almacenado mensaje fuera de orden con numseq=%d (esperaba numseq=%d)\n",numseq,nextexpected);
+		} else if (prgflags & F_VERBOSE) {
+			fprintf(stderr,"Descartado mensaje fuera de orden con numseq=%d: demasiados huecos\n",numseq);
 		}
 	} else { // números de secuencia fuera de la ventana de recepción
 	   	//nextexpected+=0;
@@ -529,6 +1063,405 @@ uint32_t calcnextexpected(uint32_t oldexpected, uint32_t numseq, uint16_t len,
 }
 
 
+/**************************************************************************/
+/* Encola para el escritor unos datos en su posición y los anota como recibidos */
+/**************************************************************************/
+int escribirdatos(uint32_t numseq, uint8_t* buffer, uint16_t len, struct salida *salida) {
+	uint32_t contiguos;
+
+	// si no caben más huecos o el disco no da abasto, es como si se hubieran perdido: ni se
+	// encolan ni se anotan, y el cliente los reenviará
+	if (!cabeintervalo(&salida->recibidos,numseq,numseq+len))
+		return 0;
+	if ((salida->mapa!=NULL) && (numseq+len<=salida->tamano))
+		memcpy(&salida->mapa[numseq],buffer,len);
+	else if (!encolarescritura(salida,numseq,buffer,len))
+		return 0;
+	// ya encolados: solo ahora cuentan como recibidos (y se confirman)
+	anadirintervalo(&salida->recibidos,numseq,numseq+len);
+	// con el fichero proyectado, que el kernel vaya pasando a disco lo recibido de forma contigua
+	if (salida->mapa!=NULL) {
+		contiguos=finintervalo(&salida->recibidos,salida->sincronizado);
+		if (contiguos>salida->tamano)
+			contiguos=salida->tamano;
+		if (contiguos-salida->sincronizado>=SINCRONIZAR) {
+			encolarsincronizacion(salida,salida->sincronizado,contiguos-salida->sincronizado);
+			salida->sincronizado=contiguos;
+		}
+	}
+	return 1;
+}
+
+
+/**************************************************************************/
+/* Reserva el fichero con el tamaño anunciado y lo proyecta en memoria */
+/**************************************************************************/
+int mapearsalida(struct salida *salida, uint32_t tamano, uint32_t inicio, unsigned int progflags) {
+	struct stat estado;
+	void *mapa;
+
+	if (tamano==0)
+		return 0;
+	// reservar los bloques de una vez (si el sistema de ficheros no puede, da igual) y fijar el
+	// tamaño, sin recortar nunca lo que otro flujo de la misma transferencia haya escrito ya
+#ifdef __linux__
+	fallocate(salida->fd,0,0,tamano);
+#endif
+	if ((fstat(salida->fd,&estado)<0) || ((estado.st_size<tamano) && (ftruncate(salida->fd,tamano)<0))) {
+		if (progflags & F_VERBOSE)
+			fprintf(stderr,"No se puede reservar el fichero (%s): se escribirá sin proyectarlo\n",strerror(errno));
+		return 0;
+	}
+	mapa=mmap(NULL,tamano,PROT_READ|PROT_WRITE,MAP_SHARED,salida->fd,0);
+	if (mapa==MAP_FAILED) {
+		if (progflags & F_VERBOSE)
+			fprintf(stderr,"No se puede proyectar el fichero (%s): se escribirá sin proyectarlo\n",strerror(errno));
+		return 0;
+	}
+	salida->mapa=mapa;
+	salida->tamano=tamano;
+	// lo anterior ya lo fue escribiendo el escritor
+	salida->sincronizado=finintervalo(&salida->recibidos,inicio);
+	if (progflags & F_VERBOSE)
+		fprintf(stderr,"Fichero de %u bytes proyectado en memoria\n",tamano);
+	return 1;
+}
+
+
+/**************************************************************************/
+/* Crea la cola y el hilo escritor del hilo actual */
+/**************************************************************************/
+void iniciarescritor() {
+	escritorhilo=calloc(1,sizeof(struct escritor));
+	if (escritorhilo!=NULL)
+		escritorhilo->datos=malloc(ESCRITOR_DATOS);
+	if ((escritorhilo==NULL) || (escritorhilo->datos==NULL)) {
+		perror("Error al reservar memoria para la cola de escritura");
+		exit(S_SYSERROR);
+	}
+	if (sem_init(&escritorhilo->avisos,0,0)!=0) {
+		perror("Error al crear el semáforo de la cola de escritura");
+		exit(S_SYSERROR);
+	}
+	if ((errno=pthread_create(&escritorhilo->hilo,NULL,escritor,escritorhilo))!=0) {
+		perror("Error al crear el hilo escritor");
+		exit(S_SYSERROR);
+	}
+}
+
+
+/**************************************************************************/
+/* Espera a que el escritor vacíe la cola y lo libera */
+/**************************************************************************/
+void terminarescritor() {
+	__atomic_store_n(&escritorhilo->terminar,1,__ATOMIC_RELEASE);
+	sem_post(&escritorhilo->avisos);
+	pthread_join(escritorhilo->hilo,NULL);
+	sem_destroy(&escritorhilo->avisos);
+	free(escritorhilo->datos);
+	free(escritorhilo);
+	escritorhilo=NULL;
+}
+
+
+/**************************************************************************/
+/* Encola una escritura (productor: el bucle de recepción) */
+/**************************************************************************/
+int encolarescritura(struct salida *salida, off_t pos, uint8_t *buffer, uint32_t len) {
+	struct escritor *e=escritorhilo;
+	struct escritura *w;
+	uint64_t relleno,liberados;
+
+	if (len==0)
+		return 1;
+	if (e->cabeza-__atomic_load_n(&e->cola,__ATOMIC_ACQUIRE)>=ESCRITOR_ENTRADAS)
+		return 0;
+	// los datos de cada escritura, contiguos en el anillo: si no caben al final, al principio
+	relleno=(e->producidos%ESCRITOR_DATOS+len>ESCRITOR_DATOS)?ESCRITOR_DATOS-e->producidos%ESCRITOR_DATOS:0;
+	liberados=__atomic_load_n(&e->liberados,__ATOMIC_ACQUIRE);
+	if (e->producidos+relleno+len-liberados>ESCRITOR_DATOS)
+		return 0;
+	w=&e->entradas[e->cabeza%ESCRITOR_ENTRADAS];
+	w->fd=salida->fd;
+	w->error=salida->error;
+	w->tipo=ESC_DATOS;
+	w->len=len;
+	w->pos=pos;
+	w->datos=e->producidos+relleno;
+	memcpy(&e->datos[w->datos%ESCRITOR_DATOS],buffer,len);
+	e->producidos=w->datos+len;
+	w->fin=e->producidos;
+	// la entrada debe estar completa antes de que el escritor vea la nueva cabeza
+	__atomic_store_n(&e->cabeza,e->cabeza+1,__ATOMIC_RELEASE);
+	sem_post(&e->avisos);
+	return 1;
+}
+
+
+/**************************************************************************/
+/* Encola el cierre de un fichero */
+/**************************************************************************/
+void encolarcierre(struct salida *salida) {
+	struct escritor *e=escritorhilo;
+	struct escritura *w;
+
+	// solo con la cola llena: esperamos a que el escritor haga sitio
+	while (e->cabeza-__atomic_load_n(&e->cola,__ATOMIC_ACQUIRE)>=ESCRITOR_ENTRADAS)
+		sched_yield();
+	w=&e->entradas[e->cabeza%ESCRITOR_ENTRADAS];
+	w->fd=salida->fd;
+	w->error=salida->error;
+	w->tipo=ESC_CERRAR;
+	w->len=0;
+	w->pos=0;
+	w->datos=e->producidos;
+	w->fin=e->producidos;
+	__atomic_store_n(&e->cabeza,e->cabeza+1,__ATOMIC_RELEASE);
+	sem_post(&e->avisos);
+}
+
+
+/**************************************************************************/
+/* Encola que se empiece a pasar a disco un rango proyectado en memoria */
+/**************************************************************************/
+void encolarsincronizacion(struct salida *salida, off_t pos, uint32_t len) {
+	struct escritor *e=escritorhilo;
+	struct escritura *w;
+
+	// es solo una ayuda: con la cola llena, el kernel ya lo escribirá por su cuenta
+	if (e->cabeza-__atomic_load_n(&e->cola,__ATOMIC_ACQUIRE)>=ESCRITOR_ENTRADAS)
+		return;
+	w=&e->entradas[e->cabeza%ESCRITOR_ENTRADAS];
+	w->fd=salida->fd;
+	w->error=salida->error;
+	w->tipo=ESC_SINCRONIZAR;
+	w->len=len;
+	w->pos=pos;
+	w->datos=e->producidos;
+	w->fin=e->producidos;
+	__atomic_store_n(&e->cabeza,e->cabeza+1,__ATOMIC_RELEASE);
+	sem_post(&e->avisos);
+}
+
+
+/**************************************************************************/
+/* Hilo escritor: vacía la cola agrupando escrituras contiguas */
+/**************************************************************************/
+void *escritor(void *arg) {
+	struct escritor *e=arg;
+	struct escritura *w,*ultima;
+	struct iovec iov[ESCRITOR_IOV];
+	unsigned int cola,cabeza;
+	int n,i;
+	size_t total;
+	ssize_t escritos;
+	off_t pos;
+
+	for (;;) {
+		while ((sem_wait(&e->avisos)!=0) && (errno==EINTR))
+			;
+		cola=e->cola;
+		cabeza=__atomic_load_n(&e->cabeza,__ATOMIC_ACQUIRE);
+		while (cola!=cabeza) {
+			w=&e->entradas[cola%ESCRITOR_ENTRADAS];
+			if (w->tipo==ESC_CERRAR) {
+				close(w->fd);
+				free(w->error); // la sesión ya no existe
+				__atomic_store_n(&e->cola,++cola,__ATOMIC_RELEASE);
+				continue;
+			}
+			if (w->tipo==ESC_SINCRONIZAR) { // empezar a escribirlo sin esperar a que acabe
+#ifdef __linux__
+				sync_file_range(w->fd,w->pos,w->len,SYNC_FILE_RANGE_WRITE);
+#endif
+				__atomic_store_n(&e->cola,++cola,__ATOMIC_RELEASE);
+				continue;
+			}
+			// agrupar las siguientes escrituras del mismo fichero que continúan a esta
+			total=0;
+			for (n=0;(n<ESCRITOR_IOV) && (cola+n!=cabeza);n++) {
+				ultima=&e->entradas[(cola+n)%ESCRITOR_ENTRADAS];
+				if ((ultima->tipo!=ESC_DATOS) || (ultima->fd!=w->fd) || (ultima->pos!=w->pos+(off_t)total))
+					break;
+				iov[n].iov_base=&e->datos[ultima->datos%ESCRITOR_DATOS];
+				iov[n].iov_len=ultima->len;
+				total+=ultima->len;
+			}
+			ultima=&e->entradas[(cola+n-1)%ESCRITOR_ENTRADAS];
+			// un pwritev puede escribir menos de lo pedido: seguir por donde se quedó
+			for (i=0,pos=w->pos;total>0;) {
+#ifdef __linux__
+				escritos=pwritev(w->fd,&iov[i],n-i,pos);
+#else
+				escritos=pwrite(w->fd,iov[i].iov_base,iov[i].iov_len,pos);
+#endif
+				if (escritos<0) {
+					if (errno==EINTR)
+						continue;
+					// solo falla esta sesión: se lo anotamos para que aborte, y descartamos el grupo
+					if (__atomic_load_n(w->error,__ATOMIC_RELAXED)==0)
+						perror("Error al escribir (pwritev) en fichero");
+					__atomic_store_n(w->error,errno,__ATOMIC_RELEASE);
+					break;
+				}
+				total-=escritos;
+				pos+=escritos;
+				while ((i<n) && ((size_t)escritos>=iov[i].iov_len))
+					escritos-=iov[i++].iov_len;
+				if (i<n) {
+					iov[i].iov_base=(uint8_t *)iov[i].iov_base+escritos;
+					iov[i].iov_len-=escritos;
+				}
+			}
+			cola+=n;
+			// datos y entradas escritos: el productor puede reutilizarlos
+			__atomic_store_n(&e->liberados,ultima->fin,__ATOMIC_RELEASE);
+			__atomic_store_n(&e->cola,cola,__ATOMIC_RELEASE);
+		}
+		if (__atomic_load_n(&e->terminar,__ATOMIC_ACQUIRE) && (cola==__atomic_load_n(&e->cabeza,__ATOMIC_ACQUIRE)))
+			break;
+	}
+	return NULL;
+}
+
+
+/**************************************************************************/
+/* Añade un rango al conjunto, uniéndolo con los que solape o toque */
+/**************************************************************************/
+int anadirintervalo(struct intervalos *iv, uint32_t inicio, uint32_t fin) {
+	int i,j,k;
+
+	if (inicio>=fin)
+		return 1;
+	// rangos [i,j) que solapan o tocan el nuevo
+	for (i=0;(i<iv->n) && (iv->r[i].fin<inicio);i++)
+		;
+	for (j=i;(j<iv->n) && (iv->r[j].inicio<=fin);j++)
+		;
+	if (i==j) { // no toca a ninguno: un rango más
+		if (iv->n>=MAXINTERVALOS)
+			return 0;
+		for (k=iv->n;k>i;k--)
+			iv->r[k]=iv->r[k-1];
+		iv->r[i].inicio=inicio;
+		iv->r[i].fin=fin;
+		iv->n++;
+		return 1;
+	}
+	// se unen todos en el primero
+	if (iv->r[i].inicio<inicio)
+		inicio=iv->r[i].inicio;
+	if (iv->r[j-1].fin>fin)
+		fin=iv->r[j-1].fin;
+	iv->r[i].inicio=inicio;
+	iv->r[i].fin=fin;
+	for (k=j;k<iv->n;k++)
+		iv->r[i+1+k-j]=iv->r[k];
+	iv->n-=j-i-1;
+	return 1;
+}
+
+
+/**************************************************************************/
+/* Comprueba si un rango cabe en el conjunto */
+/**************************************************************************/
+int cabeintervalo(struct intervalos *iv, uint32_t inicio, uint32_t fin) {
+	int i;
+
+	if ((inicio>=fin) || (iv->n<MAXINTERVALOS))
+		return 1;
+	// lleno: solo cabe si se une a algún rango que ya esté
+	for (i=0;(i<iv->n) && (iv->r[i].fin<inicio);i++)
+		;
+	return (i<iv->n) && (iv->r[i].inicio<=fin);
+}
+
+
+/**************************************************************************/
+/* Quita un rango del conjunto */
+/**************************************************************************/
+void quitarintervalo(struct intervalos *iv, uint32_t inicio, uint32_t fin) {
+	int i,k;
+
+	for (i=0;(i<iv->n) && (inicio<fin);i++) {
+		if ((iv->r[i].fin<=inicio) || (iv->r[i].inicio>=fin))
+			continue;
+		if ((iv->r[i].inicio<inicio) && (iv->r[i].fin>fin)) { // queda un hueco en medio: partir
+			if (iv->n>MAXINTERVALOS) { // sin sitio: se quita también el final, que se reenviará
+				iv->r[i].fin=inicio;
+				return;
+			}
+			for (k=iv->n;k>i+1;k--)
+				iv->r[k]=iv->r[k-1];
+			iv->r[i+1].inicio=fin;
+			iv->r[i+1].fin=iv->r[i].fin;
+			iv->r[i].fin=inicio;
+			iv->n++;
+			return;
+		}
+		if (iv->r[i].inicio<inicio) { // queda el principio
+			iv->r[i].fin=inicio;
+		} else if (iv->r[i].fin>fin) { // queda el final
+			iv->r[i].inicio=fin;
+		} else { // no queda nada
+			for (k=i;k<iv->n-1;k++)
+				iv->r[k]=iv->r[k+1];
+			iv->n--;
+			i--;
+		}
+	}
+}
+
+
+/**************************************************************************/
+/* Fin de los datos recibidos de forma contigua desde un número de secuencia */
+/**************************************************************************/
+uint32_t finintervalo(struct intervalos *iv, uint32_t desde) {
+	int i;
+
+	for (i=0;i<iv->n;i++) {
+		if ((iv->r[i].inicio<=desde) && (desde<iv->r[i].fin))
+			return iv->r[i].fin;
+	}
+	return desde;
+}
+
+
+/**************************************************************************/
+/* Construye los bloques SACK de los rangos recibidos por encima de next */
+/**************************************************************************/
+int bloquessack(struct intervalos *iv, uint32_t nextexpected, uint32_t reciente, uint8_t *buffer) {
+	struct intervalo bloques[MAXINTERVALOS+1];
+	struct rcftp_sack sack;
+	struct intervalo r;
+	int i,j,nbloques=0;
+
+	// los rangos ya están ordenados y unidos; el que llega hasta nextexpected no es un bloque
+	for (i=0;i<iv->n;i++) {
+		if (iv->r[i].inicio<=nextexpected)
+			continue;
+		bloques[nbloques++]=iv->r[i];
+	}
+	// el rango del mensaje recién recibido va primero (el emisor ve antes lo más nuevo),
+	// y el resto en orden creciente
+	for (i=0;i<nbloques;i++) {
+		if ((bloques[i].inicio<=reciente) && (reciente<bloques[i].fin)) {
+			r=bloques[i];
+			for (j=i;j>0;j--)
+				bloques[j]=bloques[j-1];
+			bloques[0]=r;
+			break;
+		}
+	}
+	for (i=0;i<nbloques;i++) {
+		sack.inicio=htonl(bloques[i].inicio);
+		sack.fin=htonl(bloques[i].fin);
+		memcpy(buffer+i*sizeof(sack),&sack,sizeof(sack));
+	}
+	return nbloques*sizeof(sack);
+}
+
+
 /**************************************************************************/
 /* Imprime estructura de direccion */
 /**************************************************************************/
@@ -565,13 +1498,13 @@ void print_peer(struct sockaddr_storage caddr) {
 int get_random_error(unsigned int flags,int error_frequency) {
 	int accion=E_NONE;
 
-	if ((rand()%error_frequency)==0) { 
+	if ((rand_r(&semilla)%error_frequency)==0) { 
 		if (flags & F_ROCKNROLL) 
-			accion=rand() % (E_ROCKNROLL_MAX+1);
+			accion=rand_r(&semilla) % (E_ROCKNROLL_MAX+1);
 		else if (flags & F_FUNKY)
-			accion=rand() % (E_FUNKY_MAX+1);
+			accion=rand_r(&semilla) % (E_FUNKY_MAX+1);
 		else if (flags & F_SALSA) 
-			accion=rand() % (E_SALSA_MAX+1);
+			accion=rand_r(&semilla) % (E_SALSA_MAX+1);
 	}
 
 	return accion;
@@ -582,7 +1515,7 @@ int get_random_error(unsigned int flags,int error_frequency) {
 /* generate incorrect response to simulate network trouble                */
 /*******************************************************************+******/
 int generar_mensaje_erroneo(struct rcftp_msg *sendbuffer, unsigned int flags, int *error, uint32_t next_valido, uint32_t next_calculado) {
-	size_t buflen=sizeof(*sendbuffer);
+	size_t buflen=rcftp_msglen(sendbuffer); // el checksum cubre cabeceras y datos válidos
 	int enviar=-1;
 	union { uint16_t s; char c[2]; } xun;
 	char c;
@@ -603,7 +1536,7 @@ int generar_mensaje_erroneo(struct rcftp_msg *sendbuffer, unsigned int flags, in
 			/* next entre 1 y RCFTP_BUFLEN menor */
 			if (next_calculado>next_valido) { // solo si hemos recibido datos válidos
 				if ((next_calculado-next_valido)>1) // si hemos recibido más de 2 bytes
-					sendbuffer->next=htonl(next_calculado-1-(rand()%((next_calculado-next_valido)-1)));
+					sendbuffer->next=htonl(next_calculado-1-(rand_r(&semilla)%((next_calculado-next_valido)-1)));
 				else // solo hemos recibido 1 byte
 					sendbuffer->next=htonl(next_calculado-1);
 				sendbuffer->sum=0;
@@ -680,41 +1613,111 @@ int generar_mensaje_erroneo(struct rcftp_msg *sendbuffer, unsigned int flags, in
 /**************************************************************************/
 /* Envía un mensaje a la dirección especificada */
 /**************************************************************************/
-void enviamensaje(int s, struct rcftp_msg sendbuffer, struct sockaddr_storage remote, socklen_t remotelen, unsigned int flags) {
-	ssize_t sentsize;
+void enviamensaje(int s, struct rcftp_msg *sendbuffer, struct sockaddr_storage remote, socklen_t remotelen, unsigned int flags, char compacto) {
+	enviamensajes(s,&sendbuffer,1,remote,remotelen,flags,compacto);
+}
 
-	if ((sentsize=sendto(s,(char *)&sendbuffer,sizeof(sendbuffer),0,(struct sockaddr *)&remote,remotelen)) != sizeof(sendbuffer)) {
-		if (sentsize!=-1)
-			fprintf(stderr,"Error: enviados %d bytes de un mensaje de %d bytes\n",(int)sentsize,(int)sizeof(sendbuffer));
-		else
-			perror("Error en sendto");
-		exit(S_SYSERROR);
-	} 
+
+/**************************************************************************/
+/* Envía varios mensajes a la dirección especificada */
+/**************************************************************************/
+void enviamensajes(int s, struct rcftp_msg **mensajes, int n, struct sockaddr_storage remote, socklen_t remotelen, unsigned int flags, char compacto) {
+	ssize_t sentsize;
+	int msglen[WINDOWSIZE];
+	int i,nenviados;
+#ifdef __linux__
+	struct mmsghdr hdrs[WINDOWSIZE];
+	struct iovec iov[WINDOWSIZE];
+#endif
+
+	if (n>WINDOWSIZE) {
+		fprintf(stderr,"Error: intentando enviar %d mensajes de una vez\n",n);
+		exit(S_PROGERROR);
+	}
+	for (i=0;i<n;i++) {
+		if (compacto) {
+			msglen[i]=rcftp_msglen(mensajes[i]);
+		} else { // formato fijo: el resto del buffer a 0 para que el checksum no cambie
+			msglen[i]=RCFTP_FIXEDLEN;
+			if (ntohs(mensajes[i]->len)<RCFTP_BUFLEN)
+				memset(&mensajes[i]->buffer[ntohs(mensajes[i]->len)],0,RCFTP_BUFLEN-ntohs(mensajes[i]->len));
+		}
+	}
+#ifdef __linux__
+	memset(hdrs,0,n*sizeof(hdrs[0]));
+	for (i=0;i<n;i++) {
+		iov[i].iov_base=mensajes[i];
+		iov[i].iov_len=msglen[i];
+		hdrs[i].msg_hdr.msg_iov=&iov[i];
+		hdrs[i].msg_hdr.msg_iovlen=1;
+		hdrs[i].msg_hdr.msg_name=&remote;
+		hdrs[i].msg_hdr.msg_namelen=remotelen;
+	}
+	for (nenviados=0;nenviados<n;nenviados+=sentsize) {
+		// sendmmsg puede enviar menos mensajes de los pedidos: continuamos con el resto
+		if ((sentsize=sendmmsg(s,&hdrs[nenviados],n-nenviados,0))<=0) {
+			perror("Error en sendmmsg");
+			exit(S_SYSERROR);
+		}
+	}
+	for (i=0;i<n;i++) {
+		if ((int)hdrs[i].msg_len!=msglen[i]) {
+			fprintf(stderr,"Error: enviados %d bytes de un mensaje de %d bytes\n",(int)hdrs[i].msg_len,msglen[i]);
+			exit(S_SYSERROR);
+		}
+	}
+#else
+	for (nenviados=0;nenviados<n;nenviados++) {
+		if ((sentsize=sendto(s,(char *)mensajes[nenviados],msglen[nenviados],0,(struct sockaddr *)&remote,remotelen)) != msglen[nenviados]) {
+			if (sentsize!=-1)
+				fprintf(stderr,"Error: enviados %d bytes de un mensaje de %d bytes\n",(int)sentsize,msglen[nenviados]);
+			else
+				perror("Error en sendto");
+			exit(S_SYSERROR);
+		} 
+	}
+#endif
 
 	// print response if in verbose mode
 	if (flags & F_VERBOSE) {
-		printf("Mensaje RCFTP " ANSI_COLOR_MAGENTA "enviado" ANSI_COLOR_RESET ":\n");
-		print_rcftp_msg(&sendbuffer,sizeof(sendbuffer));
+		for (i=0;i<n;i++) {
+			printf("Mensaje RCFTP " ANSI_COLOR_MAGENTA "enviado" ANSI_COLOR_RESET ":\n");
+			print_rcftp_msg(mensajes[i],msglen[i]);
+		}
 	} 
 }	
 
 
+/**************************************************************************/
+/* Formato (compacto o fijo) en el que envía el cliente */
+/**************************************************************************/
+int esformatocompacto(struct rcftp_msg *recvbuffer, ssize_t recvsize) {
+	return (recvbuffer->flags & F_COMPACTO) || (recvsize!=(ssize_t)RCFTP_FIXEDLEN);
+}
+
+
 /**************************************************************************/
 /* Verifica version,next,checksum */
 /**************************************************************************/
-int mensajevalido(struct rcftp_msg recvbuffer) { 
+int mensajevalido(struct rcftp_msg *recvbuffer, int len) { 
 	int esperado=1;
 	//uint16_t aux;
 
-	if (recvbuffer.version!=RCFTP_VERSION_1) { // versión incorrecta
+	if ((recvbuffer->flags & F_FLUJO) && ((recvbuffer->version==RCFTP_VERSION_1) || (recvbuffer->version==RCFTP_VERSION_2))) {
+		; // next lleva el identificador de la transferencia
+	} else if (recvbuffer->version==RCFTP_VERSION_2) { // next lleva el tamaño de segmento propuesto
+		if ((ntohl(recvbuffer->next)==0) || (ntohs(recvbuffer->len)>ntohl(recvbuffer->next))) {
+			esperado=0;
+			fprintf(stderr,"Error: recibido un mensaje con NEXT incorrecto o mayor que el segmento negociado\n");
+		}
+	} else if (recvbuffer->version!=RCFTP_VERSION_1) { // versión incorrecta
 		esperado=0;
 		fprintf(stderr,"Error: recibido un mensaje con versión incorrecta\n");
-	}
-	if (recvbuffer.next!=0) { // next incorrecto
+	} else if (recvbuffer->next!=0) { // next incorrecto
 		esperado=0;
 		fprintf(stderr,"Error: recibido un mensaje con NEXT incorrecto\n");
 	}
-	if (issumvalid(&recvbuffer,sizeof(recvbuffer))==0) { // checksum incorrecto
+	if (issumvalid(recvbuffer,len)==0) { // checksum incorrecto
 		esperado=0;
 		fprintf(stderr,"Error: recibido un mensaje con checksum incorrecto\n"); /* (esperaba ");
 		aux=recvbuffer.sum;
@@ -728,7 +1731,7 @@ int mensajevalido(struct rcftp_msg recvbuffer) {
 /**************************************************************************/
 /* Responde BUSY a otro interlocutor */
 /**************************************************************************/
-void responderbusy(int s, struct sockaddr_storage remote,socklen_t remotelen,unsigned int flags) {
+void responderbusy(int s, struct sockaddr_storage remote,socklen_t remotelen,unsigned int flags,char compacto) {
 	struct rcftp_msg sendbuffer;
 
 	// empezamos a construir el mensaje
@@ -737,11 +1740,11 @@ void responderbusy(int s, struct sockaddr_storage remote,socklen_t remotelen,uns
 	// longitud=adddata(); // nunca respondemos con datos
 	sendbuffer.len=htons(0);
 	sendbuffer.next=htonl(0);
-	sendbuffer.flags=F_BUSY;  
+	sendbuffer.flags=compacto?(F_BUSY|F_COMPACTO):F_BUSY;
 	sendbuffer.sum=0;
-	sendbuffer.sum=xsum((char*)&sendbuffer,sizeof(sendbuffer));
+	sendbuffer.sum=xsum((char*)&sendbuffer,rcftp_msglen(&sendbuffer));
 
-	enviamensaje(s,sendbuffer,remote,remotelen,flags);
+	enviamensaje(s,&sendbuffer,remote,remotelen,flags,compacto);
 }
 
 /**************************************************************************/
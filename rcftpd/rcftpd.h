@@ -36,12 +36,25 @@
 #define ERR_FREQ 5 /**< Inversa de la tasa de error */
 /** @} */
 
+/* sesiones simultáneas (-m) */
+#define MAXSESIONES 512 /**< Número máximo de clientes atendidos a la vez con -m */
+#define CUBETAS 256 /**< Cubetas de la tabla de sesiones (potencia de 2) */
+#define INACTIVIDAD 60000000 /**< Tiempo sin recibir nada tras el que se abandona una sesión con -m, en microsegundos */
+
+/* hilos trabajadores (-n), cada uno con su socket en el mismo puerto (SO_REUSEPORT) */
+#define MAXHILOS 64 /**< Número máximo de hilos trabajadores */
+
+/* confirmaciones retardadas (-d): una respuesta por cada varios mensajes en orden */
+#define ACUMULAR 2 /**< Mensajes en orden confirmados con una sola respuesta si se indica -d sin valor */
+
 /* máximo número de mensajes pendientes de enviar */
 /* - la ventana de emisión por defecto del cliente es 2048 B; 4 mensajes */
 /* - el tiempo de transmisión por defecto del cliente es 200 ms */
 /* - el RTT simulador por defecto es 900 ms */
 /* - tamaño de ventana WINDOWSIZE=w=900/200=5 */
-#define WINDOWSIZE 10 /**< Número máximo de mensajes pendientes de enviar */
+/* - el cliente envía ráfagas de hasta 8 mensajes con una sola llamada, */
+/*   que llegan a la vez y se suman a las respuestas aún pendientes */
+#define WINDOWSIZE 32 /**< Número máximo de mensajes pendientes de enviar */
 
 /* Flags del programa */
 /** @{ */
@@ -50,8 +63,185 @@
 #define F_SALSA		0x2	/**< Flag para generar respuestas incorrectas y descartando mensajes recibidos */
 #define F_FUNKY		0x4	/**< F_SALSA + puede no responder o duplicar mensaje */
 #define F_ROCKNROLL	0x8 /**< F_FUNKY + cualquier error, con/sin descartar mensajes recibidos */
+#define F_SELREPEAT	0x10 /**< Almacena mensajes fuera de orden (repetición selectiva) */
+#define F_GRO		0x20 /**< Recibe datagramas agrupados por el kernel (UDP GRO) */
+#define F_MULTI		0x40 /**< Atiende a varios clientes a la vez, cada uno en su sesión */
+#define F_MAPEO		0x80 /**< Escribe con mmap los ficheros cuyo tamaño anuncia el cliente (F_TAMANO) */
+/** @} */
+
+/* máximo número de rangos separados de datos recibidos (en repetición selectiva, con huecos) */
+#define MAXINTERVALOS 32 /**< Número máximo de rangos de datos recibidos separados por huecos */
+
+/**
+ * Rango de números de secuencia [inicio,fin) (host order)
+ */
+struct intervalo {
+	uint32_t inicio; /**< Primer número de secuencia del rango */
+	uint32_t fin; /**< Número de secuencia siguiente al último del rango */
+};
+
+/**
+ * Conjunto de rangos de datos ya escritos en el fichero, ordenados, sin solaparse y sin
+ * tocarse (los contiguos se unen). Cabe uno más que MAXINTERVALOS para poder partir uno al quitar.
+ */
+struct intervalos {
+	struct intervalo r[MAXINTERVALOS+1]; /**< Rangos, en orden creciente */
+	int n; /**< Número de rangos */
+};
+
+/* tipos de timer de una sesión */
+/** @{ */
+#define T_ENVIO 0 /**< Vence el retardo simulado de una respuesta planificada */
+#define T_ACK 1 /**< Vence el plazo de una confirmación retardada */
+#define T_INACTIVIDAD 2 /**< Comprobación de inactividad del cliente */
+/** @} */
+
+/* escritor asíncrono: el bucle de recepción encola los datos y un hilo los escribe en disco */
+#define ESCRITOR_ENTRADAS 4096 /**< Escrituras encoladas como máximo (potencia de 2) */
+#define ESCRITOR_DATOS (4*1024*1024) /**< Bytes de datos encolados como máximo */
+#define ESCRITOR_IOV 64 /**< Escrituras contiguas agrupadas como máximo en un solo pwritev */
+#define SINCRONIZAR (1024*1024) /**< Bytes contiguos escritos en memoria (F_MAPEO) tras los que se empieza a pasarlos a disco */
+
+/* tipos de escritura encolada */
+/** @{ */
+#define ESC_DATOS 0 /**< Escribir datos */
+#define ESC_CERRAR 1 /**< Cerrar el fichero tras las escrituras anteriores */
+#define ESC_SINCRONIZAR 2 /**< Empezar a pasar a disco un rango escrito en memoria (mmap), sin esperar */
+/** @} */
+
+/**
+ * Fichero de salida de una sesión: los datos con número de secuencia n van en la posición n
+ * del fichero (en un flujo con F_FLUJO, numseq ya es la posición), estén o no en orden
+ */
+struct salida {
+	int fd; /**< Descriptor del fichero */
+	struct intervalos recibidos; /**< Datos escritos (encolados) y aceptados; simular una pérdida los quita */
+	uint8_t *mapa; /**< Fichero proyectado en memoria (F_MAPEO y tamaño anunciado), o NULL: escribir con el escritor */
+	uint32_t tamano; /**< Bytes proyectados */
+	uint32_t sincronizado; /**< Hasta dónde se ha pedido pasar a disco lo recibido de forma contigua */
+	int *error; /**< errno de la primera escritura fallida del hilo escritor, o 0 (lo libera el escritor al cerrar el fichero) */
+};
+
+/**
+ * Escritura encolada para el hilo escritor
+ */
+struct escritura {
+	int fd; /**< Descriptor del fichero */
+	int *error; /**< Dónde avisar a la sesión si la escritura falla */
+	char tipo; /**< ESC_DATOS, ESC_CERRAR o ESC_SINCRONIZAR */
+	uint32_t len; /**< Longitud de los datos (o del rango a sincronizar) */
+	off_t pos; /**< Posición del fichero en la que escribirlos */
+	uint64_t datos; /**< Posición de los datos en el anillo (contador, sin aplicar el módulo) */
+	uint64_t fin; /**< Bytes del anillo ocupados hasta esta escritura incluida (para liberarlos) */
+};
+
+/**
+ * Cola de escrituras de un productor (el bucle de recepción) a un consumidor (el hilo
+ * escritor), sin bloqueos: cada índice lo modifica solo uno de los dos. Los datos se copian
+ * a un anillo de bytes, cada escritura contigua (si no cabe al final, empieza al principio).
+ */
+struct escritor {
+	struct escritura entradas[ESCRITOR_ENTRADAS]; /**< Escrituras, en una cola circular */
+	uint8_t *datos; /**< Anillo de ESCRITOR_DATOS bytes con los datos de las escrituras */
+	unsigned int cabeza; /**< Escrituras encoladas (solo la modifica el productor) */
+	unsigned int cola; /**< Escrituras hechas (solo la modifica el escritor) */
+	uint64_t producidos; /**< Bytes del anillo ocupados desde el inicio (solo productor) */
+	uint64_t liberados; /**< Bytes del anillo liberados desde el inicio (solo escritor) */
+	char terminar; /**< El escritor termina al vaciar la cola */
+	sem_t avisos; /**< Un aviso por escritura encolada, para que el escritor no espere activamente */
+	pthread_t hilo; /**< Hilo escritor */
+};
+
+/* estados de una sesión */
+/** @{ */
+#define SES_ACTIVA 0 /**< Atendiendo al cliente */
+#define SES_FINALIZADA 1 /**< F_FIN confirmado: cerrar la sesión */
+#define SES_ABORTADA 2 /**< F_ABORT transmitido: cerrar la sesión */
+#define SES_ERROR 3 /**< El cliente ha desbordado al servidor: cerrar la sesión */
 /** @} */
 
+struct sesion;
+
+/**
+ * Dato asociado a los timers de una sesión (addtimer), para saber a qué corresponden al vencer
+ */
+struct temporizador {
+	struct sesion *sesion; /**< Sesión del timer */
+	int tipo; /**< T_ENVIO, T_ACK o T_INACTIVIDAD */
+};
+
+/**
+ * Estado de la comunicación con un cliente
+ *
+ * Las respuestas solo llevan cabeceras y bloques SACK, así que la cola y la respuesta
+ * retenida guardan RCFTP_FIXEDLEN bytes por mensaje, no un struct rcftp_msg completo.
+ */
+struct sesion {
+	struct sockaddr_storage peer; /**< Dirección del cliente */
+	socklen_t peerlen; /**< Longitud de la dirección del cliente */
+	unsigned int numero; /**< Número de sesión (con -m, sufijo del fichero recibido) */
+	char estado; /**< SES_ACTIVA, SES_FINALIZADA, SES_ABORTADA o SES_ERROR */
+	struct salida salida; /**< Fichero en el que escribir los datos recibidos */
+	uint32_t inicio; /**< Posición en el fichero del primer byte (0 salvo en un flujo con F_FLUJO) */
+	uint32_t next_valido; /**< Next válido (correcto en el servidor) */
+	int error; /**< Último error simulado (en F_SALSA/F_FUNKY se repite hasta avanzar) */
+	char compacto; /**< Responder en formato compacto (como el último mensaje del cliente) */
+	uint8_t version; /**< Responder en la versión del último mensaje del cliente */
+	struct timeval horainicio; /**< Hora del primer mensaje, para el resumen final */
+	uint8_t cola[WINDOWSIZE][RCFTP_FIXEDLEN]; /**< Respuestas planificadas, en una cola circular */
+	int error_win[WINDOWSIZE]; /**< Error simulado de cada respuesta planificada */
+	int timers[WINDOWSIZE]; /**< Timer del retardo de cada respuesta planificada */
+	unsigned int firstmsg; /**< Primera respuesta planificada */
+	unsigned int lastmsg; /**< Siguiente posición libre de la cola */
+	int vencidos; /**< Respuestas cuyo retardo ha vencido, pendientes de enviar */
+	char pendiente; /**< En la lista de sesiones a atender tras los timers */
+	uint64_t ultimovencimiento; /**< Vencimiento (us) de la última respuesta planificada */
+	uint8_t retenida[RCFTP_FIXEDLEN]; /**< Última respuesta retenida (confirmaciones retardadas) */
+	int retenidas; /**< Respuestas retenidas desde la última enviada */
+	int timerack; /**< Plazo de la respuesta retenida, o -1 */
+	uint64_t ultimarecepcion; /**< Hora (us) del último mensaje recibido */
+	int timerinactividad; /**< Timer de inactividad, o -1 */
+	struct temporizador tenvio; /**< Dato de los timers T_ENVIO */
+	struct temporizador tack; /**< Dato del timer T_ACK */
+	struct temporizador tinactividad; /**< Dato del timer T_INACTIVIDAD */
+	struct sesion *siguiente; /**< Siguiente sesión de la misma cubeta */
+};
+
+/**
+ * Tabla de sesiones abiertas, por dirección del cliente
+ */
+struct tablasesiones {
+	struct sesion *cubetas[CUBETAS]; /**< Listas de sesiones, por hash de la dirección */
+	int n; /**< Sesiones abiertas */
+};
+
+/**
+ * Parámetros de un hilo trabajador (-n): atiende a los clientes que el kernel reparte a su socket
+ */
+struct trabajador {
+	pthread_t hilo; /**< Hilo que ejecuta process_requests */
+	int s; /**< Socket propio, asociado al puerto común con SO_REUSEPORT */
+	unsigned int semilla; /**< Semilla de sus números aleatorios */
+	unsigned int progflags; /**< Flags del programa */
+	unsigned long ttrans; /**< Tiempo de transmisión a simular, en microsegundos */
+	unsigned long tprop; /**< Tiempo de propagación a simular, en microsegundos */
+	int error_frequency; /**< Inversa de la tasa de errores a generar */
+	int acumular; /**< Mensajes en orden a confirmar con una sola respuesta */
+};
+
+/* máximo número de mensajes recibidos con una sola llamada al sistema */
+#define MAXRAFAGA 16 /**< Número máximo de mensajes por ráfaga (recvmmsg) */
+
+/**
+ * Mensaje recibido dentro de una ráfaga
+ */
+struct recibido {
+	struct rcftp_msg msg; /**< Mensaje recibido */
+	ssize_t len; /**< Tamaño recibido */
+	struct sockaddr_storage remote; /**< Dirección de la que hemos recibido */
+	socklen_t remotelen; /**< Longitud de la dirección de la que hemos recibido */
+};
+
 /* defines para la salida del programa */
 /** @{ */
 #define S_OK 0 /**< Flag de salida correcta */
@@ -108,8 +298,10 @@
  * @param[out] ttrans Tiempo de transmisión a simular, en microsegundos
  * @param[out] tprop Tiempo de propagación a simular, en microsegundos
  * @param[out] error_frequency Inversa de la tasa de errores a generar (si hay que generar errores)
+ * @param[out] acumular Mensajes en orden a confirmar con una sola respuesta (1: responder a todos)
+ * @param[out] hilos Hilos trabajadores (1: atender en el hilo principal)
  */
-void initargs(int argc, char **argv, unsigned int *flags, char** port, unsigned long *ttrans, unsigned long *tprop, int *error_frequency);
+void initargs(int argc, char **argv, unsigned int *flags, char** port, unsigned long *ttrans, unsigned long *tprop, int *error_frequency, int *acumular, int *hilos);
 
 /**
  * Imprime un resumen del uso del programa
@@ -123,20 +315,127 @@ void printuso(char *progname);
  * Inicializa el servidor en el socket
  *
  * @param[in] port String con el servicio o número de puerto
+ * @param[in] compartido Distinto de 0 para permitir que otros sockets se asocien al mismo puerto
+ *   (SO_REUSEPORT): el kernel reparte los clientes entre ellos según su dirección
  * @return El descriptor de socket UDP abierto
  */
-int start_server(char* port);
+int start_server(char* port, int compartido);
 
 /**
- * Manejo de los mensajes de un cliente hasta confirmar el último
+ * Manejo de los mensajes de los clientes. Sin F_MULTI, atiende a un único cliente (a los
+ * demás les responde F_BUSY) hasta confirmar su último mensaje; con F_MULTI, atiende a
+ * varios a la vez, cada uno en su sesión, y no termina.
  *
  * @param[in] s	Socket UDP del que esperar mensajes
  * @param[in] flags Flags del programa a tener en cuenta en la ejecución
  * @param[in] ttrans Tiempo de transmisión a simular, en microsegundos
  * @param[in] tprop Tiempo de propagación a simular, en microsegundos
  * @param[in] error_frequency Inversa de la tasa de errores a generar (si hay que generar errores)
+ * @param[in] acumular Mensajes en orden a confirmar con una sola respuesta (1: responder a todos).
+ *   La respuesta se retiene como mucho 2*ttrans, y nunca si hay huecos, flags o errores.
+ */
+void process_requests(int s, unsigned int flags, unsigned long ttrans, unsigned long tprop, int error_frequency, int acumular);
+
+/**
+ * Cuerpo de un hilo trabajador: atiende con process_requests los mensajes de su socket,
+ * con sus propias sesiones y timers (no comparte estado con los demás hilos)
+ *
+ * @param[in] arg Parámetros del hilo (struct trabajador)
+ * @return No termina
+ */
+void *trabajador(void *arg);
+
+/**
+ * Procesa un mensaje de un cliente: escribe sus datos, construye la respuesta (con el error
+ * simulado que toque) y la planifica o la retiene
+ *
+ * @param[in,out] ses Sesión del cliente
+ * @param[in] recvbuffer Mensaje recibido (de longitud válida)
+ * @param[in] recvsize Longitud recibida
+ * @param[in] progflags Flags del programa
+ * @param[in] ttrans Tiempo de transmisión a simular, en microsegundos
+ * @param[in] tprop Tiempo de propagación a simular, en microsegundos
+ * @param[in] error_frequency Inversa de la tasa de errores a generar
+ * @param[in] acumular Mensajes en orden a confirmar con una sola respuesta
+ * @return S_OK, o S_CLIERROR si el cliente ha fallado (hay que cerrar la sesión)
+ */
+int procesarmensaje(struct sesion *ses, struct rcftp_msg *recvbuffer, ssize_t recvsize, unsigned int progflags,
+		unsigned long ttrans, unsigned long tprop, int error_frequency, int acumular);
+
+/**
+ * Planifica el envío de una respuesta tras el retardo simulado (Ttrans+2Tprop, y como pronto
+ * Ttrans después de la anterior), copiándola a la cola de la sesión
+ *
+ * @param[in,out] ses Sesión del cliente
+ * @param[in] mensaje Respuesta a enviar
+ * @param[in] error Error simulado en la respuesta (para mostrarlo al enviarla)
+ * @param[in] ttrans Tiempo de transmisión a simular, en microsegundos
+ * @param[in] tprop Tiempo de propagación a simular, en microsegundos
+ * @param[in] progflags Flags del programa
+ * @return 1: planificada; 0: cola o timers desbordados (el cliente desborda al servidor)
+ */
+int planificarenvio(struct sesion *ses, struct rcftp_msg *mensaje, int error, unsigned long ttrans, unsigned long tprop, unsigned int progflags);
+
+/**
+ * Envía con una sola llamada las respuestas de una sesión cuyo retardo ha vencido, y
+ * actualiza su estado si se transmite F_FIN o F_ABORT
+ *
+ * @param[in] s Socket UDP
+ * @param[in,out] ses Sesión del cliente
+ * @param[in] progflags Flags del programa
+ */
+void enviarvencidos(int s, struct sesion *ses, unsigned int progflags);
+
+/**
+ * Devuelve la hora actual de un reloj monotónico
+ *
+ * @return Hora en microsegundos
+ */
+uint64_t ahorausec();
+
+/**
+ * Calcula la cubeta de la tabla de sesiones que corresponde a una dirección (hash FNV-1a)
+ *
+ * @param[in] remote Dirección del cliente
+ * @param[in] remotelen Longitud de la dirección
+ * @return Cubeta, entre 0 y CUBETAS-1
+ */
+unsigned int cubetasesion(struct sockaddr_storage *remote, socklen_t remotelen);
+
+/**
+ * Busca la sesión de un cliente por su dirección
+ *
+ * @param[in] tabla Tabla de sesiones
+ * @param[in] remote Dirección del cliente
+ * @param[in] remotelen Longitud de la dirección
+ * @return Sesión del cliente, o NULL si no tiene
  */
-void process_requests(int s, unsigned int flags, unsigned long ttrans, unsigned long tprop, int error_frequency);
+struct sesion *buscarsesion(struct tablasesiones *tabla, struct sockaddr_storage *remote, socklen_t remotelen);
+
+/**
+ * Abre una sesión para un cliente nuevo, con su fichero de salida ("f_recibido" sin F_MULTI,
+ * "f_recibido.<número>" con F_MULTI). Si el primer mensaje lleva F_FLUJO, la sesión es un flujo de
+ * una transferencia en paralelo: empieza en su numseq y escribe en "f_recibido.t<identificador>" (en hexadecimal),
+ * compartido con los demás flujos de la transferencia, en su posición y sin truncarlo.
+ *
+ * @param[in,out] tabla Tabla de sesiones
+ * @param[in] remote Dirección del cliente
+ * @param[in] remotelen Longitud de la dirección
+ * @param[in] primero Primer mensaje recibido del cliente
+ * @param[in] progflags Flags del programa
+ * @return Sesión abierta, o NULL si no se ha podido abrir el fichero (solo con F_MULTI)
+ */
+struct sesion *nuevasesion(struct tablasesiones *tabla, struct sockaddr_storage *remote, socklen_t remotelen,
+		struct rcftp_msg *primero, unsigned int progflags);
+
+/**
+ * Cierra una sesión: muestra el resumen, cancela sus timers, cierra el fichero y la libera
+ *
+ * @param[in,out] tabla Tabla de sesiones
+ * @param[in] ses Sesión a cerrar
+ * @param[in] progflags Flags del programa
+ */
+void cerrarsesion(struct tablasesiones *tabla, struct sesion *ses, unsigned int progflags);
 
 /**
  * Imprime el otro extremo del socket
@@ -174,31 +473,183 @@ int generar_mensaje_erroneo(struct rcftp_msg *sendbuffer, unsigned int flags, in
  * @param[in] numseq Número de secuencia del mensaje (host order)
  * @param[in] len Longitud del buffer del mensaje (host order)
  * @param[in] buffer Buffer de datos recibidos
- * @param[in] fsalida Fichero al que escribir los datos
- * @param[in,out] flags Flags: se añadirá F_ABORT si no se puede escribir en fichero
- * @param[in] prgflags Flags del programa
+ * @param[in,out] salida Fichero al que escribir los datos y rangos ya recibidos
+ * @param[in,out] flags Flags de la respuesta
+ * @param[in] prgflags Flags del programa (con F_SELREPEAT se aceptan datos fuera de orden)
  * @return Next expected (host order)
  */
 uint32_t calcnextexpected(uint32_t oldexpected, uint32_t numseq, uint16_t len, 
-		uint8_t* buffer, FILE *fsalida, uint8_t *flags, unsigned int prgflags);
+		uint8_t* buffer, struct salida *salida, uint8_t *flags, unsigned int prgflags);
+
+/**
+ * Encola para el hilo escritor unos datos en su posición del fichero (su número de secuencia),
+ * o los copia en ella si el fichero está proyectado en memoria, y los añade a los recibidos.
+ * Si la cola o el conjunto de rangos están llenos no espera: los datos no se aceptan (ni se
+ * encolan) y el cliente tendrá que reenviarlos. Solo se anotan, y por tanto se confirman,
+ * los datos ya encolados o copiados.
+ *
+ * @param[in] numseq Número de secuencia del primer byte (host order)
+ * @param[in] buffer Datos a escribir
+ * @param[in] len Longitud de los datos
+ * @param[in,out] salida Fichero al que escribir los datos y rangos ya recibidos
+ * @return 1: datos aceptados; 0: no aceptados
+ */
+int escribirdatos(uint32_t numseq, uint8_t* buffer, uint16_t len, struct salida *salida);
+
+/**
+ * Crea la cola y el hilo escritor del hilo que la llama (cada hilo trabajador tiene los suyos)
+ */
+void iniciarescritor();
+
+/**
+ * Espera a que el hilo escritor del hilo que la llama termine las escrituras encoladas, y lo libera
+ */
+void terminarescritor();
+
+/**
+ * Encola una escritura para el hilo escritor (sin bloquearse). Si falla, el escritor lo anota
+ * en salida->error, y la sesión aborta.
+ *
+ * @param[in] salida Fichero de salida de la sesión
+ * @param[in] pos Posición del fichero en la que escribir
+ * @param[in] buffer Datos a escribir (se copian)
+ * @param[in] len Longitud de los datos
+ * @return 1: encolada; 0: cola llena
+ */
+int encolarescritura(struct salida *salida, off_t pos, uint8_t *buffer, uint32_t len);
+
+/**
+ * Encola el cierre de un fichero, que el escritor hará tras sus escrituras pendientes.
+ * Solo espera (sin tocar el disco) si la cola está completamente llena. El escritor libera
+ * entonces salida->error.
+ *
+ * @param[in] salida Fichero de salida de la sesión
+ */
+void encolarcierre(struct salida *salida);
+
+/**
+ * Encola la petición de empezar a pasar a disco un rango de un fichero proyectado en memoria.
+ * Es solo una ayuda al kernel: si la cola está llena, no se encola.
+ *
+ * @param[in] salida Fichero de salida de la sesión
+ * @param[in] pos Posición del primer byte
+ * @param[in] len Longitud del rango
+ */
+void encolarsincronizacion(struct salida *salida, off_t pos, uint32_t len);
+
+/**
+ * Reserva el fichero de una sesión con el tamaño anunciado por el cliente (F_TAMANO) y lo
+ * proyecta en memoria, para copiar los datos directamente en él. Lo escrito antes por el
+ * escritor sigue siendo válido (mmap y pwrite comparten la caché de páginas).
+ *
+ * @param[in,out] salida Fichero de la sesión
+ * @param[in] tamano Tamaño total del fichero
+ * @param[in] inicio Primer byte que recibe la sesión (el de su rango en un flujo)
+ * @param[in] progflags Flags del programa
+ * @return 1: proyectado; 0: se sigue escribiendo con el escritor
+ */
+int mapearsalida(struct salida *salida, uint32_t tamano, uint32_t inicio, unsigned int progflags);
+
+/**
+ * Cuerpo del hilo escritor: agrupa las escrituras contiguas de un mismo fichero en un solo pwritev
+ *
+ * @param[in] arg Cola de escrituras (struct escritor)
+ * @return NULL al terminar
+ */
+void *escritor(void *arg);
+
+/**
+ * Añade un rango a un conjunto, uniéndolo con los que solape o toque
+ *
+ * @param[in,out] iv Conjunto de rangos
+ * @param[in] inicio Primer número de secuencia del rango
+ * @param[in] fin Número de secuencia siguiente al último del rango
+ * @return 1: añadido (o ya estaba); 0: no cabe (ya hay MAXINTERVALOS rangos separados), sin cambios
+ */
+int anadirintervalo(struct intervalos *iv, uint32_t inicio, uint32_t fin);
+
+/**
+ * Comprueba, sin modificarlo, si un rango se podría añadir a un conjunto
+ *
+ * @param[in] iv Conjunto de rangos
+ * @param[in] inicio Primer número de secuencia del rango
+ * @param[in] fin Número de secuencia siguiente al último del rango
+ * @return 1: anadirintervalo lo aceptaría; 0: no cabe
+ */
+int cabeintervalo(struct intervalos *iv, uint32_t inicio, uint32_t fin);
+
+/**
+ * Quita un rango de un conjunto, recortando o partiendo los rangos que solape
+ *
+ * @param[in,out] iv Conjunto de rangos
+ * @param[in] inicio Primer número de secuencia a quitar
+ * @param[in] fin Número de secuencia siguiente al último a quitar
+ */
+void quitarintervalo(struct intervalos *iv, uint32_t inicio, uint32_t fin);
+
+/**
+ * Calcula hasta dónde llegan los datos recibidos de forma contigua a partir de un número de secuencia
+ *
+ * @param[in] iv Conjunto de rangos
+ * @param[in] desde Número de secuencia desde el que contar
+ * @return Fin del rango que contiene desde, o desde si no está en ninguno
+ */
+uint32_t finintervalo(struct intervalos *iv, uint32_t desde);
+
+/**
+ * Escribe en buffer un bloque SACK por cada rango de datos recibido por encima de
+ * nextexpected. El rango que contiene el mensaje recién recibido va el primero.
+ * Caben todos: MAXINTERVALOS bloques ocupan menos de RCFTP_BUFLEN bytes.
+ *
+ * @param[in] iv Rangos de datos recibidos
+ * @param[in] nextexpected Next expected actual
+ * @param[in] reciente Número de secuencia del mensaje recién recibido (host order)
+ * @param[out] buffer Buffer de datos de la respuesta
+ * @return Bytes escritos en buffer (0 si no hay nada almacenado)
+ */
+int bloquessack(struct intervalos *iv, uint32_t nextexpected, uint32_t reciente, uint8_t *buffer);
 
 /** Envía un mensaje a la dirección especificada
  *
  * @param[in] s Socket
- * @param[in] sendbuffer Mensaje a enviar
+ * @param[in,out] sendbuffer Mensaje a enviar (en formato fijo se ponen a 0 los bytes de buffer a partir de len)
  * @param[in] remote Dirección a la que enviar
  * @param[in] remotelen Longitud de la dirección especificada
  * @param[in] flags Flags del programa
+ * @param[in] compacto 1: enviar solo cabeceras y datos válidos; 0: formato fijo de RCFTP_FIXEDLEN bytes
  */
-void enviamensaje(int s,struct rcftp_msg sendbuffer, struct sockaddr_storage remote, socklen_t remotelen, unsigned int flags);
+void enviamensaje(int s,struct rcftp_msg *sendbuffer, struct sockaddr_storage remote, socklen_t remotelen, unsigned int flags, char compacto);
+
+/** Envía varios mensajes a la dirección especificada, con una sola llamada (sendmmsg) en GNU/Linux
+ *
+ * @param[in] s Socket
+ * @param[in,out] mensajes Mensajes a enviar, en orden (en formato fijo se ponen a 0 los bytes de buffer a partir de len)
+ * @param[in] n Número de mensajes (no más de WINDOWSIZE)
+ * @param[in] remote Dirección a la que enviar
+ * @param[in] remotelen Longitud de la dirección especificada
+ * @param[in] flags Flags del programa
+ * @param[in] compacto 1: enviar solo cabeceras y datos válidos; 0: formato fijo de RCFTP_FIXEDLEN bytes
+ */
+void enviamensajes(int s, struct rcftp_msg **mensajes, int n, struct sockaddr_storage remote, socklen_t remotelen, unsigned int flags, char compacto);
+
+/**
+ * Determina el formato en el que envía el cliente: compacto si lo indica con F_COMPACTO o si
+ * el mensaje no mide RCFTP_FIXEDLEN bytes; si no, el formato fijo original
+ *
+ * @param[in] recvbuffer Mensaje recibido
+ * @param[in] recvsize Longitud recibida del mensaje
+ * @return 1: formato compacto; 0: formato fijo
+ */
+int esformatocompacto(struct rcftp_msg *recvbuffer, ssize_t recvsize);
 
 /**
  * Determina si un mensaje es válido o no
  *
  * @param[in] recvbuffer Mensaje a comprobar
+ * @param[in] len Longitud recibida del mensaje
  * @return 1: es el esperado; 0: no es el esperado
  */
-int mensajevalido(struct rcftp_msg recvbuffer); 
+int mensajevalido(struct rcftp_msg *recvbuffer, int len); 
 
 
 /**
@@ -208,8 +659,9 @@ int mensajevalido(struct rcftp_msg recvbuffer);
  * @param[in] remote Dirección a la que enviar
  * @param[in] remotelen Longitud de la dirección especificada
  * @param[in] flags Flags del programa
+ * @param[in] compacto 1: responder en formato compacto; 0: formato fijo
  */
-void responderbusy(int s, struct sockaddr_storage remote,socklen_t remotelen,unsigned int flags);
+void responderbusy(int s, struct sockaddr_storage remote,socklen_t remotelen,unsigned int flags,char compacto);
 
 /**
  * Devuelve una cadena de descripción del error
@@ -220,16 +672,36 @@ void responderbusy(int s, struct sockaddr_storage remote,socklen_t remotelen,uns
 char* strerrorrcftpd(int error);
 
 /**
- * Recibe un mensaje (y hace las verificaciones de error oportunas) 
+ * Recibe los mensajes disponibles, hasta n, con una sola llamada (recvmmsg) en GNU/Linux
+ * (y hace las verificaciones de error oportunas)
+ *
+ * @param[in] socket Descriptor de socket (no bloqueante)
+ * @param[out] rafaga Espacio donde almacenar los mensajes recibidos, con su tamaño y remitente
+ * @param[in] n Número máximo de mensajes a recibir (no más de MAXRAFAGA)
+ * @param[in] gro Distinto de 0 si el socket tiene activado UDP GRO (ver recibiragrupados)
+ * @return Número de mensajes recibidos (0 si no había ninguno)
+ */
+int recibirmensajes(int socket, struct recibido *rafaga, int n, unsigned int gro);
+
+/**
+ * Activa en el socket la recepción de datagramas agrupados por el kernel (UDP GRO, GNU/Linux)
+ *
+ * @param[in] s Socket
+ * @return 1 si se ha activado; 0 si no está disponible
+ */
+int activargro(int s);
+
+/**
+ * Recibe datagramas agrupados por el kernel (UDP GRO) y los separa en los mensajes
+ * que los forman, según el tamaño de segmento indicado por el kernel. Si un datagrama
+ * tiene más mensajes de los que caben en la ráfaga, el resto se devuelve en la siguiente llamada.
  *
- * @param[in] socket Descriptor de socket
- * @param[out] buffer Espacio donde almacenar lo recibido
- * @param[in] buflen Longitud del buffer
- * @param[out] remote Dirección de la que hemos recibido
- * @param[out] remotelen Longitud de la dirección de la que hemos recibido
- * @return Tamaño del mensaje recibido
+ * @param[in] socket Descriptor de socket (no bloqueante, con UDP GRO activado)
+ * @param[out] rafaga Espacio donde almacenar los mensajes recibidos, con su tamaño y remitente
+ * @param[in] n Número máximo de mensajes a devolver
+ * @return Número de mensajes devueltos (0 si no había ninguno)
  */
-ssize_t recibirmensaje(int socket, struct rcftp_msg *buffer, int buflen, struct sockaddr_storage *remote, socklen_t *remotelen);
+int recibiragrupados(int socket, struct recibido *rafaga, int n);
 
 /**
  * Muestra info y calcula el tiempo transcurrido y la velocidad efectiva aproximada 